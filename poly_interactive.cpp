@@ -58,27 +58,46 @@
  * '0' = reset all geometric transformations
  * '1' (+ 'z') + left mouse drag = translate upper light (spotlight facing down)
  * '2' (+ 'z') + left mouse drag = translate front light (point light)
+ * 'p' + left mouse click = pick the object and triangle under the mouse
+ * 'i' = toggle frame statistics (printed to the console once per second)
+ * 'm' = print the loaded meshes and the memory each one holds
  *
  */
 
 #ifdef _WIN32
+#include <GL/glew.h>
 #include <GL/glut.h>
 #pragma warning(disable:4996)
 // (or others, depending on the system in use)
 #else
+#define GL_GLEXT_PROTOTYPES
 #include <GLUT/glut.h>
 #endif
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <ctype.h>
 #include <math.h>
 #include <iostream>
 #include <string.h>
 #include <memory.h>
 
 #include <map>
+#include <set>
 #include <iostream>
 #include <cassert>
+#include <vector>
+#include <deque>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <sys/stat.h>
 
 #define PI 3.14159265
 
@@ -86,6 +105,19 @@
 #define WIDTH 1200
 
 void myMenu(int value);
+bool hasExtension(const char* file, const char* extension);
+void pickAtMouse(int x, int y, bool report);
+void updateStreamedMesh();
+void buildLightJobs();
+bool usesLightingProgram();
+void collectFrameLights();
+void jobCullLights(int i);
+void countCulledLights();
+void printAssets();
+void releaseAssets();
+void drawBox(const float* bmin, const float* bmax);
+void handleMenu(int value);
+void recordTraceEvent(int type, int a, int b, int c, int d, double time);
 
 static int EXIT_APP = 0;
 static int POLYGON_MODE_POINT = 1;
@@ -93,6 +125,11 @@ static int POLYGON_MODE_LINE = 2;
 static int POLYGON_MODE_FILL = 3;
 static int POLYGON_MODE_LINE_FILL = 4;
 static int OPTION_ROTATE_IDLE = 7;
+static int OPTION_OCCLUSION_CULLING = 32;
+static int OPTION_DYNAMIC_RESOLUTION = 33;
+static int OPTION_LIGHT_CULLING = 34;
+static int OPTION_SPOT_CONES = 35;
+static int OPTION_TWO_PASS_WIREFRAME = 36;
 
 static int MESH_BROTHER_BLENDER_BLACK = 9;
 static int MESH_BROTHER_BLENDER_WHITE = 8;
@@ -126,6 +163,9 @@ static int FRONT_LIGHT_TURQUOISE = 27;
 static int ORIGIN_VISIBLE = 28;
 static int ORIGIN_HIDDEN = 29;
 
+static int LIGHTING_FIXED_FUNCTION = 30;
+static int LIGHTING_PER_PIXEL = 31;
+
 int _polygon_render_mode = POLYGON_MODE_FILL;
 int _mesh_brother_color = MESH_BROTHER_BLENDER_BLACK;
 int _mesh_monkey_color = MESH_MONKEY_BLENDER_WHITE;
@@ -138,6 +178,7 @@ int _spotLightState = SPOT_LIGHT_ON;
 int _upper_light_color = UPPER_LIGHT_WHITE;
 int _front_light_color = FRONT_LIGHT_WHITE;
 int _origin_visibility = ORIGIN_HIDDEN;
+int _lighting_path = LIGHTING_FIXED_FUNCTION;
 
 static int menu_all;
 int subOption;
@@ -147,13 +188,21 @@ static int TRANSFORM_TRANSLATE = 2;
 static int TRANSFORM_ROTATE = 3;
 static int TRANSFORM_LIGHT1_TRANSLATE = 4;
 static int TRANSFORM_LIGHT0_TRANSLATE = 5;
+static int TRANSFORM_PICK = 6;
 
 int _transform_current = 0;
 int _mesh_current = 5;
 bool _idle_rotate_current = false;
+bool _occlusion_culling = true;
+bool _dynamic_resolution = false;
+bool _light_culling = true;
+bool _show_spot_cones = false;
+bool _two_pass_wireframe = false;
 
-int _current_height = HEIGHT;
-int _current_width = WIDTH;
+std::atomic<int> _current_height(HEIGHT);
+std::atomic<int> _current_width(WIDTH);
+int _render_width = WIDTH;
+int _render_height = HEIGHT;
 
 float _current_fov = 75.0;
 
@@ -202,24 +251,71 @@ typedef struct {
 	GLfloat* normal;
 } INT3VECTPLUS;
 
+typedef struct {
+	float bmin[3];
+	float bmax[3];
+	int first;
+	int count;
+} BVHNODE;
+
+typedef struct {
+	std::vector<BVHNODE> nodes;
+	std::vector<int> indices;
+	int depth;
+} BVH;
+
+/* GL_N3F_V3F streams built at load time, see buildMeshStreams() */
+typedef struct {
+	std::vector<float> flat;
+	std::vector<float> smooth;
+	std::vector<unsigned int> indices;
+	std::vector<float> centers;
+	std::vector<float> points;
+	GLuint flatBuffer;
+	GLuint smoothBuffer;
+	GLuint indexBuffer;
+	GLuint wireBuffer;
+	GLuint pointBuffer;
+	int triangles;
+	int vertices;
+	int smoothVertices;
+	double ms;
+	bool uploaded;
+} MESHSTREAMS;
+
 typedef struct {
 	int nv;
 	int nf;
 	FLTVECTPLUS *vertex;
 	INT3VECTPLUS *face;
+	float bmin[3];
+	float bmax[3];
+	BVH* bvh;
+	MESHSTREAMS* streams;
 } SurFaceMesh;
 
 typedef struct {
 	int count;
 	TRIANGLEPLUS * list;
+	float bmin[3];
+	float bmax[3];
+	BVH* bvh;
+	MESHSTREAMS* streams;
 } RawMesh;
 
+typedef struct {
+	GLfloat emission[4];
+	GLfloat ambient[4];
+	GLfloat diffuse[4];
+	GLfloat specular[4];
+	GLfloat shininess;
+} MATERIAL;
+
 SurFaceMesh * _surfmesh;
 
 RawMesh * _brother_blender_mesh;
 RawMesh * _blender_monkey_mesh;
 RawMesh * _room_walls_mesh;
-RawMesh * _scene_mesh;
 RawMesh * _tables_mesh;
 RawMesh * _lamp_bases_mesh;
 RawMesh * _lamp_point_mesh;
@@ -227,6 +323,9 @@ RawMesh * _lamp_spotlight_mesh;
 
 bool _fullscreen = false;
 bool _mouseDown = false;
+bool _stats_enabled = false;
+/* --bench-scene runs the frame jobs without a window or GL context */
+bool _headless = false;
 
 float _xtransform = 0.0f;
 float _ytransform = 0.0f;
@@ -246,6 +345,54 @@ float _radius_diff_scale = 1.0f;
 float _xgrid_mouse = 0.0f;
 float _ygrid_mouse = 0.0f;
 
+int _pick_x = 0;
+int _pick_y = 0;
+bool _pick_report = false;
+unsigned int _pick_sequence = 0;
+double _input_time = 0.0;
+int _input_events = 0;
+
+/*
+ * What the renderer sees of the user's input: the transformations, the
+ * light positions and the menu modes. The globals above are owned by the
+ * input thread once it runs; display() reads only the immutable copy in
+ * _view, see publishViewState().
+ */
+typedef struct {
+	float rotate[3];
+	float translate[3];
+	float scale;
+	float light0[4];
+	float light1[4];
+	int polygonMode;
+	int brotherColor;
+	int monkeyColor;
+	int sampleMaterial;
+	int wallsMode;
+	int shadingModel;
+	int pointLight;
+	int spotLight;
+	int upperLightColor;
+	int frontLightColor;
+	int origin;
+	int lightingPath;
+	bool occlusionCulling;
+	bool dynamicResolution;
+	bool lightCulling;
+	bool spotCones;
+	bool twoPassWireframe;
+	int pickX;
+	int pickY;
+	bool pickReport;
+	unsigned int pickSequence;
+	double inputTime;
+	int events;
+	unsigned int sequence;
+} VIEWSTATE;
+
+VIEWSTATE _view_buffers[3];
+const VIEWSTATE* _view = &_view_buffers[0];
+
 void resetTransformations() {
 	_xdiff_rotate = 0.0f;
 	_ydiff_rotate = 0.0f;
@@ -266,6 +413,7 @@ void myCreateMenu() {
 	glutAddMenuEntry("Polygon Line Mode", POLYGON_MODE_LINE);
 	glutAddMenuEntry("Polygon Fill Mode", POLYGON_MODE_FILL);
 	glutAddMenuEntry("Polygon Line and Fill Mode", POLYGON_MODE_LINE_FILL);
+	glutAddMenuEntry("Two Pass Line and Fill", OPTION_TWO_PASS_WIREFRAME);
 
 	int brother_blender = glutCreateMenu(myMenu);
 	glutAddMenuEntry("Black", MESH_BROTHER_BLENDER_BLACK);
@@ -309,6 +457,10 @@ void myCreateMenu() {
 	glutAddMenuEntry("Hidden", ORIGIN_HIDDEN);
 	glutAddMenuEntry("Visible", ORIGIN_VISIBLE);
 
+	int lighting = glutCreateMenu(myMenu);
+	glutAddMenuEntry("Fixed Function", LIGHTING_FIXED_FUNCTION);
+	glutAddMenuEntry("Per-Pixel Clustered", LIGHTING_PER_PIXEL);
+
 	menu_all = glutCreateMenu(myMenu);
 	glutAddSubMenu("Rendering Modes", rendering_modes);
 	glutAddSubMenu("Brother Blender", brother_blender);
@@ -321,13 +473,23 @@ void myCreateMenu() {
 	glutAddSubMenu("Upper Light", upperLight);
 	glutAddSubMenu("Front Light", frontLight);
 	glutAddSubMenu("Origin", origin);
+	glutAddSubMenu("Lighting", lighting);
 
 	glutAddMenuEntry("Rotate While Idle", OPTION_ROTATE_IDLE);
+	glutAddMenuEntry("Occlusion Culling", OPTION_OCCLUSION_CULLING);
+	glutAddMenuEntry("Dynamic Resolution", OPTION_DYNAMIC_RESOLUTION);
+	glutAddMenuEntry("Light Culling", OPTION_LIGHT_CULLING);
+	glutAddMenuEntry("Show Spot Cones", OPTION_SPOT_CONES);
 	glutAddMenuEntry("Exit", EXIT_APP);
 	glutAttachMenu(GLUT_RIGHT_BUTTON);
 }
 
 bool glInit() {
+#ifdef _WIN32
+	if (glewInit() != GLEW_OK) {
+		return false;
+	}
+#endif
 	glClearColor(0.66f, 0.66f, 0.66f, 0.66f);
 	glEnable(GL_DEPTH_TEST);
 	glClearDepth(1.0f);
@@ -349,19 +511,22 @@ void myResize(int w, int h) {
 }
 
 void idle() {
+	glutPostRedisplay();
+}
+
+/* advances the idle rotation, INPUT_TICK_MS apart on the input thread */
+bool idleStep() {
 	if (!_mouseDown && _idle_rotate_current) {
 		_xdiff_rotate += 0.6f;
 		_ydiff_rotate += 0.5f;
 		_zdiff_rotate += 0.4f;
+		return true;
 	}
-	glutPostRedisplay();
+	return false;
 }
 
-void keyboard(unsigned char key, int x, int y) {
+void handleKeyboard(unsigned char key, int x, int y) {
 	switch (key) {
-	case 27:
-		exit(1);
-		break;
 	case 114:
 		_transform_current = TRANSFORM_ROTATE;
 		_z_axis_enabled = false;
@@ -388,6 +553,10 @@ void keyboard(unsigned char key, int x, int y) {
 	case 48:
 		resetTransformations();
 		break;
+	case 112:
+		_transform_current = TRANSFORM_PICK;
+		_z_axis_enabled = false;
+		break;
 	}
 }
 
@@ -403,8 +572,14 @@ void specialKeyboard(int key, int x, int y) {
 	}
 }
 
-void mouse(int button, int state, int x, int y) {
-	if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
+void handleMouse(int button, int state, int x, int y) {
+	if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN
+			&& _transform_current == TRANSFORM_PICK) {
+		_pick_x = x;
+		_pick_y = y;
+		_pick_report = true;
+		_pick_sequence++;
+	} else if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
 		_mouseDown = true;
 		_xtransform = x;
 		_ytransform = _current_height - y;
@@ -419,7 +594,7 @@ void mouse(int button, int state, int x, int y) {
 	}
 }
 
-void mouseMotion(int x, int y) {
+void handleMouseMotion(int x, int y) {
 	if (_transform_current == TRANSFORM_ROTATE) {
 		if (_z_axis_enabled) {
 			_zdiff_rotate += -(x - _xtransform);
@@ -460,7 +635,15 @@ void mouseMotion(int x, int y) {
 	_ytransform = _current_height - y;
 	_xgrid_mouse = -(_current_width / 2.0 - x);
 	_ygrid_mouse = -(_current_height / 2.0 - (_current_height - y));
-	glutPostRedisplay();
+}
+
+void handleMousePassiveMotion(int x, int y) {
+	if (_transform_current == TRANSFORM_PICK) {
+		_pick_x = x;
+		_pick_y = y;
+		_pick_report = false;
+		_pick_sequence++;
+	}
 }
 
 void calculateNormal(FLTVECTPLUS p1, FLTVECTPLUS p2, FLTVECTPLUS p3,
@@ -484,64 +667,843 @@ void updateNormal(GLfloat** normal, GLfloat* add, int count) {
 	(*normal)[2] = ((*normal)[2] + add[2]) / (GLfloat) count;
 }
 
-int readOFFMesh(const char* file) {
+double nowMs() {
+	return std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Input thread
+ *
+ * The GLUT callbacks only stamp the event and put it on a single producer,
+ * single consumer ring; the input thread applies it to the globals with the
+ * handlers above and publishes a VIEWSTATE. Snapshots go through a triple
+ * buffer: the input thread writes its back buffer and swaps it with the
+ * middle one, the renderer swaps the middle one with its front buffer when
+ * VIEW_NEW is set, so neither side ever waits for the other and a slow
+ * frame cannot hold up input.
+ */
+#define INPUT_QUEUE_SIZE 1024
+#define INPUT_TICK_MS (1000.0 / 60.0)
+#define INPUT_KEYBOARD 0
+#define INPUT_MOUSE 1
+#define INPUT_MOTION 2
+#define INPUT_PASSIVE_MOTION 3
+#define INPUT_MENU 4
+#define INPUT_TICK 5
+#define VIEW_NEW 4
+
+typedef struct {
+	int type;
+	int a;
+	int b;
+	int c;
+	int d;
+	double time;
+} INPUTEVENT;
+
+INPUTEVENT _input_queue[INPUT_QUEUE_SIZE];
+std::atomic<unsigned int> _input_head(0);
+std::atomic<unsigned int> _input_tail(0);
+std::atomic<int> _input_dropped(0);
+std::thread* _input_thread = 0;
+bool _input_shutdown = false;
+bool _replaying = false;
+std::mutex _input_wake_lock;
+std::condition_variable _input_wake;
+
+std::atomic<int> _view_middle(1);
+int _view_back = 2;
+int _view_front = 0;
+unsigned int _view_sequence = 0;
+
+void captureViewState(VIEWSTATE* state) {
+	state->rotate[0] = _xdiff_rotate;
+	state->rotate[1] = _ydiff_rotate;
+	state->rotate[2] = _zdiff_rotate;
+	state->translate[0] = _xdiff_translate;
+	state->translate[1] = _ydiff_translate;
+	state->translate[2] = _zdiff_translate;
+	state->scale = _radius_diff_scale;
+	memcpy(state->light0, _light0_pos, 4 * sizeof(float));
+	memcpy(state->light1, _light1_pos, 4 * sizeof(float));
+	state->polygonMode = _polygon_render_mode;
+	state->brotherColor = _mesh_brother_color;
+	state->monkeyColor = _mesh_monkey_color;
+	state->sampleMaterial = _mesh_sample_mat;
+	state->wallsMode = _walls_mode;
+	state->shadingModel = _shading_model;
+	state->pointLight = _pointLightState;
+	state->spotLight = _spotLightState;
+	state->upperLightColor = _upper_light_color;
+	state->frontLightColor = _front_light_color;
+	state->origin = _origin_visibility;
+	state->lightingPath = _lighting_path;
+	state->occlusionCulling = _occlusion_culling;
+	state->dynamicResolution = _dynamic_resolution;
+	state->lightCulling = _light_culling;
+	state->spotCones = _show_spot_cones;
+	state->twoPassWireframe = _two_pass_wireframe;
+	state->pickX = _pick_x;
+	state->pickY = _pick_y;
+	state->pickReport = _pick_report;
+	state->pickSequence = _pick_sequence;
+	state->inputTime = _input_time;
+	state->events = _input_events;
+	state->sequence = ++_view_sequence;
+}
+
+/* the inverse of captureViewState(), for the menu and transform state */
+void restoreViewState(const VIEWSTATE* state) {
+	_xdiff_rotate = state->rotate[0];
+	_ydiff_rotate = state->rotate[1];
+	_zdiff_rotate = state->rotate[2];
+	_xdiff_translate = state->translate[0];
+	_ydiff_translate = state->translate[1];
+	_zdiff_translate = state->translate[2];
+	_radius_diff_scale = state->scale;
+	memcpy(_light0_pos, state->light0, 4 * sizeof(float));
+	memcpy(_light1_pos, state->light1, 4 * sizeof(float));
+	_polygon_render_mode = state->polygonMode;
+	_mesh_brother_color = state->brotherColor;
+	_mesh_monkey_color = state->monkeyColor;
+	_mesh_sample_mat = state->sampleMaterial;
+	_walls_mode = state->wallsMode;
+	_shading_model = state->shadingModel;
+	_pointLightState = state->pointLight;
+	_spotLightState = state->spotLight;
+	_upper_light_color = state->upperLightColor;
+	_front_light_color = state->frontLightColor;
+	_origin_visibility = state->origin;
+	_lighting_path = state->lightingPath;
+	_occlusion_culling = state->occlusionCulling;
+	_dynamic_resolution = state->dynamicResolution;
+	_light_culling = state->lightCulling;
+	_show_spot_cones = state->spotCones;
+	_two_pass_wireframe = state->twoPassWireframe;
+}
+
+/* input thread */
+void publishViewState() {
+	captureViewState(&_view_buffers[_view_back]);
+	_view_back = _view_middle.exchange(_view_back | VIEW_NEW) & 3;
+}
+
+/* renderer, once at the start of each frame */
+bool acquireViewState() {
+	if (!(_view_middle.load() & VIEW_NEW)) {
+		return false;
+	}
+	_view_front = _view_middle.exchange(_view_front) & 3;
+	_view = &_view_buffers[_view_front];
+	return true;
+}
+
+/* fills every buffer; only while the input thread is not running */
+void initViewState() {
+	for (int i = 0; i < 3; i++) {
+		captureViewState(&_view_buffers[i]);
+	}
+	_view_middle = 1;
+	_view_back = 2;
+	_view_front = 0;
+	_view = &_view_buffers[0];
+}
+
+/* GLUT thread; while a trace is replayed live input is ignored */
+void pushInput(int type, int a, int b, int c, int d) {
+	if (_replaying) {
+		return;
+	}
+	unsigned int head = _input_head.load(std::memory_order_relaxed);
+	if (head - _input_tail.load(std::memory_order_acquire) == INPUT_QUEUE_SIZE) {
+		_input_dropped++;
+		return;
+	}
+	INPUTEVENT* event = &_input_queue[head % INPUT_QUEUE_SIZE];
+	event->type = type;
+	event->a = a;
+	event->b = b;
+	event->c = c;
+	event->d = d;
+	event->time = nowMs();
+	_input_head.store(head + 1, std::memory_order_release);
+	std::lock_guard<std::mutex> guard(_input_wake_lock);
+	_input_wake.notify_one();
+}
+
+void handleInput(const INPUTEVENT* event) {
+	if (event->type == INPUT_KEYBOARD) {
+		handleKeyboard(event->a, event->b, event->c);
+	} else if (event->type == INPUT_MOUSE) {
+		handleMouse(event->a, event->b, event->c, event->d);
+	} else if (event->type == INPUT_MOTION) {
+		handleMouseMotion(event->a, event->b);
+	} else if (event->type == INPUT_PASSIVE_MOTION) {
+		handleMousePassiveMotion(event->a, event->b);
+	} else if (event->type == INPUT_MENU) {
+		handleMenu(event->a);
+	}
+	_input_time = event->time;
+	_input_events++;
+	recordTraceEvent(event->type, event->a, event->b, event->c, event->d,
+			event->time);
+}
+
+void inputWorker() {
+	double nextTick = nowMs() + INPUT_TICK_MS;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(_input_wake_lock);
+			double wait = std::max(0.0, nextTick - nowMs());
+			_input_wake.wait_for(lock,
+					std::chrono::microseconds((long long) (wait * 1000.0)),
+					[] {return _input_shutdown
+						|| _input_head.load() != _input_tail.load();});
+			if (_input_shutdown) {
+				return;
+			}
+		}
+		bool changed = false;
+		unsigned int tail = _input_tail.load(std::memory_order_relaxed);
+		while (tail != _input_head.load(std::memory_order_acquire)) {
+			handleInput(&_input_queue[tail % INPUT_QUEUE_SIZE]);
+			_input_tail.store(++tail, std::memory_order_release);
+			changed = true;
+		}
+		double now = nowMs();
+		if (now >= nextTick) {
+			if (idleStep()) {
+				_input_events++;
+				recordTraceEvent(INPUT_TICK, 0, 0, 0, 0, now);
+				changed = true;
+			}
+			nextTick = std::max(nextTick + INPUT_TICK_MS, now);
+		}
+		if (changed) {
+			publishViewState();
+		}
+	}
+}
+
+void stopInputThread() {
+	{
+		std::lock_guard<std::mutex> guard(_input_wake_lock);
+		_input_shutdown = true;
+	}
+	_input_wake.notify_all();
+	_input_thread->join();
+	delete _input_thread;
+	_input_thread = 0;
+}
+
+void startInputThread() {
+	initViewState();
+	_input_thread = new std::thread(inputWorker);
+	atexit(stopInputThread);
+}
+
+/* GLUT callbacks: window and process control stay here, the rest is queued */
+void keyboard(unsigned char key, int x, int y) {
+	switch (key) {
+	case 27:
+		exit(1);
+		break;
+	case 105:
+		_stats_enabled = !_stats_enabled;
+		break;
+	case 109:
+		printAssets();
+		break;
+	default:
+		pushInput(INPUT_KEYBOARD, key, x, y, 0);
+		break;
+	}
+}
+
+void mouse(int button, int state, int x, int y) {
+	pushInput(INPUT_MOUSE, button, state, x, y);
+}
+
+void mouseMotion(int x, int y) {
+	pushInput(INPUT_MOTION, x, y, 0, 0);
+}
+
+void mousePassiveMotion(int x, int y) {
+	pushInput(INPUT_PASSIVE_MOTION, x, y, 0, 0);
+}
+
+void myMenu(int value) {
+	if (value == 0) {
+		glutDestroyWindow(_windowID);
+		exit(0);
+	}
+	pushInput(INPUT_MENU, value, 0, 0, 0);
+}
+
+/*
+ * Session traces
+ *
+ * --record keeps every event the input thread applies (and the idle
+ * rotation steps it takes) plus, for every frame, how many of those events
+ * its snapshot included and the window size. --replay feeds the events
+ * back on the render thread, frame by frame, so each frame sees exactly the
+ * state it saw when recorded, either paced by the recorded frame times or,
+ * with --fast, as fast as it can draw. Occlusion results and the dynamic
+ * resolution scale still follow the GPU's timing.
+ */
+#define TRACE_MAGIC 0x43525450
+#define TRACE_VERSION 1
+
+typedef struct {
+	int magic;
+	int version;
+	int events;
+	int frames;
+} TRACEHEADER;
+
+typedef struct {
+	float time;
+	short a;
+	short b;
+	short c;
+	short d;
+	unsigned char type;
+} TRACEEVENT;
+
+typedef struct {
+	float time;
+	int events;
+	short width;
+	short height;
+} TRACEFRAME;
+
+const char* _trace_file = 0;
+bool _recording = false;
+bool _replay_fast = false;
+const char* _replay_timings_file = 0;
+double _trace_start = 0.0;
+std::vector<TRACEEVENT> _trace_events;
+std::vector<TRACEFRAME> _trace_frames;
+int _replay_frame = 0;
+int _replay_event = 0;
+std::vector<float> _replay_ms;
+
+/* input thread */
+void recordTraceEvent(int type, int a, int b, int c, int d, double time) {
+	if (!_recording) {
+		return;
+	}
+	TRACEEVENT event;
+	event.time = time - _trace_start;
+	event.a = a;
+	event.b = b;
+	event.c = c;
+	event.d = d;
+	event.type = type;
+	_trace_events.push_back(event);
+}
+
+/* render thread, once per frame with the snapshot it is about to draw */
+void recordTraceFrame() {
+	if (!_recording) {
+		return;
+	}
+	TRACEFRAME frame;
+	frame.time = nowMs() - _trace_start;
+	frame.events = _view->events;
+	frame.width = _current_width;
+	frame.height = _current_height;
+	_trace_frames.push_back(frame);
+}
+
+/* at exit, after the input thread has stopped */
+void writeTrace() {
+	FILE* fout = fopen(_trace_file, "wb");
+	if (!fout) {
+		printf("Errors: writing trace .... %s\n", _trace_file);
+		return;
+	}
+	TRACEHEADER header;
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	header.events = _trace_events.size();
+	header.frames = _trace_frames.size();
+	fwrite(&header, sizeof(TRACEHEADER), 1, fout);
+	if (header.events > 0) {
+		fwrite(&_trace_events[0], sizeof(TRACEEVENT), header.events, fout);
+	}
+	if (header.frames > 0) {
+		fwrite(&_trace_frames[0], sizeof(TRACEFRAME), header.frames, fout);
+	}
+	fclose(fout);
+	printf("recorded %d events over %d frames to %s\n", header.events,
+			header.frames, _trace_file);
+}
+
+void startRecording(const char* file) {
+	_trace_file = file;
+	_recording = true;
+	_trace_start = nowMs();
+	atexit(writeTrace);
+}
+
+bool loadTrace(const char* file) {
+	FILE* fin = fopen(file, "rb");
+	if (!fin) {
+		printf("Errors: reading trace .... %s\n", file);
+		return false;
+	}
+	TRACEHEADER header;
+	bool ok = fread(&header, sizeof(TRACEHEADER), 1, fin) == 1
+			&& header.magic == TRACE_MAGIC && header.version == TRACE_VERSION
+			&& header.events >= 0 && header.frames >= 0;
+	if (ok) {
+		_trace_events.resize(header.events);
+		_trace_frames.resize(header.frames);
+		ok = (header.events == 0
+				|| fread(&_trace_events[0], sizeof(TRACEEVENT), header.events,
+						fin) == (size_t) header.events)
+				&& (header.frames == 0
+						|| fread(&_trace_frames[0], sizeof(TRACEFRAME),
+								header.frames, fin) == (size_t) header.frames);
+	}
+	fclose(fin);
+	if (!ok) {
+		printf("Errors: not a trace file .... %s\n", file);
+	}
+	return ok;
+}
+
+void printReplaySummary() {
+	int frames = _replay_ms.size();
+	if (frames == 0) {
+		printf("replay: no frames\n");
+		return;
+	}
+	std::vector<float> sorted(_replay_ms);
+	std::sort(sorted.begin(), sorted.end());
+	double total = 0.0;
+	for (int i = 0; i < frames; i++) {
+		total += sorted[i];
+	}
+	printf("replay: %d frames, %.1f ms total, %.3f ms avg, %.3f ms p50, "
+			"%.3f ms p95, %.3f ms p99, %.3f ms max\n", frames, total,
+			total / frames, sorted[frames / 2], sorted[frames * 95 / 100],
+			sorted[frames * 99 / 100], sorted[frames - 1]);
+	FILE* fout =
+			_replay_timings_file ? fopen(_replay_timings_file, "w") : 0;
+	if (fout) {
+		fprintf(fout, "frame,ms\n");
+		for (int i = 0; i < frames; i++) {
+			fprintf(fout, "%d,%.4f\n", i, _replay_ms[i]);
+		}
+		fclose(fout);
+	}
+}
+
+/* render thread, in place of acquireViewState() */
+void replayFrame() {
+	if (_replay_frame >= (int) _trace_frames.size()) {
+		printReplaySummary();
+		exit(0);
+	}
+	const TRACEFRAME* frame = &_trace_frames[_replay_frame];
+	if (frame->width != _current_width || frame->height != _current_height) {
+		glutReshapeWindow(frame->width, frame->height);
+	}
+	for (; _replay_event < frame->events; _replay_event++) {
+		const TRACEEVENT* event = &_trace_events[_replay_event];
+		if (event->type == INPUT_TICK) {
+			idleStep();
+		} else {
+			INPUTEVENT input;
+			input.type = event->type;
+			input.a = event->a;
+			input.b = event->b;
+			input.c = event->c;
+			input.d = event->d;
+			input.time = nowMs();
+			handleInput(&input);
+		}
+	}
+	if (!_replay_fast) {
+		double wait = frame->time - (nowMs() - _trace_start);
+		if (wait > 0.0) {
+			std::this_thread::sleep_for(
+					std::chrono::microseconds((long long) (wait * 1000.0)));
+		}
+	}
+	captureViewState(&_view_buffers[0]);
+	_view = &_view_buffers[0];
+	_replay_frame++;
+}
+
+void startReplay(const char* file, bool fast, const char* timings) {
+	if (!loadTrace(file)) {
+		exit(66);
+	}
+	_replaying = true;
+	_replay_fast = fast;
+	_replay_timings_file = timings;
+	_trace_start = nowMs();
+}
+
+void recordReplayFrame(double ms) {
+	if (_replaying && _replay_frame > 0) {
+		_replay_ms.push_back(ms);
+	}
+}
+
+void growBounds(float* bmin, float* bmax, float x, float y, float z) {
+	if (x < bmin[0]) bmin[0] = x;
+	if (y < bmin[1]) bmin[1] = y;
+	if (z < bmin[2]) bmin[2] = z;
+	if (x > bmax[0]) bmax[0] = x;
+	if (y > bmax[1]) bmax[1] = y;
+	if (z > bmax[2]) bmax[2] = z;
+}
+
+void emptyBounds(float* bmin, float* bmax) {
+	bmin[0] = bmin[1] = bmin[2] = 1e30f;
+	bmax[0] = bmax[1] = bmax[2] = -1e30f;
+}
+
+void computeOFFMeshBounds(SurFaceMesh* mesh) {
+	emptyBounds(mesh->bmin, mesh->bmax);
+	for (int i = 0; i < mesh->nv; i++) {
+		growBounds(mesh->bmin, mesh->bmax, mesh->vertex[i].x,
+				mesh->vertex[i].y, mesh->vertex[i].z);
+	}
+}
+
+void computeRawMeshBounds(RawMesh* mesh) {
+	emptyBounds(mesh->bmin, mesh->bmax);
+	for (int i = 0; i < mesh->count; i++) {
+		growBounds(mesh->bmin, mesh->bmax, mesh->list[i].p1->x,
+				mesh->list[i].p1->y, mesh->list[i].p1->z);
+		growBounds(mesh->bmin, mesh->bmax, mesh->list[i].p2->x,
+				mesh->list[i].p2->y, mesh->list[i].p2->z);
+		growBounds(mesh->bmin, mesh->bmax, mesh->list[i].p3->x,
+				mesh->list[i].p3->y, mesh->list[i].p3->z);
+	}
+}
+
+/*
+ * Mesh loading is split in two: the readers only parse a file into flat
+ * arrays, and buildOFFMesh()/buildRawMesh() do the welding and normals.
+ * Indexed formats (OFF, PLY) go through buildOFFMesh(), triangle soups
+ * (RAW, STL) through buildRawMesh().
+ */
+SurFaceMesh* buildOFFMesh(const float* vertices, int nv, const int* faces,
+		int nf) {
+	SurFaceMesh* mesh = (SurFaceMesh*) malloc(sizeof(SurFaceMesh));
+	mesh->nv = nv;
+	mesh->nf = nf;
+	mesh->bvh = 0;
+	mesh->streams = 0;
+	mesh->vertex = (FLTVECTPLUS *) malloc(sizeof(FLTVECTPLUS) * mesh->nv);
+	mesh->face = (INT3VECTPLUS *) malloc(sizeof(INT3VECTPLUS) * mesh->nf);
+	for (int n = 0; n < mesh->nv; n++) {
+		mesh->vertex[n].x = vertices[3 * n];
+		mesh->vertex[n].y = vertices[3 * n + 1];
+		mesh->vertex[n].z = vertices[3 * n + 2];
+		mesh->vertex[n].connected_count = 0;
+		mesh->vertex[n].normal = (GLfloat*) malloc(3 * sizeof(GLfloat));
+		mesh->vertex[n].normal[0] = 0.0;
+		mesh->vertex[n].normal[1] = 0.0;
+		mesh->vertex[n].normal[2] = 0.0;
+	}
+	for (int n = 0; n < mesh->nf; n++) {
+		int a = faces[3 * n];
+		int b = faces[3 * n + 1];
+		int c = faces[3 * n + 2];
+		mesh->face[n].a = a;
+		mesh->face[n].b = b;
+		mesh->face[n].c = c;
+		mesh->face[n].normal = (GLfloat*) malloc(3 * sizeof(GLfloat));
+		calculateNormal(mesh->vertex[a], mesh->vertex[b], mesh->vertex[c],
+				&mesh->face[n].normal);
+		mesh->vertex[a].connected_count++;
+		mesh->vertex[b].connected_count++;
+		mesh->vertex[c].connected_count++;
+		updateNormal(&mesh->vertex[a].normal, mesh->face[n].normal,
+				mesh->vertex[a].connected_count);
+		updateNormal(&mesh->vertex[b].normal, mesh->face[n].normal,
+				mesh->vertex[b].connected_count);
+		updateNormal(&mesh->vertex[c].normal, mesh->face[n].normal,
+				mesh->vertex[c].connected_count);
+	}
+	computeOFFMeshBounds(mesh);
+	return mesh;
+}
+
+/*
+ * Compressed meshes
+ *
+ * A .raw or .off file may be gzip (.gz) or, when built with HAVE_ZSTD,
+ * zstd (.zst) compressed. openMeshFile() starts a thread that inflates
+ * the file DECOMPRESS_BLOCK bytes at a time into a pipe and hands the
+ * parser the pipe's read end, so the text is parsed while the rest is
+ * still being inflated, and at most a block and the pipe's buffer of it
+ * are ever in memory. Needs -lz (and -lzstd). The inflating thread
+ * writes to a POSIX pipe, so on Windows compressed files are refused.
+ */
+bool isCompressed(const char* file) {
+	return hasExtension(file, ".gz") || hasExtension(file, ".zst");
+}
+
+/* the name without .gz or .zst, for picking the parser */
+std::string uncompressedName(const char* file) {
+	std::string name(file);
+	if (hasExtension(file, ".gz")) {
+		name.resize(name.size() - 3);
+	} else if (hasExtension(file, ".zst")) {
+		name.resize(name.size() - 4);
+	}
+	return name;
+}
+
+#ifdef _WIN32
+FILE* openMeshFile(const char* file) {
+	if (isCompressed(file)) {
+		printf("%s: compressed meshes are not supported on Windows\n", file);
+		return NULL;
+	}
+	return fopen(file, "r");
+}
+
+bool closeMeshFile(FILE* fin) {
+	fclose(fin);
+	return true;
+}
+#else
+#include <zlib.h>
+#include <unistd.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define DECOMPRESS_BLOCK 65536
+
+typedef struct {
+	std::string file;
+	int fd;
+	std::thread* thread;
+	long long bytes;
+	double ms;
+	bool failed;
+} INFLATESTREAM;
+
+std::map<FILE*, INFLATESTREAM*> _inflate_streams;
+std::mutex _inflate_lock;
+
+bool writeBlock(INFLATESTREAM* stream, const char* block, size_t size) {
+	while (size > 0) {
+		ssize_t n = write(stream->fd, block, size);
+		if (n <= 0) {
+			return false;
+		}
+		block += n;
+		size -= n;
+		stream->bytes += n;
+	}
+	return true;
+}
+
+void inflateGzip(INFLATESTREAM* stream) {
+	gzFile in = gzopen(stream->file.c_str(), "rb");
+	if (!in) {
+		stream->failed = true;
+		return;
+	}
+	std::vector<char> block(DECOMPRESS_BLOCK);
+	int n;
+	while ((n = gzread(in, &block[0], DECOMPRESS_BLOCK)) > 0) {
+		if (!writeBlock(stream, &block[0], n)) {
+			break;
+		}
+	}
+	/* a cut off file reads as a short one, only gzerror() tells */
+	int error = Z_OK;
+	gzerror(in, &error);
+	stream->failed = n < 0 || error != Z_OK;
+	gzclose(in);
+}
+
+void inflateZstd(INFLATESTREAM* stream) {
+#ifdef HAVE_ZSTD
+	FILE* in = fopen(stream->file.c_str(), "rb");
+	ZSTD_DStream* zstd = ZSTD_createDStream();
+	if (!in || !zstd) {
+		stream->failed = true;
+		if (in) {
+			fclose(in);
+		}
+		ZSTD_freeDStream(zstd);
+		return;
+	}
+	ZSTD_initDStream(zstd);
+	std::vector<char> packed(ZSTD_DStreamInSize());
+	std::vector<char> block(DECOMPRESS_BLOCK);
+	size_t read;
+	size_t result = 0;
+	bool open = true;
+	while (open && (read = fread(&packed[0], 1, packed.size(), in)) > 0) {
+		ZSTD_inBuffer input = { &packed[0], read, 0 };
+		bool full = true;
+		/* a full block may leave output behind even with no input left */
+		while (open && (input.pos < input.size || full)) {
+			ZSTD_outBuffer output = { &block[0], block.size(), 0 };
+			result = ZSTD_decompressStream(zstd, &output, &input);
+			full = output.pos == output.size;
+			if (ZSTD_isError(result)) {
+				stream->failed = true;
+				open = false;
+			} else {
+				open = writeBlock(stream, &block[0], output.pos);
+			}
+		}
+	}
+	/* a non-zero hint means the last frame was cut short */
+	stream->failed = stream->failed || result != 0;
+	ZSTD_freeDStream(zstd);
+	fclose(in);
+#else
+	stream->failed = true;
+#endif
+}
+
+void inflateStream(INFLATESTREAM* stream) {
+	double start = nowMs();
+	if (hasExtension(stream->file.c_str(), ".gz")) {
+		inflateGzip(stream);
+	} else {
+		inflateZstd(stream);
+	}
+	close(stream->fd);
+	stream->ms = nowMs() - start;
+}
+
+/* fopen() for the parsers; close with closeMeshFile() */
+FILE* openMeshFile(const char* file) {
+	if (!isCompressed(file)) {
+		return fopen(file, "r");
+	}
+#ifndef HAVE_ZSTD
+	if (hasExtension(file, ".zst")) {
+		printf("%s: built without zstd, define HAVE_ZSTD\n", file);
+		return NULL;
+	}
+#endif
+	int fds[2];
+	if (access(file, R_OK) != 0 || pipe(fds) != 0) {
+		return NULL;
+	}
+	FILE* fin = fdopen(fds[0], "r");
+	if (!fin) {
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	}
+	INFLATESTREAM* stream = new INFLATESTREAM;
+	stream->file = file;
+	stream->fd = fds[1];
+	stream->bytes = 0;
+	stream->ms = 0.0;
+	stream->failed = false;
+	stream->thread = new std::thread(inflateStream, stream);
+	std::lock_guard<std::mutex> guard(_inflate_lock);
+	_inflate_streams[fin] = stream;
+	return fin;
+}
+
+/*
+ * Drains what the parser left, so the inflating thread can finish; false
+ * if the stream was damaged, whatever the parser made of it.
+ */
+bool closeMeshFile(FILE* fin) {
+	INFLATESTREAM* stream = 0;
+	{
+		std::lock_guard<std::mutex> guard(_inflate_lock);
+		std::map<FILE*, INFLATESTREAM*>::iterator it = _inflate_streams.find(
+				fin);
+		if (it != _inflate_streams.end()) {
+			stream = it->second;
+			_inflate_streams.erase(it);
+		}
+	}
+	if (!stream) {
+		fclose(fin);
+		return true;
+	}
+	char rest[4096];
+	while (fread(rest, 1, sizeof(rest), fin) > 0) {
+	}
+	fclose(fin);
+	stream->thread->join();
+	printf("%s: %.1f MB inflated in %.1f ms alongside parsing%s\n",
+			stream->file.c_str(), stream->bytes / 1048576.0, stream->ms,
+			stream->failed ? ", stream is damaged" : "");
+	bool ok = !stream->failed;
+	delete stream->thread;
+	delete stream;
+	return ok;
+}
+#endif
+
+bool parseOFFMesh(const char* file, std::vector<float>& vertices,
+		std::vector<int>& faces) {
 
 	int num, n, m;
 	int a, b, c, d;
 	float x, y, z;
 	char line[256];
 	FILE *fin;
-	if ((fin = fopen(file, "r")) == NULL) {
-		printf("read error... %s", &file);
-		exit(65);
+	if ((fin = openMeshFile(file)) == NULL) {
+		printf("read error... %s\n", file);
+		return false;
 	};
 	while (fgets(line, 256, fin) != NULL) {
 		if (line[0] == 'O' && line[1] == 'F' && line[2] == 'F') /* OFF format */
 			break;
 	}
-	fscanf(fin, "%d %d %d\n", &m, &n, &num);
-	_surfmesh = (SurFaceMesh*) malloc(sizeof(SurFaceMesh));
-	_surfmesh->nv = m;
-	_surfmesh->nf = n;
-	_surfmesh->vertex = (FLTVECTPLUS *) malloc(
-			sizeof(FLTVECTPLUS) * _surfmesh->nv);
-	_surfmesh->face = (INT3VECTPLUS *) malloc(
-			sizeof(INT3VECTPLUS) * _surfmesh->nf);
-	for (n = 0; n < _surfmesh->nv; n++) {
-		fscanf(fin, "%f %f %f\n", &x, &y, &z);
-		_surfmesh->vertex[n].x = x;
-		_surfmesh->vertex[n].y = y;
-		_surfmesh->vertex[n].z = z;
-		_surfmesh->vertex[n].connected_count = 0;
-		_surfmesh->vertex[n].normal = (GLfloat*) malloc(3 * sizeof(GLfloat));
-		_surfmesh->vertex[n].normal[0] = 0.0;
-		_surfmesh->vertex[n].normal[1] = 0.0;
-		_surfmesh->vertex[n].normal[2] = 0.0;
-	}
-	for (n = 0; n < _surfmesh->nf; n++) {
-		fscanf(fin, "%d %d %d %d\n", &a, &b, &c, &d);
-		_surfmesh->face[n].a = b;
-		_surfmesh->face[n].b = c;
-		_surfmesh->face[n].c = d;
-		_surfmesh->face[n].normal = (GLfloat*) malloc(3 * sizeof(GLfloat));
-		calculateNormal(_surfmesh->vertex[b], _surfmesh->vertex[c],
-				_surfmesh->vertex[d], &_surfmesh->face[n].normal);
-		_surfmesh->vertex[a].connected_count++;
-		_surfmesh->vertex[b].connected_count++;
-		_surfmesh->vertex[c].connected_count++;
-		updateNormal(&_surfmesh->vertex[a].normal, _surfmesh->face[n].normal,
-				_surfmesh->vertex[a].connected_count);
-		updateNormal(&_surfmesh->vertex[b].normal, _surfmesh->face[n].normal,
-				_surfmesh->vertex[b].connected_count);
-		updateNormal(&_surfmesh->vertex[c].normal, _surfmesh->face[n].normal,
-				_surfmesh->vertex[c].connected_count);
-
-		if (a != 3) {
-			printf("Errors: reading mesh .... \n");
+	bool ok = fscanf(fin, "%d %d %d\n", &m, &n, &num) == 3 && m >= 0
+			&& n >= 0 && m <= INT_MAX / 3 && n <= INT_MAX / 3;
+	vertices.resize(ok ? 3 * m : 0);
+	faces.resize(ok ? 3 * n : 0);
+	for (int i = 0; ok && i < m; i++) {
+		ok = fscanf(fin, "%f %f %f\n", &x, &y, &z) == 3;
+		vertices[3 * i] = x;
+		vertices[3 * i + 1] = y;
+		vertices[3 * i + 2] = z;
+	}
+	for (int i = 0; ok && i < n; i++) {
+		ok = fscanf(fin, "%d", &a) == 1;
+		if (ok && a != 3) {
+			printf("Errors: reading mesh .... %s: face %d has %d vertices, "
+					"only triangles are supported\n", file, i, a);
+			closeMeshFile(fin);
+			return false;
 		}
+		ok = ok && fscanf(fin, "%d %d %d\n", &b, &c, &d) == 3;
+		faces[3 * i] = b;
+		faces[3 * i + 1] = c;
+		faces[3 * i + 2] = d;
 	}
-	fclose(fin);
-	return 0;
+	ok = closeMeshFile(fin) && ok;
+	if (!ok) {
+		printf("Errors: reading mesh .... %s is truncated\n", file);
+		return false;
+	}
+	for (size_t i = 0; i < faces.size(); i++) {
+		if (faces[i] < 0 || faces[i] >= m) {
+			printf("Errors: reading mesh .... %s: index %d out of range\n", file,
+					faces[i]);
+			return false;
+		}
+	}
+	return true;
 }
 
 bool floatEquals(float a, float b) {
@@ -571,30 +1533,21 @@ bool getPoint(float x, float y, float z, RawMesh * mesh, int count,
 	return false;
 }
 
-int readRawMesh(const char* file, RawMesh** triangular_mesh) {
-	int count;
-	float x, y, z, x1, y1, z1, x2, y2, z2;
-	char line[256];
-	FILE *fin;
-	if ((fin = fopen(file, "r")) == NULL) {
-		printf("read error...%s", &file);
-		exit(65);
-	};
-	while (fgets(line, 256, fin) != NULL) {
-		if (line[0] == 'R' && line[1] == 'A' && line[2] == 'W') /* RAW format */
-			break;
-	}
-
-	fscanf(fin, "%d\n", &count);
+void buildRawMesh(const float* triangles, int count,
+		RawMesh** triangular_mesh) {
 	*triangular_mesh = (RawMesh*) malloc(sizeof(RawMesh));
 	(*triangular_mesh)->count = count;
+	(*triangular_mesh)->bvh = 0;
+	(*triangular_mesh)->streams = 0;
 
 	(*triangular_mesh)->list = (TRIANGLEPLUS*) malloc(
 			sizeof(TRIANGLEPLUS) * count);
 
 	for (int n = 0; n < count; n++) {
-		fscanf(fin, "%f %f %f %f %f %f %f %f %f\n", &x, &y, &z, &x1, &y1, &z1,
-				&x2, &y2, &z2);
+		const float* t = triangles + 9 * (size_t) n;
+		float x = t[0], y = t[1], z = t[2];
+		float x1 = t[3], y1 = t[4], z1 = t[5];
+		float x2 = t[6], y2 = t[7], z2 = t[8];
 		FLTVECTPLUS* point;
 
 		if (getPoint(x, y, z, (*triangular_mesh), n, &point)) {
@@ -667,682 +1620,8257 @@ int readRawMesh(const char* file, RawMesh** triangular_mesh) {
 
 	}
 
-	fclose(fin);
-	return 0;
+	computeRawMeshBounds(*triangular_mesh);
 }
 
-void myMenu(int value) {
-	if (value == 0) {
-		glutDestroyWindow(_windowID);
-		exit(0);
-	} else if (value < 5) {
-		_polygon_render_mode = value;
-	} else if (value == OPTION_ROTATE_IDLE) {
-		_idle_rotate_current = !_idle_rotate_current;
-	} else {
-		if (value == MESH_SAMPLE_METAL || value == MESH_SAMPLE_GLASS
-				|| value == MESH_SAMPLE_FABRIC) {
-			_mesh_sample_mat = value;
-		} else if (value == MESH_BROTHER_BLENDER_BLACK
-				|| value == MESH_BROTHER_BLENDER_WHITE) {
-			_mesh_brother_color = value;
-		} else if (value == MESH_MONKEY_BLENDER_BLACK
-				|| value == MESH_MONKEY_BLENDER_WHITE) {
-			_mesh_monkey_color = value;
-		} else if (value == ROOM_WALLS_BRICK || value == ROOM_WALLS_DRY_WALLS
-				|| value == ROOM_WALLS_STUCCO) {
-			_walls_mode = value;
-		} else if (value == SMOOTH_SHADING || value == FLAT_SHADING) {
-			_shading_model = value;
-		} else if (value == POINT_LIGHT_ON || value == POINT_LIGHT_OFF) {
-			_pointLightState = value;
-		} else if (value == SPOT_LIGHT_ON || value == SPOT_LIGHT_OFF) {
-			_spotLightState = value;
-		} else if (value == UPPER_LIGHT_WHITE || value == UPPER_LIGHT_ORANGE) {
-			_upper_light_color = value;
-		} else if (value == FRONT_LIGHT_WHITE || value == FRONT_LIGHT_TURQUOISE) {
-			_front_light_color = value;
-		} else if (value == ORIGIN_HIDDEN || value == ORIGIN_VISIBLE) {
-			_origin_visibility = value;
-		}
+bool parseRawMesh(const char* file, std::vector<float>& triangles) {
+	long long count;
+	char line[256];
+	FILE *fin;
+	if ((fin = openMeshFile(file)) == NULL) {
+		printf("read error...%s\n", file);
+		return false;
+	};
+	while (fgets(line, 256, fin) != NULL) {
+		if (line[0] == 'R' && line[1] == 'A' && line[2] == 'W') /* RAW format */
+			break;
+	}
+
+	bool ok = fscanf(fin, "%lld\n", &count) == 1;
+	if (ok && (count < 0 || count > INT_MAX / 9)) {
+		printf("%s: %lld triangles is too many to load, convert it with "
+				"--convert-chunked and view it with --chunked\n", file, count);
+		closeMeshFile(fin);
+		return false;
 	}
+	triangles.resize(ok ? 9 * count : 0);
+	for (int n = 0; ok && n < count; n++) {
+		float* t = &triangles[9 * (size_t) n];
+		ok = fscanf(fin, "%f %f %f %f %f %f %f %f %f\n", &t[0], &t[1], &t[2],
+				&t[3], &t[4], &t[5], &t[6], &t[7], &t[8]) == 9;
+	}
+	ok = closeMeshFile(fin) && ok;
+	if (!ok) {
+		printf("Errors: reading mesh .... %s is truncated\n", file);
+	}
+	return ok;
+}
+
+/*
+ * Binary PLY and STL
+ *
+ * Both are read with one fread of the whole body; values are then copied
+ * out by offset, and only byte swapped when the file's endianness differs
+ * from the host's. PLY is indexed and goes through buildOFFMesh(), STL is
+ * a triangle soup and goes through buildRawMesh() like RAW.
+ */
+#define PLY_INT 0
+#define PLY_UINT 1
+#define PLY_FLOAT 2
+
+typedef struct {
+	std::string name;
+	int size;
+	int kind;
+	int countSize;
+	int countKind;
+	int offset;
+} PLYPROPERTY;
+
+typedef struct {
+	std::string name;
+	long long count;
+	std::vector<PLYPROPERTY> properties;
+	int stride;
+} PLYELEMENT;
+
+bool hostLittleEndian() {
+	unsigned short one = 1;
+	return *(unsigned char*) &one == 1;
 }
 
-void drawOFFMeshWithoutColor(SurFaceMesh *surfmesh) {
-	for (int i = 0; i < surfmesh->nf; i++) {
-		glBegin(GL_TRIANGLES);
-		glVertex3f(surfmesh->vertex[surfmesh->face[i].a].x,
-				surfmesh->vertex[surfmesh->face[i].a].y,
-				surfmesh->vertex[surfmesh->face[i].a].z);
-		glVertex3f(surfmesh->vertex[surfmesh->face[i].b].x,
-				surfmesh->vertex[surfmesh->face[i].b].y,
-				surfmesh->vertex[surfmesh->face[i].b].z);
-		glVertex3f(surfmesh->vertex[surfmesh->face[i].c].x,
-				surfmesh->vertex[surfmesh->face[i].c].y,
-				surfmesh->vertex[surfmesh->face[i].c].z);
-		glEnd();
+bool plyType(const char* name, int* size, int* kind) {
+	static const char* names[] = { "char", "int8", "uchar", "uint8", "short",
+			"int16", "ushort", "uint16", "int", "int32", "uint", "uint32",
+			"float", "float32", "double", "float64" };
+	static const int sizes[] = { 1, 1, 1, 1, 2, 2, 2, 2, 4, 4, 4, 4, 4, 4, 8, 8 };
+	static const int kinds[] = { PLY_INT, PLY_INT, PLY_UINT, PLY_UINT, PLY_INT,
+			PLY_INT, PLY_UINT, PLY_UINT, PLY_INT, PLY_INT, PLY_UINT, PLY_UINT,
+			PLY_FLOAT, PLY_FLOAT, PLY_FLOAT, PLY_FLOAT };
+	for (int i = 0; i < 16; i++) {
+		if (strcmp(name, names[i]) == 0) {
+			*size = sizes[i];
+			*kind = kinds[i];
+			return true;
+		}
 	}
+	return false;
 }
 
-void drawRawMeshWithoutColor(RawMesh *mesh) {
-	for (int i = 0; i < mesh->count; i++) {
-		glBegin(GL_TRIANGLES);
-		glVertex3f(mesh->list[i].p1->x, mesh->list[i].p1->y,
-				mesh->list[i].p1->z);
-		glVertex3f(mesh->list[i].p2->x, mesh->list[i].p2->y,
-				mesh->list[i].p2->z);
-		glVertex3f(mesh->list[i].p3->x, mesh->list[i].p3->y,
-				mesh->list[i].p3->z);
-		glEnd();
+double plyValue(const unsigned char* p, int size, int kind, bool swap) {
+	unsigned char b[8];
+	for (int i = 0; i < size; i++) {
+		b[i] = swap ? p[size - 1 - i] : p[i];
+	}
+	switch (size * 4 + kind) {
+	case 1 * 4 + PLY_INT:
+		return *(signed char*) b;
+	case 1 * 4 + PLY_UINT:
+		return *(unsigned char*) b;
+	case 2 * 4 + PLY_INT:
+		return *(short*) b;
+	case 2 * 4 + PLY_UINT:
+		return *(unsigned short*) b;
+	case 4 * 4 + PLY_INT:
+		return *(int*) b;
+	case 4 * 4 + PLY_UINT:
+		return *(unsigned int*) b;
+	case 4 * 4 + PLY_FLOAT:
+		return *(float*) b;
+	case 8 * 4 + PLY_FLOAT:
+		return *(double*) b;
 	}
+	return 0.0;
 }
 
-void setUpFaceNormal(FLTVECTPLUS p1, FLTVECTPLUS p2, FLTVECTPLUS p3) {
-	GLfloat* normal = (GLfloat *) malloc(3 * sizeof(GLfloat));
-	calculateNormal(p1, p2, p3, &normal);
-	glNormal3fv(normal);
-	free(normal);
+float plyFloat(const unsigned char* p, const PLYPROPERTY* property,
+		bool swap) {
+	if (property->kind == PLY_FLOAT && property->size == 4 && !swap) {
+		float f;
+		memcpy(&f, p, 4);
+		return f;
+	}
+	return plyValue(p, property->size, property->kind, swap);
 }
 
-void setUpFaceNormal(TRIANGLEPLUS triangle) {
-	setUpFaceNormal(*triangle.p1, *triangle.p2, *triangle.p3);
+const PLYPROPERTY* plyFind(const PLYELEMENT* element, const char* name) {
+	for (size_t i = 0; i < element->properties.size(); i++) {
+		if (element->properties[i].name == name) {
+			return &element->properties[i];
+		}
+	}
+	return 0;
 }
 
-void drawOFFMesh(SurFaceMesh *surfmesh) {
-	int numberOfColors = 8;
-	for (int i = 0; i < surfmesh->nf; i++) {
-		if (i % numberOfColors == 0) {
-			glColor3f(0.0, 0.0, 1.0);
-		} else if (i % numberOfColors == 1) {
-			glColor3f(0.0, 1.0, 0.0);
-		} else if (i % numberOfColors == 2) {
-			glColor3f(1.0, 0.0, 0.0);
-		} else if (i % numberOfColors == 3) {
-			glColor3f(1.0, 0.0, 1.0);
-		} else if (i % numberOfColors == 4) {
-			glColor3f(0.0, 1.0, 1.0);
-		} else if (i % numberOfColors == 5) {
-			glColor3f(1.0, 1.0, 0.0);
-		} else if (i % numberOfColors == 6) {
-			glColor3f(1.0, 1.0, 1.0);
-		} else if (i % numberOfColors == 7) {
-			glColor3f(0.0, 0.0, 0.0);
-		}
-		if (_shading_model == FLAT_SHADING) {
-			glNormal3fv(surfmesh->face[i].normal);
-			glBegin(GL_TRIANGLES);
-			glVertex3f(surfmesh->vertex[surfmesh->face[i].a].x,
-					surfmesh->vertex[surfmesh->face[i].a].y,
-					surfmesh->vertex[surfmesh->face[i].a].z);
-			glVertex3f(surfmesh->vertex[surfmesh->face[i].b].x,
-					surfmesh->vertex[surfmesh->face[i].b].y,
-					surfmesh->vertex[surfmesh->face[i].b].z);
-			glVertex3f(surfmesh->vertex[surfmesh->face[i].c].x,
-					surfmesh->vertex[surfmesh->face[i].c].y,
-					surfmesh->vertex[surfmesh->face[i].c].z);
-			glEnd();
-		} else if (_shading_model == SMOOTH_SHADING) {
-			glBegin(GL_TRIANGLES);
-			glNormal3fv(surfmesh->vertex[surfmesh->face[i].a].normal);
-			glVertex3f(surfmesh->vertex[surfmesh->face[i].a].x,
-					surfmesh->vertex[surfmesh->face[i].a].y,
-					surfmesh->vertex[surfmesh->face[i].a].z);
-			glNormal3fv(surfmesh->vertex[surfmesh->face[i].b].normal);
-			glVertex3f(surfmesh->vertex[surfmesh->face[i].b].x,
-					surfmesh->vertex[surfmesh->face[i].b].y,
-					surfmesh->vertex[surfmesh->face[i].b].z);
-			glNormal3fv(surfmesh->vertex[surfmesh->face[i].c].normal);
-			glVertex3f(surfmesh->vertex[surfmesh->face[i].c].x,
-					surfmesh->vertex[surfmesh->face[i].c].y,
-					surfmesh->vertex[surfmesh->face[i].c].z);
-			glEnd();
-		}
-
-	}
-}
-
-void drawRawMesh(RawMesh * mesh, float* rgb) {
-	float currentColor = 0.0;
-	for (int i = 0; i < mesh->count; i++) {
-		if (currentColor >= 1.0) {
-			currentColor = 0.0;
-		}
-		//glColor3f(currentColor, currentColor - currentColor / 6.0, 0);
-		currentColor += 0.05;
-		glColor3f(rgb[0], rgb[1], rgb[2]);
-		if (_shading_model == FLAT_SHADING) {
-			glNormal3fv(mesh->list[i].normal);
-			glBegin(GL_TRIANGLES);
-			glVertex3f(mesh->list[i].p1->x, mesh->list[i].p1->y,
-					mesh->list[i].p1->z);
-			glVertex3f(mesh->list[i].p2->x, mesh->list[i].p2->y,
-					mesh->list[i].p2->z);
-			glVertex3f(mesh->list[i].p3->x, mesh->list[i].p3->y,
-					mesh->list[i].p3->z);
-			glEnd();
-		} else if (_shading_model == SMOOTH_SHADING) {
-			glBegin(GL_TRIANGLES);
-			glNormal3fv(mesh->list[i].p1->normal);
-
-			glVertex3f(mesh->list[i].p1->x, mesh->list[i].p1->y,
-					mesh->list[i].p1->z);
-			glNormal3fv(mesh->list[i].p2->normal);
-			glVertex3f(mesh->list[i].p2->x, mesh->list[i].p2->y,
-					mesh->list[i].p2->z);
-			glNormal3fv(mesh->list[i].p3->normal);
-			glVertex3f(mesh->list[i].p3->x, mesh->list[i].p3->y,
-					mesh->list[i].p3->z);
-			glEnd();
-		}
-	}
-}
-
-void drawSampleMesh(bool withColor) {
-	glPushMatrix();
-	GLfloat emission[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat ambient[4] = { 0.3, 0.0, 0.0, 1.0 };
-	GLfloat diffuse[4] = { 0.0, 0.4, 0.0, 1.0 };
-	float shine = 0.0;
-	GLfloat shininess[4] = { 0.0, 0.0, 0.0, 1.0 };
-	if (_mesh_sample_mat == MESH_SAMPLE_METAL) {
-		shininess[0] = 0.5;
-		shininess[1] = 0.5;
-		shininess[2] = 0.5;
-		shininess[3] = 1.0;
-		shine = 25.0;
-	} else if (_mesh_sample_mat == MESH_SAMPLE_GLASS) {
-		shininess[0] = diffuse[0] = 0.75;
-		shininess[1] = diffuse[1] = 0.75;
-		shininess[2] = diffuse[2] = 0.75;
-		shine = 100.0;
+/* normals stays empty when the file has none */
+bool parsePLYMesh(const char* file, std::vector<float>& vertices,
+		std::vector<int>& faces, std::vector<float>& normals) {
+	if (isCompressed(file)) {
+		printf("%s: only RAW and OFF meshes can be compressed\n", file);
+		return false;
 	}
-	glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emission);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, shininess);
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, shine);
-	glTranslatef(0.3, 2.0, 0.4);
-	glScalef(0.05, 0.05, 0.05);
-	if (withColor) {
-		drawOFFMesh(_surfmesh);
-	} else {
-		drawOFFMeshWithoutColor(_surfmesh);
+	FILE* fin = fopen(file, "rb");
+	if (fin == NULL) {
+		printf("read error... %s\n", file);
+		return false;
+	}
+	char line[256];
+	char word[64];
+	char type[64];
+	char countType[64];
+	bool littleEndian = true;
+	std::vector<PLYELEMENT> elements;
+	if (fgets(line, 256, fin) == NULL || strncmp(line, "ply", 3) != 0) {
+		printf("Errors: reading mesh .... %s is not a PLY file\n", file);
+		fclose(fin);
+		return false;
+	}
+	while (fgets(line, 256, fin) != NULL) {
+		if (strncmp(line, "end_header", 10) == 0) {
+			break;
+		} else if (sscanf(line, "format %63s", word) == 1) {
+			if (strcmp(word, "binary_big_endian") == 0) {
+				littleEndian = false;
+			} else if (strcmp(word, "binary_little_endian") != 0) {
+				printf("Errors: reading mesh .... %s: %s PLY is not supported\n",
+						file, word);
+				fclose(fin);
+				return false;
+			}
+		} else if (strncmp(line, "element", 7) == 0) {
+			PLYELEMENT element;
+			long long count;
+			if (sscanf(line, "element %63s %lld", word, &count) != 2
+					|| count < 0) {
+				printf("Errors: reading mesh .... %s: bad element %s", file,
+						line);
+				fclose(fin);
+				return false;
+			}
+			element.name = word;
+			element.count = count;
+			element.stride = 0;
+			elements.push_back(element);
+		} else if (strncmp(line, "property", 8) == 0 && !elements.empty()) {
+			PLYPROPERTY property;
+			property.countSize = 0;
+			property.countKind = PLY_UINT;
+			bool ok;
+			if (sscanf(line, "property list %63s %63s %63s", countType, type,
+					word) == 3) {
+				ok = plyType(countType, &property.countSize, &property.countKind)
+						&& plyType(type, &property.size, &property.kind);
+			} else {
+				ok = sscanf(line, "property %63s %63s", type, word) == 2
+						&& plyType(type, &property.size, &property.kind);
+			}
+			if (!ok) {
+				printf("Errors: reading mesh .... %s: bad property %s", file,
+						line);
+				fclose(fin);
+				return false;
+			}
+			property.name = word;
+			PLYELEMENT* element = &elements.back();
+			property.offset = element->stride;
+			if (property.countSize == 0 && element->stride >= 0) {
+				element->stride += property.size;
+			} else {
+				element->stride = -1;
+			}
+			element->properties.push_back(property);
+		}
+	}
+	long start = ftell(fin);
+	fseek(fin, 0, SEEK_END);
+	long size = ftell(fin) - start;
+	fseek(fin, start, SEEK_SET);
+	std::vector<unsigned char> body(size + 1);
+	if (size > 0 && fread(&body[0], 1, size, fin) != (size_t) size) {
+		printf("Errors: reading mesh .... %s is truncated\n", file);
+		fclose(fin);
+		return false;
+	}
+	fclose(fin);
+	/* every property takes at least its size, or its count's for lists */
+	for (size_t e = 0; e < elements.size(); e++) {
+		long long bytes = 0;
+		for (size_t k = 0; k < elements[e].properties.size(); k++) {
+			const PLYPROPERTY* property = &elements[e].properties[k];
+			bytes += property->countSize ? property->countSize
+					: property->size;
+		}
+		if (elements[e].count > size / std::max(bytes, 1LL)) {
+			printf("Errors: reading mesh .... %s is truncated\n", file);
+			return false;
+		}
 	}
-	glPopMatrix();
-}
 
-void drawBrotherBlender(bool withColor) {
-	glPushMatrix();
-	GLfloat emission[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat ambient[4] = { 0.6, 0.33, 0.0, 1.0 };
-	GLfloat diffuse[4] = { 0.66, 0.33, 0.0, 1.0 };
-	GLfloat shininess[4] = { 0.66, 0.33, 0.0, 1.0 };
-	if (_mesh_brother_color == MESH_BROTHER_BLENDER_WHITE) {
-		ambient[0] = diffuse[0] = shininess[0] = 1.0;
-		ambient[1] = diffuse[1] = shininess[1] = 1.0;
-		ambient[2] = diffuse[2] = shininess[2] = 1.0;
+	bool swap = littleEndian != hostLittleEndian();
+	const unsigned char* p = &body[0];
+	const unsigned char* end = p + size;
+	for (size_t e = 0; e < elements.size(); e++) {
+		PLYELEMENT* element = &elements[e];
+		if (element->name == "vertex" && element->stride > 0) {
+			const PLYPROPERTY* x = plyFind(element, "x");
+			const PLYPROPERTY* y = plyFind(element, "y");
+			const PLYPROPERTY* z = plyFind(element, "z");
+			const PLYPROPERTY* nx = plyFind(element, "nx");
+			const PLYPROPERTY* ny = plyFind(element, "ny");
+			const PLYPROPERTY* nz = plyFind(element, "nz");
+			if (!x || !y || !z || p + element->count * element->stride > end) {
+				printf("Errors: reading mesh .... %s: bad vertex element\n", file);
+				return false;
+			}
+			vertices.resize(3 * element->count);
+			if (nx && ny && nz) {
+				normals.resize(3 * element->count);
+			}
+			for (long long i = 0; i < element->count; i++, p += element->stride) {
+				vertices[3 * i] = plyFloat(p + x->offset, x, swap);
+				vertices[3 * i + 1] = plyFloat(p + y->offset, y, swap);
+				vertices[3 * i + 2] = plyFloat(p + z->offset, z, swap);
+				if (!normals.empty()) {
+					normals[3 * i] = plyFloat(p + nx->offset, nx, swap);
+					normals[3 * i + 1] = plyFloat(p + ny->offset, ny, swap);
+					normals[3 * i + 2] = plyFloat(p + nz->offset, nz, swap);
+				}
+			}
+			continue;
+		}
+		if (element->stride >= 0) {
+			p += element->count * element->stride;
+			continue;
+		}
+		/* elements with lists: faces are fanned into triangles */
+		bool isFace = element->name == "face";
+		faces.reserve(isFace ? 3 * element->count : 0);
+		for (long long i = 0; i < element->count; i++) {
+			for (size_t k = 0; k < element->properties.size(); k++) {
+				const PLYPROPERTY* property = &element->properties[k];
+				if (p + property->countSize > end) {
+					printf("Errors: reading mesh .... %s is truncated\n", file);
+					return false;
+				}
+				if (property->countSize == 0) {
+					p += property->size;
+					continue;
+				}
+				int n = (int) plyValue(p, property->countSize,
+						property->countKind, swap);
+				p += property->countSize;
+				if (p + n * property->size > end) {
+					printf("Errors: reading mesh .... %s is truncated\n", file);
+					return false;
+				}
+				bool indices = isFace
+						&& (property->name == "vertex_indices"
+								|| property->name == "vertex_index");
+				for (int t = 1; indices && t + 1 < n; t++) {
+					faces.push_back(
+							(int) plyValue(p, property->size, property->kind, swap));
+					faces.push_back(
+							(int) plyValue(p + t * property->size, property->size,
+									property->kind, swap));
+					faces.push_back(
+							(int) plyValue(p + (t + 1) * property->size,
+									property->size, property->kind, swap));
+				}
+				p += n * property->size;
+			}
+		}
 	}
-	glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emission);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, shininess);
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 15.0);
-	if (withColor) {
-		float rgb[3] = { 0.1, 0.1, 0.1 };
-		drawRawMesh(_brother_blender_mesh, (float*) rgb);
-	} else {
-		drawRawMeshWithoutColor(_brother_blender_mesh);
+	int nv = vertices.size() / 3;
+	for (size_t i = 0; i < faces.size(); i++) {
+		if (faces[i] < 0 || faces[i] >= nv) {
+			printf("Errors: reading mesh .... %s: index %d out of range\n", file,
+					faces[i]);
+			return false;
+		}
 	}
-	glPopMatrix();
+	return true;
 }
 
-void drawBlenderMonkey(bool withColor) {
-	glPushMatrix();
-	GLfloat emission[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat ambient[4] = { 0.3, 0.3, 0.3, 1.0 };
-	GLfloat diffuse[4] = { 0.3, 0.3, 0.3, 1.0 };
-	GLfloat shininess[4] = { 0.3, 0.3, 0.3, 1.0 };
-	if (_mesh_monkey_color == MESH_MONKEY_BLENDER_BLACK) {
-		ambient[0] = diffuse[0] = shininess[0] = 0.66;
-		ambient[1] = diffuse[1] = shininess[1] = 0.1;
-		ambient[2] = diffuse[2] = shininess[2] = 0.1;
+bool parseSTLMesh(const char* file, std::vector<float>& triangles) {
+	if (isCompressed(file)) {
+		printf("%s: only RAW and OFF meshes can be compressed\n", file);
+		return false;
 	}
-	glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emission);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, shininess);
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 25.0);
-	if (withColor) {
-		float rgb[3] = { 0.0, 0.0, 0.0 };
-		drawRawMesh(_blender_monkey_mesh, (float*) rgb);
-	} else {
-		drawRawMeshWithoutColor(_blender_monkey_mesh);
+	FILE* fin = fopen(file, "rb");
+	if (fin == NULL) {
+		printf("read error... %s\n", file);
+		return false;
 	}
-	glPopMatrix();
+	unsigned char header[84];
+	fseek(fin, 0, SEEK_END);
+	long size = ftell(fin);
+	fseek(fin, 0, SEEK_SET);
+	if (size < 84 || fread(header, 1, 84, fin) != 84) {
+		printf("Errors: reading mesh .... %s is not a binary STL file\n", file);
+		fclose(fin);
+		return false;
+	}
+	unsigned int count = (unsigned int) plyValue(header + 80, 4, PLY_UINT,
+			!hostLittleEndian());
+	if (count > INT_MAX / 9) {
+		printf("%s: %u triangles is too many to load\n", file, count);
+		fclose(fin);
+		return false;
+	}
+	if (size != 84 + 50 * (long long) count) {
+		printf("Errors: reading mesh .... %s is not a binary STL file "
+				"(ASCII STL is not supported)\n", file);
+		fclose(fin);
+		return false;
+	}
+	std::vector<unsigned char> body(50 * (size_t) count + 1);
+	if (fread(&body[0], 50, count, fin) != count) {
+		printf("Errors: reading mesh .... %s is truncated\n", file);
+		fclose(fin);
+		return false;
+	}
+	fclose(fin);
+	triangles.resize(9 * (size_t) count);
+	bool swap = !hostLittleEndian();
+	for (unsigned int i = 0; i < count; i++) {
+		const unsigned char* p = &body[50 * (size_t) i + 12];
+		if (!swap) {
+			memcpy(&triangles[9 * (size_t) i], p, 9 * sizeof(float));
+		} else {
+			for (int k = 0; k < 9; k++) {
+				triangles[9 * (size_t) i + k] = plyValue(p + 4 * k, 4, PLY_FLOAT,
+						true);
+			}
+		}
+	}
+	return true;
 }
 
-void drawRoomWalls(bool withColor) {
-	glPushMatrix();
-
-	GLfloat emission[4] = { 0.1, 0.1, 0.1, 1.0 };
-	GLfloat ambient[4] = { 0.2, 0.2, 0.0, 1.0 };
-	GLfloat diffuse[4] = { 0.0, 0.3, 0.0, 1.0 };
-	GLfloat shininess[4] = { 0.1, 0.0, 0.4, 1.0 };
-	float shine = 10.0;
-	if (_walls_mode == ROOM_WALLS_DRY_WALLS) {
-		shininess[0] = shininess[1] = shininess[2]  = 0.0;
-		ambient[0] = diffuse[0] = 0.4;
-		ambient[1] = diffuse[1] = 0.4;
-		ambient[2] = diffuse[2] = 0.4;
-		shine = 0.0;
-	} else if (_walls_mode == ROOM_WALLS_BRICK) {
-		ambient[0] = diffuse[0] = shininess[0] = 0.4;
-		ambient[1] = diffuse[1] = shininess[1] = 0.2;
-		ambient[2] = diffuse[2] = shininess[2] = 0.0;
-		shine = 20.0;
+bool hasExtension(const char* file, const char* extension) {
+	size_t n = strlen(file);
+	size_t e = strlen(extension);
+	if (n < e) {
+		return false;
 	}
-	glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emission);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, shininess);
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, shine);
-
-	if (withColor) {
-		float rgb[3] = { 0.15, 0.15, 0.85 };
-		drawRawMesh(_room_walls_mesh, (float*) rgb);
-	} else {
-		drawRawMeshWithoutColor(_room_walls_mesh);
+	for (size_t i = 0; i < e; i++) {
+		if (tolower(file[n - e + i]) != extension[i]) {
+			return false;
+		}
 	}
-	glPopMatrix();
+	return true;
 }
 
-void drawTables(bool withColor) {
-	glPushMatrix();
-
-	GLfloat emission[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat ambient[4] = { 0.2, 0.1, 0.0, 1.0 };
-	GLfloat diffuse[4] = { 0.2, 0.1, 0.0, 1.0 };
-	GLfloat shininess[4] = { 0.2, 0.1, 0.0, 1.0 };
-	glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emission);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, shininess);
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 25.0);
-
-	if (withColor) {
-		float rgb[3] = { 0.15, 0.15, 0.85 };
-		drawRawMesh(_tables_mesh, (float*) rgb);
-	} else {
-		drawRawMeshWithoutColor(_tables_mesh);
+void writeBytes(FILE* fout, const void* data, int size, bool swap) {
+	const unsigned char* p = (const unsigned char*) data;
+	if (!swap) {
+		fwrite(p, size, 1, fout);
+		return;
+	}
+	for (int i = size - 1; i >= 0; i--) {
+		fputc(p[i], fout);
 	}
-	glPopMatrix();
 }
 
-void drawLampBases(bool withColor) {
-	glPushMatrix();
+void writeBinaryPLY(const char* file, const SurFaceMesh* mesh,
+		bool withNormals, bool bigEndian) {
+	FILE* fout = fopen(file, "wb");
+	fprintf(fout, "ply\nformat %s 1.0\nelement vertex %d\n",
+			bigEndian ? "binary_big_endian" : "binary_little_endian", mesh->nv);
+	fprintf(fout, "property float x\nproperty float y\nproperty float z\n");
+	if (withNormals) {
+		fprintf(fout, "property float nx\nproperty float ny\nproperty float nz\n");
+	}
+	fprintf(fout, "element face %d\nproperty list uchar int vertex_indices\n"
+			"end_header\n", mesh->nf);
+	bool swap = bigEndian == hostLittleEndian();
+	for (int i = 0; i < mesh->nv; i++) {
+		writeBytes(fout, &mesh->vertex[i].x, 4, swap);
+		writeBytes(fout, &mesh->vertex[i].y, 4, swap);
+		writeBytes(fout, &mesh->vertex[i].z, 4, swap);
+		for (int k = 0; withNormals && k < 3; k++) {
+			writeBytes(fout, &mesh->vertex[i].normal[k], 4, swap);
+		}
+	}
+	unsigned char three = 3;
+	for (int i = 0; i < mesh->nf; i++) {
+		fwrite(&three, 1, 1, fout);
+		writeBytes(fout, &mesh->face[i].a, 4, swap);
+		writeBytes(fout, &mesh->face[i].b, 4, swap);
+		writeBytes(fout, &mesh->face[i].c, 4, swap);
+	}
+	fclose(fout);
+}
 
-	GLfloat emission[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat diffuse[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat shininess[4] = { 0.0, 0.0, 0.0, 1.0 };
-	glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emission);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, shininess);
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 25.0);
+void writeBinarySTL(const char* file, const float* triangles, int count) {
+	FILE* fout = fopen(file, "wb");
+	char header[80];
+	memset(header, 0, 80);
+	strncpy(header, "poly_interactive", 79);
+	fwrite(header, 1, 80, fout);
+	bool swap = !hostLittleEndian();
+	unsigned int n = count;
+	writeBytes(fout, &n, 4, swap);
+	unsigned short attributes = 0;
+	for (int i = 0; i < count; i++) {
+		const float* v = triangles + 9 * i;
+		float normal[3] = { 0.0f, 0.0f, 0.0f };
+		for (int k = 0; k < 3; k++) {
+			writeBytes(fout, &normal[k], 4, swap);
+		}
+		for (int k = 0; k < 9; k++) {
+			writeBytes(fout, &v[k], 4, swap);
+		}
+		fwrite(&attributes, 2, 1, fout);
+	}
+	fclose(fout);
+}
 
-	if (withColor) {
-		float rgb[3] = { 0.15, 0.15, 0.85 };
-		drawRawMesh(_lamp_bases_mesh, (float*) rgb);
-	} else {
-		drawRawMeshWithoutColor(_lamp_bases_mesh);
+long fileSize(const char* file) {
+	FILE* f = fopen(file, "rb");
+	if (!f) {
+		return 0;
 	}
-	glPopMatrix();
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+	return size;
 }
 
-void drawLampPoint(bool withColor) {
-	glPushMatrix();
+void printLoadTiming(const char* file, const char* format, double parseMs,
+		double buildMs, double asciiParseMs, bool same) {
+	printf("  %-36s %-22s %6.0f KB  parse %8.2f ms (%5.1fx)  build %8.2f ms"
+			"  %s\n", file, format, fileSize(file) / 1024.0, parseMs,
+			parseMs > 0.0 ? asciiParseMs / parseMs : 0.0, buildMs,
+			same ? "same mesh" : "MISMATCH");
+}
 
-	GLfloat emission[4] = { 1.0, 1.0, 1.0, 1.0 };
-	GLfloat ambient[4] = { 1.0, 1.0, 1.0, 1.0 };
-	GLfloat diffuse[4] = { 1.0, 1.0, 1.0, 1.0 };
-	GLfloat shininess[4] = { 1.0, 1.0, 1.0, 1.0 };
-	glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emission);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, shininess);
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 25.0);
+/*
+ * --bench-load: for every ASCII mesh given, writes binary STL and PLY
+ * copies next to it, loads each version and compares parse and build
+ * time against the ASCII reader. The copies are removed afterwards.
+ */
+int benchLoad(int count, char** files) {
+	for (int f = 0; f < count; f++) {
+		const char* file = files[f];
+		std::string stl = std::string(file) + ".bench.stl";
+		std::string ply = std::string(file) + ".bench.ply";
+		std::string plyNormals = std::string(file) + ".bench.n.ply";
+		std::string plyBig = std::string(file) + ".bench.be.ply";
+		printf("%s\n", file);
+		double start;
+		double parseMs;
+		double buildMs;
+		if (hasExtension(file, ".off")) {
+			std::vector<float> vertices;
+			std::vector<int> faces;
+			start = nowMs();
+			if (!parseOFFMesh(file, vertices, faces)) {
+				return 65;
+			}
+			double asciiMs = nowMs() - start;
+			int nv = vertices.size() / 3;
+			int nf = faces.size() / 3;
+			start = nowMs();
+			SurFaceMesh* mesh = buildOFFMesh(&vertices[0], nv, &faces[0], nf);
+			printLoadTiming(file, "ascii off", asciiMs, nowMs() - start, asciiMs,
+					true);
+			writeBinaryPLY(ply.c_str(), mesh, false, false);
+			writeBinaryPLY(plyNormals.c_str(), mesh, true, false);
+			writeBinaryPLY(plyBig.c_str(), mesh, false, true);
+			const char* plys[3] = { ply.c_str(), plyNormals.c_str(),
+					plyBig.c_str() };
+			const char* names[3] = { "binary ply", "binary ply + normals",
+					"binary ply big endian" };
+			for (int i = 0; i < 3; i++) {
+				std::vector<float> v;
+				std::vector<int> t;
+				std::vector<float> n;
+				start = nowMs();
+				parsePLYMesh(plys[i], v, t, n);
+				parseMs = nowMs() - start;
+				start = nowMs();
+				SurFaceMesh* loaded = buildOFFMesh(&v[0], v.size() / 3, &t[0],
+						t.size() / 3);
+				buildMs = nowMs() - start;
+				printLoadTiming(plys[i], names[i], parseMs, buildMs, asciiMs,
+						v == vertices && t == faces && loaded->nf == nf);
+				remove(plys[i]);
+			}
+			std::vector<float> soup(9 * nf);
+			for (int i = 0; i < nf; i++) {
+				for (int k = 0; k < 3; k++) {
+					memcpy(&soup[9 * i + 3 * k], &vertices[3 * faces[3 * i + k]],
+							3 * sizeof(float));
+				}
+			}
+			writeBinarySTL(stl.c_str(), &soup[0], nf);
+			std::vector<float> triangles;
+			start = nowMs();
+			parseSTLMesh(stl.c_str(), triangles);
+			parseMs = nowMs() - start;
+			RawMesh* loaded;
+			start = nowMs();
+			buildRawMesh(&triangles[0], nf, &loaded);
+			buildMs = nowMs() - start;
+			printLoadTiming(stl.c_str(), "binary stl", parseMs, buildMs, asciiMs,
+					triangles == soup);
+			remove(stl.c_str());
+			continue;
+		}
 
-	if (withColor) {
-		float rgb[3] = { 0.15, 0.15, 0.85 };
-		drawRawMesh(_lamp_point_mesh, (float*) rgb);
-	} else {
-		drawRawMeshWithoutColor(_lamp_point_mesh);
+		std::vector<float> triangles;
+		start = nowMs();
+		if (!parseRawMesh(file, triangles)) {
+			return 65;
+		}
+		double asciiMs = nowMs() - start;
+		int tris = triangles.size() / 9;
+		RawMesh* mesh;
+		start = nowMs();
+		buildRawMesh(&triangles[0], tris, &mesh);
+		double asciiBuildMs = nowMs() - start;
+		printLoadTiming(file, "ascii raw", asciiMs, asciiBuildMs, asciiMs, true);
+
+		writeBinarySTL(stl.c_str(), &triangles[0], tris);
+		std::vector<float> binary;
+		start = nowMs();
+		parseSTLMesh(stl.c_str(), binary);
+		parseMs = nowMs() - start;
+		RawMesh* loaded;
+		start = nowMs();
+		buildRawMesh(&binary[0], tris, &loaded);
+		buildMs = nowMs() - start;
+		printLoadTiming(stl.c_str(), "binary stl", parseMs, buildMs, asciiMs,
+				binary == triangles);
+		remove(stl.c_str());
+
+		/* the welded RAW mesh, written indexed */
+		std::map<FLTVECTPLUS*, int> index;
+		std::vector<float> vertices;
+		std::vector<int> faces;
+		for (int i = 0; i < tris; i++) {
+			FLTVECTPLUS* p[3] = { mesh->list[i].p1, mesh->list[i].p2,
+					mesh->list[i].p3 };
+			for (int k = 0; k < 3; k++) {
+				if (index.find(p[k]) == index.end()) {
+					index[p[k]] = vertices.size() / 3;
+					vertices.push_back(p[k]->x);
+					vertices.push_back(p[k]->y);
+					vertices.push_back(p[k]->z);
+				}
+				faces.push_back(index[p[k]]);
+			}
+		}
+		SurFaceMesh* indexed = buildOFFMesh(&vertices[0], vertices.size() / 3,
+				&faces[0], tris);
+		writeBinaryPLY(ply.c_str(), indexed, false, false);
+		std::vector<float> v;
+		std::vector<int> t;
+		std::vector<float> n;
+		start = nowMs();
+		parsePLYMesh(ply.c_str(), v, t, n);
+		parseMs = nowMs() - start;
+		start = nowMs();
+		buildOFFMesh(&v[0], v.size() / 3, &t[0], t.size() / 3);
+		buildMs = nowMs() - start;
+		printLoadTiming(ply.c_str(), "binary ply (welded)", parseMs, buildMs,
+				asciiMs, v == vertices && t == faces);
+		remove(ply.c_str());
 	}
-	glPopMatrix();
+	return 0;
 }
 
-void drawLampSpotlight(bool withColor) {
-	glPushMatrix();
+/*
+ * Mesh cleanup
+ *
+ * Runs on the parsed arrays, before buildRawMesh()/buildOFFMesh(). Vertices
+ * are matched by exact position; a triangle is dropped if two of its
+ * corners are the same vertex, if its area is negligible next to the
+ * mesh's size, or if it is a sliver (twice its area over its longest edge
+ * squared below CLEAN_COLLINEAR). A triangle over the same three vertices
+ * as an earlier one is dropped as a duplicate; it is counted as flipped if
+ * its winding is the other way round. Indexed meshes then lose the
+ * vertices no face uses.
+ *
+ * The result is cached next to the mesh as <file>.clean and reused while
+ * the mesh's size and modification time are unchanged.
+ */
+#define CLEAN_MAGIC 0x4e4c4350
+#define CLEAN_VERSION 1
+#define CLEAN_AREA 1e-12
+#define CLEAN_COLLINEAR 1e-6
 
-	GLfloat emission[4] = { 0.0, 0.0, 1.0, 1.0 };
-	GLfloat ambient[4] = { 0.0, 0.0, 1.0, 1.0 };
-	GLfloat diffuse[4] = { 0.0, 0.0, 1.0, 1.0 };
-	GLfloat shininess[4] = { 0.0, 0.0, 1.0, 1.0 };
-	glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emission);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, shininess);
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 25.0);
+typedef struct {
+	int triangles;
+	int collapsed;
+	int zeroArea;
+	int collinear;
+	int duplicates;
+	int flipped;
+	int vertices;
+	int unusedVertices;
+	double ms;
+	bool cached;
+} MESHREPORT;
 
-	if (withColor) {
-		float rgb[3] = { 0.15, 0.15, 0.85 };
-		drawRawMesh(_lamp_spotlight_mesh, (float*) rgb);
-	} else {
-		drawRawMeshWithoutColor(_lamp_spotlight_mesh);
+typedef struct {
+	int magic;
+	int version;
+	long long sourceSize;
+	long long sourceTime;
+	int floats;
+	int ints;
+	MESHREPORT report;
+} CLEANHEADER;
+
+typedef struct {
+	int v[3];
+	int face;
+} FACEKEY;
+
+struct PositionHash {
+	size_t operator()(const std::vector<float>::const_iterator& p) const {
+		unsigned int bits[3];
+		memcpy(bits, &*p, sizeof(bits));
+		return bits[0] * 73856093u ^ bits[1] * 19349663u ^ bits[2] * 83492791u;
 	}
-	glPopMatrix();
-}
+};
 
-void drawScene(bool withColor) {
-	glPushMatrix();
-	if (withColor) {
-		drawRawMesh(_scene_mesh, 0);
-	} else {
-		drawRawMeshWithoutColor(_scene_mesh);
+struct PositionEqual {
+	bool operator()(const std::vector<float>::const_iterator& a,
+			const std::vector<float>::const_iterator& b) const {
+		return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+	}
+};
+
+/* the first vertex at each position stands for all of them */
+void findCanonicalVertices(const std::vector<float>& vertices,
+		std::vector<int>& canonical) {
+	typedef std::unordered_map<std::vector<float>::const_iterator, int,
+			PositionHash, PositionEqual> POSITIONMAP;
+	int count = vertices.size() / 3;
+	POSITIONMAP first(count);
+	canonical.resize(count);
+	for (int i = 0; i < count; i++) {
+		std::pair<POSITIONMAP::iterator, bool> slot = first.insert(
+				std::make_pair(vertices.begin() + 3 * i, i));
+		canonical[i] = slot.first->second;
 	}
-	glPopMatrix();
 }
 
-void setUpSpotlight() {
-	glEnable(GL_LIGHT2);
-	GLfloat pos[4] = { -1.2, -5.8, 0.2, 1.0 };
-	glLightfv(GL_LIGHT2, GL_POSITION, pos);
-	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat diffuse[4] = { 1.0, 1.0, 1.0, 1.0 };
-	GLfloat specular[4] = { 1.0, 1.0, 1.0, 1.0 };
-	glLightfv(GL_LIGHT2, GL_AMBIENT, ambient);
-	glLightfv(GL_LIGHT2, GL_DIFFUSE, diffuse);
-	glLightfv(GL_LIGHT2, GL_SPECULAR, specular);
-	GLfloat direction[3] = { -2.0, 1.0, -0.1 };
-	glLightfv(GL_LIGHT2, GL_SPOT_DIRECTION, direction);
-	glLightf(GL_LIGHT2, GL_SPOT_CUTOFF, 40.0);
-	glLightf(GL_LIGHT2, GL_SPOT_EXPONENT, 0.0);
+bool compareFaceKeys(const FACEKEY& a, const FACEKEY& b) {
+	if (a.v[0] != b.v[0]) {
+		return a.v[0] < b.v[0];
+	}
+	if (a.v[1] != b.v[1]) {
+		return a.v[1] < b.v[1];
+	}
+	if (a.v[2] != b.v[2]) {
+		return a.v[2] < b.v[2];
+	}
+	return a.face < b.face;
 }
 
-void setUpPointlight() {
-	glEnable(GL_LIGHT3);
-	GLfloat pos[4] = { 2.1, -6.2, 0.2, 1.0 };
-	glLightfv(GL_LIGHT3, GL_POSITION, pos);
-	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat diffuse[4] = { 1.0, 1.0, 1.0, 1.0 };
-	GLfloat specular[4] = { 1.0, 1.0, 1.0, 1.0 };
-	glLightfv(GL_LIGHT3, GL_AMBIENT, ambient);
-	glLightfv(GL_LIGHT3, GL_DIFFUSE, diffuse);
-	glLightfv(GL_LIGHT3, GL_SPECULAR, specular);
+/* true if (a, b, c) is a rotation of (x, y, z) */
+bool sameWinding(int a, int b, int c, int x, int y, int z) {
+	return (a == x && b == y && c == z) || (a == y && b == z && c == x)
+			|| (a == z && b == x && c == y);
 }
 
-void drawAll(bool withColor, bool separate) {
-	if (separate) {
-		glPushMatrix();
-		glScalef(3.0, 3.0, 3.0);
-		glRotatef(-80, 1.0, 0.0, 0.0);
-		drawRoomWalls(withColor);
-		drawBrotherBlender(withColor);
-		drawBlenderMonkey(withColor);
-		drawTables(withColor);
-		drawLampBases(withColor);
-		drawLampPoint(withColor);
-		drawLampSpotlight(withColor);
-		drawSampleMesh(true);
-		if (_spotLightState == SPOT_LIGHT_ON) {
-			setUpSpotlight();
-		} else {
-			glDisable(GL_LIGHT2);
+/* keeps[i] is cleared for every face that goes; returns the kept count */
+int cleanFaces(const std::vector<float>& vertices, std::vector<int>& faces,
+		std::vector<char>& keep, MESHREPORT* report) {
+	std::vector<int> canonical;
+	findCanonicalVertices(vertices, canonical);
+	float bmin[3];
+	float bmax[3];
+	emptyBounds(bmin, bmax);
+	for (size_t i = 0; i < vertices.size(); i += 3) {
+		growBounds(bmin, bmax, vertices[i], vertices[i + 1], vertices[i + 2]);
+	}
+	double diagonal2 = 0.0;
+	for (int k = 0; k < 3; k++) {
+		diagonal2 += (bmax[k] - bmin[k]) * (double) (bmax[k] - bmin[k]);
+	}
+	int nf = faces.size() / 3;
+	keep.assign(nf, 1);
+	std::vector<FACEKEY> keys;
+	keys.reserve(nf);
+	for (int f = 0; f < nf; f++) {
+		int a = canonical[faces[3 * f]];
+		int b = canonical[faces[3 * f + 1]];
+		int c = canonical[faces[3 * f + 2]];
+		if (a == b || b == c || a == c) {
+			report->collapsed++;
+			keep[f] = 0;
+			continue;
 		}
-		if (_pointLightState == POINT_LIGHT_ON) {
-			setUpPointlight();
-		} else {
-			glDisable(GL_LIGHT3);
+		const float* p = &vertices[3 * a];
+		const float* q = &vertices[3 * b];
+		const float* r = &vertices[3 * c];
+		double e1[3], e2[3], e3[3];
+		for (int k = 0; k < 3; k++) {
+			e1[k] = q[k] - p[k];
+			e2[k] = r[k] - p[k];
+			e3[k] = r[k] - q[k];
+		}
+		double nx = e1[1] * e2[2] - e1[2] * e2[1];
+		double ny = e1[2] * e2[0] - e1[0] * e2[2];
+		double nz = e1[0] * e2[1] - e1[1] * e2[0];
+		double area2 = sqrt(nx * nx + ny * ny + nz * nz);
+		double longest = std::max(e1[0] * e1[0] + e1[1] * e1[1] + e1[2] * e1[2],
+				std::max(e2[0] * e2[0] + e2[1] * e2[1] + e2[2] * e2[2],
+						e3[0] * e3[0] + e3[1] * e3[1] + e3[2] * e3[2]));
+		if (area2 <= 2.0 * CLEAN_AREA * diagonal2) {
+			report->zeroArea++;
+			keep[f] = 0;
+			continue;
+		}
+		if (area2 < CLEAN_COLLINEAR * longest) {
+			report->collinear++;
+			keep[f] = 0;
+			continue;
+		}
+		FACEKEY key;
+		key.v[0] = a;
+		key.v[1] = b;
+		key.v[2] = c;
+		std::sort(key.v, key.v + 3);
+		key.face = f;
+		keys.push_back(key);
+	}
+	std::sort(keys.begin(), keys.end(), compareFaceKeys);
+	/* equal keys are sorted by face, so a run starts with the one to keep */
+	size_t run = 0;
+	for (size_t i = 1; i < keys.size(); i++) {
+		if (memcmp(keys[i].v, keys[run].v, sizeof(keys[run].v)) != 0) {
+			run = i;
+			continue;
+		}
+		int f = keys[i].face;
+		int g = keys[run].face;
+		keep[f] = 0;
+		report->duplicates++;
+		if (!sameWinding(canonical[faces[3 * f]], canonical[faces[3 * f + 1]],
+				canonical[faces[3 * f + 2]], canonical[faces[3 * g]],
+				canonical[faces[3 * g + 1]], canonical[faces[3 * g + 2]])) {
+			report->flipped++;
 		}
-		glPopMatrix();
-	} else {
-		drawScene(withColor);
 	}
+	int kept = 0;
+	for (int f = 0; f < nf; f++) {
+		kept += keep[f];
+	}
+	return kept;
 }
 
-void drawAllWithMode() {
-	if (_polygon_render_mode == POLYGON_MODE_FILL) {
-		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-		drawAll(true, true);
-	} else if (_polygon_render_mode == POLYGON_MODE_POINT) {
-		glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
+/* RAW and STL: every triangle has its own three corners */
+void cleanTriangleSoup(std::vector<float>& triangles, MESHREPORT* report) {
+	int count = triangles.size() / 9;
+	std::vector<int> faces(3 * count);
+	for (int i = 0; i < 3 * count; i++) {
+		faces[i] = i;
+	}
+	std::vector<char> keep;
+	cleanFaces(triangles, faces, keep, report);
+	int out = 0;
+	for (int f = 0; f < count; f++) {
+		if (keep[f]) {
+			memmove(&triangles[9 * out], &triangles[9 * f], 9 * sizeof(float));
+			out++;
+		}
+	}
+	triangles.resize(9 * out);
+	report->triangles = out;
+}
+
+/* OFF and PLY */
+void cleanIndexedMesh(std::vector<float>& vertices, std::vector<int>& faces,
+		MESHREPORT* report) {
+	int nf = faces.size() / 3;
+	std::vector<char> keep;
+	cleanFaces(vertices, faces, keep, report);
+	int out = 0;
+	for (int f = 0; f < nf; f++) {
+		if (keep[f]) {
+			memmove(&faces[3 * out], &faces[3 * f], 3 * sizeof(int));
+			out++;
+		}
+	}
+	faces.resize(3 * out);
+	int nv = vertices.size() / 3;
+	std::vector<int> remap(nv, -1);
+	int used = 0;
+	for (int i = 0; i < 3 * out; i++) {
+		int v = faces[i];
+		if (remap[v] < 0) {
+			remap[v] = used++;
+		}
+		faces[i] = remap[v];
+	}
+	std::vector<float> compact(3 * used);
+	for (int v = 0; v < nv; v++) {
+		if (remap[v] >= 0) {
+			memcpy(&compact[3 * remap[v]], &vertices[3 * v], 3 * sizeof(float));
+		}
+	}
+	vertices.swap(compact);
+	report->unusedVertices = nv - used;
+	report->vertices = used;
+	report->triangles = out;
+}
+
+long long fileTime(const char* file) {
+	struct stat info;
+	if (stat(file, &info) != 0) {
+		return 0;
+	}
+	return info.st_mtime;
+}
+
+bool readCleanCache(const char* file, std::vector<float>& floats,
+		std::vector<int>& ints, MESHREPORT* report) {
+	std::string cache = std::string(file) + ".clean";
+	FILE* fin = fopen(cache.c_str(), "rb");
+	if (!fin) {
+		return false;
+	}
+	CLEANHEADER header;
+	bool ok = fread(&header, sizeof(CLEANHEADER), 1, fin) == 1
+			&& header.magic == CLEAN_MAGIC && header.version == CLEAN_VERSION
+			&& header.sourceSize == fileSize(file)
+			&& header.sourceTime == fileTime(file) && header.floats >= 0
+			&& header.ints >= 0;
+	if (ok) {
+		floats.resize(header.floats);
+		ints.resize(header.ints);
+		ok = (header.floats == 0
+				|| fread(&floats[0], sizeof(float), header.floats, fin)
+						== (size_t) header.floats)
+				&& (header.ints == 0
+						|| fread(&ints[0], sizeof(int), header.ints, fin)
+								== (size_t) header.ints);
+	}
+	fclose(fin);
+	if (ok) {
+		*report = header.report;
+	}
+	return ok;
+}
+
+void writeCleanCache(const char* file, const std::vector<float>& floats,
+		const std::vector<int>& ints, const MESHREPORT* report) {
+	std::string cache = std::string(file) + ".clean";
+	FILE* fout = fopen(cache.c_str(), "wb");
+	if (!fout) {
+		return;
+	}
+	CLEANHEADER header;
+	memset(&header, 0, sizeof(CLEANHEADER));
+	header.magic = CLEAN_MAGIC;
+	header.version = CLEAN_VERSION;
+	header.sourceSize = fileSize(file);
+	header.sourceTime = fileTime(file);
+	header.floats = floats.size();
+	header.ints = ints.size();
+	header.report = *report;
+	fwrite(&header, sizeof(CLEANHEADER), 1, fout);
+	if (!floats.empty()) {
+		fwrite(&floats[0], sizeof(float), floats.size(), fout);
+	}
+	if (!ints.empty()) {
+		fwrite(&ints[0], sizeof(int), ints.size(), fout);
+	}
+	fclose(fout);
+}
+
+void printMeshReport(const char* file, const MESHREPORT* report) {
+	printf("%s: %d triangles kept, removed %d collapsed, %d zero area, "
+			"%d collinear, %d duplicate (%d flipped), %d unused vertices, "
+			"%.1f ms%s\n", file, report->triangles, report->collapsed,
+			report->zeroArea, report->collinear, report->duplicates,
+			report->flipped, report->unusedVertices, report->ms,
+			report->cached ? " (cached)" : "");
+}
+
+/*
+ * The parsers with the cleanup pass in between: RAW and STL go through
+ * readCleanRawMesh(), OFF and PLY through readCleanOFFMesh() (PLY normals
+ * are recomputed like OFF ones). These run on the job workers, so a file
+ * that cannot be read is returned as false for the caller to handle, not
+ * exited on.
+ */
+bool readCleanRawMesh(const char* file, RawMesh** mesh, MESHREPORT* report) {
+	double start = nowMs();
+	std::vector<float> triangles;
+	std::vector<int> unused;
+	memset(report, 0, sizeof(MESHREPORT));
+	if (readCleanCache(file, triangles, unused, report)) {
+		report->cached = true;
+	} else if (hasExtension(uncompressedName(file).c_str(), ".stl")
+			? parseSTLMesh(file, triangles) : parseRawMesh(file, triangles)) {
+		cleanTriangleSoup(triangles, report);
+		writeCleanCache(file, triangles, unused, report);
+	} else {
+		return false;
+	}
+	int count = triangles.size() / 9;
+	buildRawMesh(count ? &triangles[0] : 0, count, mesh);
+	report->ms = nowMs() - start;
+	return true;
+}
+
+bool readCleanOFFMesh(const char* file, SurFaceMesh** mesh,
+		MESHREPORT* report) {
+	double start = nowMs();
+	std::vector<float> vertices;
+	std::vector<int> faces;
+	std::vector<float> normals;
+	memset(report, 0, sizeof(MESHREPORT));
+	if (readCleanCache(file, vertices, faces, report)) {
+		report->cached = true;
+	} else if (hasExtension(uncompressedName(file).c_str(), ".ply")
+			? parsePLYMesh(file, vertices, faces, normals)
+			: parseOFFMesh(file, vertices, faces)) {
+		cleanIndexedMesh(vertices, faces, report);
+		writeCleanCache(file, vertices, faces, report);
+	} else {
+		return false;
+	}
+	int nv = vertices.size() / 3;
+	int nf = faces.size() / 3;
+	*mesh = buildOFFMesh(nv ? &vertices[0] : 0, nv, nf ? &faces[0] : 0, nf);
+	report->ms = nowMs() - start;
+	return true;
+}
+
+bool readCleanMeshFile(const char* file, RawMesh** raw, SurFaceMesh** off,
+		MESHREPORT* report) {
+	*raw = 0;
+	*off = 0;
+	std::string name = uncompressedName(file);
+	if (hasExtension(name.c_str(), ".off")
+			|| hasExtension(name.c_str(), ".ply")) {
+		return readCleanOFFMesh(file, off, report);
+	}
+	return readCleanRawMesh(file, raw, report);
+}
+
+/*
+ * Vertex streams
+ *
+ * Every mesh gets two ready-to-draw streams at load time, so switching
+ * between flat and smooth shading only picks a buffer. The flat stream
+ * repeats each corner with its face normal. The smooth stream is indexed:
+ * the faces around a vertex fall into smoothing groups, joined across the
+ * edges where they meet within _crease_angle of each other, and each group
+ * shares one vertex with the area weighted normal of its faces, so a hard
+ * edge splits the vertex into a copy per side instead of blurring it. The
+ * faces around each vertex come from a counting sort of the corners, and
+ * the groups from one pass over each fan, linear in the mesh size.
+ * The point stream has every welded vertex once, with the normal of all its
+ * faces, in a fixed random order so that any prefix of it is an even sample
+ * of the mesh (see drawPointStreams()).
+ */
+float _crease_angle = 40.0f;
+
+int findGroup(std::vector<int>& group, int k) {
+	while (group[k] != k) {
+		group[k] = group[group[k]];
+		k = group[k];
+	}
+	return k;
+}
+
+MESHSTREAMS* buildMeshStreams(const std::vector<float>& positions,
+		const std::vector<int>& corners) {
+	double start = nowMs();
+	MESHSTREAMS* streams = new MESHSTREAMS;
+	int nv = positions.size() / 3;
+	int nf = corners.size() / 3;
+	streams->triangles = nf;
+	streams->vertices = nv;
+	streams->uploaded = false;
+
+	std::vector<float> normals(3 * nf);
+	std::vector<float> areas(nf);
+	for (int f = 0; f < nf; f++) {
+		const float* p1 = &positions[3 * corners[3 * f]];
+		const float* p2 = &positions[3 * corners[3 * f + 1]];
+		const float* p3 = &positions[3 * corners[3 * f + 2]];
+		float u[3] = { p2[0] - p1[0], p2[1] - p1[1], p2[2] - p1[2] };
+		float v[3] = { p3[0] - p1[0], p3[1] - p1[1], p3[2] - p1[2] };
+		float* n = &normals[3 * f];
+		n[0] = u[1] * v[2] - u[2] * v[1];
+		n[1] = u[2] * v[0] - v[2] * u[0];
+		n[2] = u[0] * v[1] - u[1] * v[0];
+		areas[f] = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		if (areas[f] > 0.0f) {
+			n[0] /= areas[f];
+			n[1] /= areas[f];
+			n[2] /= areas[f];
+		}
+	}
+
+	streams->centers.resize(3 * nf);
+	for (int f = 0; f < nf; f++) {
+		for (int k = 0; k < 3; k++) {
+			streams->centers[3 * f + k] = (positions[3 * corners[3 * f] + k]
+					+ positions[3 * corners[3 * f + 1] + k]
+					+ positions[3 * corners[3 * f + 2] + k]) / 3.0f;
+		}
+	}
+
+	streams->flat.reserve(18 * nf);
+	for (int c = 0; c < 3 * nf; c++) {
+		streams->flat.insert(streams->flat.end(), &normals[3 * (c / 3)],
+				&normals[3 * (c / 3)] + 3);
+		streams->flat.insert(streams->flat.end(), &positions[3 * corners[c]],
+				&positions[3 * corners[c]] + 3);
+	}
+
+	std::vector<int> first(nv + 1, 0);
+	for (int c = 0; c < 3 * nf; c++) {
+		first[corners[c] + 1]++;
+	}
+	for (int v = 0; v < nv; v++) {
+		first[v + 1] += first[v];
+	}
+	std::vector<int> around(3 * nf);
+	std::vector<int> next(first.begin(), first.end() - 1);
+	for (int c = 0; c < 3 * nf; c++) {
+		around[next[corners[c]]++] = c;
+	}
+
+	float creaseCos = cos(_crease_angle * PI / 180.0f);
+	std::vector<int> owner(nv, -1);
+	std::vector<int> group(3 * nf);
+	std::vector<int> slot(3 * nf);
+	std::vector<float> sums(9 * nf);
+	streams->indices.resize(3 * nf);
+	streams->points.resize(6 * nv);
+	for (int v = 0; v < nv; v++) {
+		float* point = &streams->points[6 * v];
+		point[0] = point[1] = point[2] = 0.0f;
+		for (int k = first[v]; k < first[v + 1]; k++) {
+			int f = around[k] / 3;
+			for (int axis = 0; axis < 3; axis++) {
+				point[axis] += normals[3 * f + axis] * areas[f];
+			}
+		}
+		float length = sqrt(point[0] * point[0] + point[1] * point[1]
+				+ point[2] * point[2]);
+		for (int axis = 0; axis < 3; axis++) {
+			if (length > 0.0f) {
+				point[axis] /= length;
+			}
+			point[3 + axis] = positions[3 * v + axis];
+		}
+		/* corners whose faces share the edge to w meet at owner[w] */
+		for (int k = first[v]; k < first[v + 1]; k++) {
+			group[k] = k;
+			slot[k] = -1;
+			sums[3 * k] = sums[3 * k + 1] = sums[3 * k + 2] = 0.0f;
+		}
+		for (int k = first[v]; k < first[v + 1]; k++) {
+			int c = around[k];
+			const float* n = &normals[3 * (c / 3)];
+			for (int side = 1; side <= 2; side++) {
+				int w = corners[c - c % 3 + (c + side) % 3];
+				int other = owner[w];
+				if (other < 0) {
+					owner[w] = k;
+					continue;
+				}
+				const float* m = &normals[3 * (around[other] / 3)];
+				if (n[0] * m[0] + n[1] * m[1] + n[2] * m[2] >= creaseCos) {
+					group[findGroup(group, k)] = findGroup(group, other);
+				}
+			}
+		}
+		for (int k = first[v]; k < first[v + 1]; k++) {
+			int c = around[k];
+			owner[corners[c - c % 3 + (c + 1) % 3]] = -1;
+			owner[corners[c - c % 3 + (c + 2) % 3]] = -1;
+			int f = c / 3;
+			float* sum = &sums[3 * findGroup(group, k)];
+			sum[0] += normals[3 * f] * areas[f];
+			sum[1] += normals[3 * f + 1] * areas[f];
+			sum[2] += normals[3 * f + 2] * areas[f];
+		}
+		for (int k = first[v]; k < first[v + 1]; k++) {
+			int root = findGroup(group, k);
+			if (slot[root] < 0) {
+				float* sum = &sums[3 * root];
+				float len = sqrt(
+						sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2]);
+				if (len > 0.0f) {
+					sum[0] /= len;
+					sum[1] /= len;
+					sum[2] /= len;
+				}
+				slot[root] = streams->smooth.size() / 6;
+				streams->smooth.insert(streams->smooth.end(), sum, sum + 3);
+				streams->smooth.insert(streams->smooth.end(), &positions[3 * v],
+						&positions[3 * v] + 3);
+			}
+			streams->indices[around[k]] = slot[root];
+		}
+	}
+	streams->smoothVertices = streams->smooth.size() / 6;
+	unsigned int random = 2463534242u;
+	for (int v = nv - 1; v > 0; v--) {
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		int other = random % (v + 1);
+		for (int k = 0; k < 6; k++) {
+			std::swap(streams->points[6 * v + k],
+					streams->points[6 * other + k]);
+		}
+	}
+	streams->ms = nowMs() - start;
+	return streams;
+}
+
+/* the welded corners become the vertices, numbered in order of appearance */
+void getRawMeshCorners(const RawMesh* mesh, std::vector<float>& positions,
+		std::vector<int>& corners) {
+	std::unordered_map<const FLTVECTPLUS*, int> numbers;
+	positions.clear();
+	corners.resize(3 * mesh->count);
+	for (int i = 0; i < mesh->count; i++) {
+		const FLTVECTPLUS* points[3] = { mesh->list[i].p1, mesh->list[i].p2,
+				mesh->list[i].p3 };
+		for (int k = 0; k < 3; k++) {
+			std::pair<std::unordered_map<const FLTVECTPLUS*, int>::iterator,
+					bool> found = numbers.insert(
+					std::make_pair(points[k], (int) numbers.size()));
+			if (found.second) {
+				positions.push_back(points[k]->x);
+				positions.push_back(points[k]->y);
+				positions.push_back(points[k]->z);
+			}
+			corners[3 * i + k] = found.first->second;
+		}
+	}
+}
+
+void getOFFMeshCorners(const SurFaceMesh* mesh, std::vector<float>& positions,
+		std::vector<int>& corners) {
+	positions.resize(3 * mesh->nv);
+	corners.resize(3 * mesh->nf);
+	for (int i = 0; i < mesh->nv; i++) {
+		positions[3 * i] = mesh->vertex[i].x;
+		positions[3 * i + 1] = mesh->vertex[i].y;
+		positions[3 * i + 2] = mesh->vertex[i].z;
+	}
+	for (int i = 0; i < mesh->nf; i++) {
+		corners[3 * i] = mesh->face[i].a;
+		corners[3 * i + 1] = mesh->face[i].b;
+		corners[3 * i + 2] = mesh->face[i].c;
+	}
+}
+
+void buildRawMeshStreams(RawMesh* mesh) {
+	std::vector<float> positions;
+	std::vector<int> corners;
+	getRawMeshCorners(mesh, positions, corners);
+	mesh->streams = buildMeshStreams(positions, corners);
+}
+
+void buildOFFMeshStreams(SurFaceMesh* mesh) {
+	std::vector<float> positions;
+	std::vector<int> corners;
+	getOFFMeshCorners(mesh, positions, corners);
+	mesh->streams = buildMeshStreams(positions, corners);
+}
+
+void printStreamReport(const MESHSTREAMS* streams) {
+	printf("    streams: %d flat, %d smooth vertices (%d split at %.0f deg), "
+			"%.1f ms\n", 3 * streams->triangles, streams->smoothVertices,
+			streams->smoothVertices - streams->vertices, _crease_angle,
+			streams->ms);
+}
+
+long long streamBytes(const MESHSTREAMS* streams) {
+	if (!streams) {
+		return 0;
+	}
+	return sizeof(MESHSTREAMS)
+			+ (streams->flat.capacity() + streams->smooth.capacity()
+					+ streams->points.capacity()) * sizeof(float)
+			+ streams->indices.capacity() * sizeof(unsigned int)
+			+ streams->centers.capacity() * sizeof(float);
+}
+
+/*
+ * moves the vertices into buffers on first draw; GL thread only. The
+ * indices and triangle centers stay for sortTransparentTriangles()
+ */
+void uploadMeshStreams(MESHSTREAMS* streams) {
+	glGenBuffers(1, &streams->flatBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, streams->flatBuffer);
+	glBufferData(GL_ARRAY_BUFFER, streams->flat.size() * sizeof(float),
+			&streams->flat[0], GL_STATIC_DRAW);
+	glGenBuffers(1, &streams->smoothBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, streams->smoothBuffer);
+	glBufferData(GL_ARRAY_BUFFER, streams->smooth.size() * sizeof(float),
+			&streams->smooth[0], GL_STATIC_DRAW);
+	glGenBuffers(1, &streams->indexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, streams->indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+			streams->indices.size() * sizeof(unsigned int),
+			&streams->indices[0], GL_STATIC_DRAW);
+	/* the smooth stream unindexed, for drawWireframeStreams() */
+	std::vector<float> wire(6 * streams->indices.size());
+	for (size_t c = 0; c < streams->indices.size(); c++) {
+		memcpy(&wire[6 * c], &streams->smooth[6 * streams->indices[c]],
+				6 * sizeof(float));
+	}
+	glGenBuffers(1, &streams->wireBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, streams->wireBuffer);
+	glBufferData(GL_ARRAY_BUFFER, wire.size() * sizeof(float), &wire[0],
+			GL_STATIC_DRAW);
+	glGenBuffers(1, &streams->pointBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, streams->pointBuffer);
+	glBufferData(GL_ARRAY_BUFFER, streams->points.size() * sizeof(float),
+			&streams->points[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	std::vector<float>().swap(streams->flat);
+	std::vector<float>().swap(streams->smooth);
+	std::vector<float>().swap(streams->points);
+	streams->uploaded = true;
+}
+
+void drawMeshStreams(MESHSTREAMS* streams, bool flat) {
+	if (streams->triangles == 0) {
+		return;
+	}
+	if (!streams->uploaded) {
+		uploadMeshStreams(streams);
+	}
+	glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+	if (flat) {
+		glBindBuffer(GL_ARRAY_BUFFER, streams->flatBuffer);
+		glInterleavedArrays(GL_N3F_V3F, 0, 0);
+		glDrawArrays(GL_TRIANGLES, 0, 3 * streams->triangles);
+	} else {
+		glBindBuffer(GL_ARRAY_BUFFER, streams->smoothBuffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, streams->indexBuffer);
+		glInterleavedArrays(GL_N3F_V3F, 0, 0);
+		glDrawElements(GL_TRIANGLES, 3 * streams->triangles, GL_UNSIGNED_INT,
+				0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glPopClientAttrib();
+}
+
+void freeMeshStreams(MESHSTREAMS* streams) {
+	if (!streams) {
+		return;
+	}
+	if (streams->uploaded) {
+		glDeleteBuffers(1, &streams->flatBuffer);
+		glDeleteBuffers(1, &streams->smoothBuffer);
+		glDeleteBuffers(1, &streams->indexBuffer);
+		glDeleteBuffers(1, &streams->wireBuffer);
+		glDeleteBuffers(1, &streams->pointBuffer);
+	}
+	delete streams;
+}
+
+/*
+ * Asset registry
+ *
+ * Meshes are loaded through acquireAsset(), which hands out a shared,
+ * reference counted ASSET per canonical path; files with the same content
+ * under different paths share one ASSET too, found by a 64 bit FNV-1a hash
+ * of the bytes and confirmed by comparing sizes and bytes. A request for an
+ * asset another thread is still loading waits for that load instead of
+ * starting its own. releaseAsset() frees the mesh with the last handle and
+ * releaseAssets() every handle of the viewer at exit. A file that cannot
+ * be loaded stays registered without a mesh and every acquireAsset() of it
+ * returns 0.
+ */
+typedef struct {
+	std::vector<std::string> paths;
+	unsigned long long hash;
+	RawMesh* raw;
+	SurFaceMesh* off;
+	MESHREPORT report;
+	int vertices;
+	int refs;
+	bool ready;
+} ASSET;
+
+std::map<std::string, ASSET*> _assets_by_path;
+std::multimap<unsigned long long, ASSET*> _assets_by_hash;
+std::mutex _asset_lock;
+std::condition_variable _asset_ready;
+
+std::string canonicalPath(const char* file) {
+#ifdef _WIN32
+	char path[_MAX_PATH];
+	if (_fullpath(path, file, _MAX_PATH)) {
+		return path;
+	}
+#else
+	char* path = realpath(file, 0);
+	if (path) {
+		std::string canonical(path);
+		free(path);
+		return canonical;
+	}
+#endif
+	return file;
+}
+
+unsigned long long hashFile(const char* file) {
+	unsigned long long hash = 14695981039346656037ull;
+	FILE* fin = fopen(file, "rb");
+	if (!fin) {
+		return hash;
+	}
+	unsigned char buffer[65536];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), fin)) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			hash = (hash ^ buffer[i]) * 1099511628211ull;
+		}
+	}
+	fclose(fin);
+	return hash;
+}
+
+int countRawMeshVertices(const RawMesh* mesh) {
+	std::vector<FLTVECTPLUS*> points(3 * mesh->count);
+	for (int i = 0; i < mesh->count; i++) {
+		points[3 * i] = mesh->list[i].p1;
+		points[3 * i + 1] = mesh->list[i].p2;
+		points[3 * i + 2] = mesh->list[i].p3;
+	}
+	std::sort(points.begin(), points.end());
+	return std::unique(points.begin(), points.end()) - points.begin();
+}
+
+/* the welded corners are shared between triangles, free each once */
+void freeRawMesh(RawMesh* mesh) {
+	std::vector<FLTVECTPLUS*> points(3 * mesh->count);
+	for (int i = 0; i < mesh->count; i++) {
+		points[3 * i] = mesh->list[i].p1;
+		points[3 * i + 1] = mesh->list[i].p2;
+		points[3 * i + 2] = mesh->list[i].p3;
+		free(mesh->list[i].normal);
+	}
+	std::sort(points.begin(), points.end());
+	points.erase(std::unique(points.begin(), points.end()), points.end());
+	for (size_t i = 0; i < points.size(); i++) {
+		free(points[i]->normal);
+		free(points[i]);
+	}
+	free(mesh->list);
+	delete mesh->bvh;
+	freeMeshStreams(mesh->streams);
+	free(mesh);
+}
+
+void freeOFFMesh(SurFaceMesh* mesh) {
+	for (int i = 0; i < mesh->nv; i++) {
+		free(mesh->vertex[i].normal);
+	}
+	for (int i = 0; i < mesh->nf; i++) {
+		free(mesh->face[i].normal);
+	}
+	free(mesh->vertex);
+	free(mesh->face);
+	delete mesh->bvh;
+	freeMeshStreams(mesh->streams);
+	free(mesh);
+}
+
+long long bvhBytes(const BVH* bvh) {
+	if (!bvh) {
+		return 0;
+	}
+	return sizeof(BVH) + bvh->nodes.capacity() * sizeof(BVHNODE)
+			+ bvh->indices.capacity() * sizeof(int);
+}
+
+/* what the asset's mesh holds in memory right now */
+long long assetBytes(const ASSET* asset) {
+	long long bytes = sizeof(ASSET);
+	long long normal = 3 * sizeof(GLfloat);
+	if (asset->raw) {
+		bytes += sizeof(RawMesh)
+				+ asset->raw->count * (sizeof(TRIANGLEPLUS) + normal)
+				+ asset->vertices * (sizeof(FLTVECTPLUS) + normal)
+				+ bvhBytes(asset->raw->bvh)
+				+ streamBytes(asset->raw->streams);
+	}
+	if (asset->off) {
+		bytes += sizeof(SurFaceMesh)
+				+ asset->off->nv * (sizeof(FLTVECTPLUS) + normal)
+				+ asset->off->nf * (sizeof(INT3VECTPLUS) + normal)
+				+ bvhBytes(asset->off->bvh)
+				+ streamBytes(asset->off->streams);
+	}
+	return bytes;
+}
+
+bool sameFileContents(const char* a, const char* b) {
+	if (fileSize(a) != fileSize(b)) {
+		return false;
+	}
+	FILE* fa = fopen(a, "rb");
+	FILE* fb = fopen(b, "rb");
+	bool same = fa && fb;
+	static const size_t BLOCK = 65536;
+	std::vector<char> blockA(BLOCK);
+	std::vector<char> blockB(BLOCK);
+	while (same) {
+		size_t n = fread(&blockA[0], 1, BLOCK, fa);
+		same = fread(&blockB[0], 1, BLOCK, fb) == n
+				&& memcmp(&blockA[0], &blockB[0], n) == 0;
+		if (n < BLOCK) {
+			break;
+		}
+	}
+	if (fa) {
+		fclose(fa);
+	}
+	if (fb) {
+		fclose(fb);
+	}
+	return same;
+}
+
+/*
+ * With _asset_lock held; the files are compared unlocked, by path, so the
+ * asset found is looked up again afterwards.
+ */
+ASSET* findSameAsset(unsigned long long hash, const std::string& path,
+		std::unique_lock<std::mutex>& lock) {
+	typedef std::multimap<unsigned long long, ASSET*>::iterator HASHES;
+	std::pair<HASHES, HASHES> range = _assets_by_hash.equal_range(hash);
+	std::vector<std::string> candidates;
+	for (HASHES it = range.first; it != range.second; ++it) {
+		candidates.push_back(it->second->paths[0]);
+	}
+	lock.unlock();
+	std::string same;
+	for (size_t i = 0; i < candidates.size() && same.empty(); i++) {
+		if (sameFileContents(path.c_str(), candidates[i].c_str())) {
+			same = candidates[i];
+		}
+	}
+	lock.lock();
+	std::map<std::string, ASSET*>::iterator it = _assets_by_path.find(same);
+	if (same.empty() || it == _assets_by_path.end()
+			|| it->second->hash != hash) {
+		return 0;
+	}
+	return it->second;
+}
+
+/* with _asset_lock held, once the asset is ready */
+ASSET* holdAsset(ASSET* asset) {
+	if (!asset->raw && !asset->off) {
+		return 0;
+	}
+	asset->refs++;
+	return asset;
+}
+
+ASSET* acquireAsset(const char* file) {
+	std::string path = canonicalPath(file);
+	std::unique_lock<std::mutex> lock(_asset_lock);
+	std::map<std::string, ASSET*>::iterator it;
+	while ((it = _assets_by_path.find(path)) != _assets_by_path.end()) {
+		if (it->second->ready) {
+			return holdAsset(it->second);
+		}
+		_asset_ready.wait(lock);
+	}
+	ASSET* asset = new ASSET;
+	asset->paths.push_back(path);
+	asset->raw = 0;
+	asset->off = 0;
+	asset->vertices = 0;
+	asset->refs = 0;
+	asset->ready = false;
+	_assets_by_path[path] = asset;
+	lock.unlock();
+
+	unsigned long long hash = hashFile(path.c_str());
+	lock.lock();
+	ASSET* shared = findSameAsset(hash, path, lock);
+	if (shared) {
+		shared->paths.push_back(path);
+		_assets_by_path[path] = shared;
+		delete asset;
+		_asset_ready.notify_all();
+		while (!shared->ready) {
+			_asset_ready.wait(lock);
+		}
+		return holdAsset(shared);
+	}
+	asset->hash = hash;
+	_assets_by_hash.insert(std::make_pair(hash, asset));
+	lock.unlock();
+
+	bool loaded = readCleanMeshFile(path.c_str(), &asset->raw, &asset->off,
+			&asset->report);
+	if (loaded && asset->off) {
+		buildOFFMeshStreams(asset->off);
+	} else if (loaded) {
+		asset->vertices = countRawMeshVertices(asset->raw);
+		buildRawMeshStreams(asset->raw);
+	}
+
+	lock.lock();
+	asset->ready = true;
+	_asset_ready.notify_all();
+	return holdAsset(asset);
+}
+
+void releaseAsset(ASSET* asset) {
+	{
+		std::lock_guard<std::mutex> guard(_asset_lock);
+		if (--asset->refs > 0) {
+			return;
+		}
+		for (size_t i = 0; i < asset->paths.size(); i++) {
+			_assets_by_path.erase(asset->paths[i]);
+		}
+		typedef std::multimap<unsigned long long, ASSET*>::iterator HASHES;
+		std::pair<HASHES, HASHES> range = _assets_by_hash.equal_range(
+				asset->hash);
+		for (HASHES it = range.first; it != range.second; ++it) {
+			if (it->second == asset) {
+				_assets_by_hash.erase(it);
+				break;
+			}
+		}
+	}
+	if (asset->raw) {
+		freeRawMesh(asset->raw);
+	}
+	if (asset->off) {
+		freeOFFMesh(asset->off);
+	}
+	delete asset;
+}
+
+void printAssets() {
+	std::lock_guard<std::mutex> guard(_asset_lock);
+	long long total = 0;
+	int count = 0;
+	std::multimap<unsigned long long, ASSET*>::iterator it;
+	for (it = _assets_by_hash.begin(); it != _assets_by_hash.end(); ++it) {
+		ASSET* asset = it->second;
+		if (!asset->ready || (!asset->raw && !asset->off)) {
+			continue;
+		}
+		long long bytes = assetBytes(asset);
+		total += bytes;
+		count++;
+		printf("    %8.1f KB  %2d refs  %s", bytes / 1024.0, asset->refs,
+				asset->paths[0].c_str());
+		for (size_t i = 1; i < asset->paths.size(); i++) {
+			printf(", %s", asset->paths[i].c_str());
+		}
+		printf("\n");
+	}
+	printf("    %8.1f KB  in %d assets\n", total / 1024.0, count);
+}
+
+void handleMenu(int value) {
+	if (value < 5) {
+		_polygon_render_mode = value;
+	} else if (value == OPTION_ROTATE_IDLE) {
+		_idle_rotate_current = !_idle_rotate_current;
+	} else if (value == OPTION_OCCLUSION_CULLING) {
+		_occlusion_culling = !_occlusion_culling;
+	} else if (value == OPTION_DYNAMIC_RESOLUTION) {
+		_dynamic_resolution = !_dynamic_resolution;
+	} else if (value == OPTION_LIGHT_CULLING) {
+		_light_culling = !_light_culling;
+	} else if (value == OPTION_SPOT_CONES) {
+		_show_spot_cones = !_show_spot_cones;
+	} else if (value == OPTION_TWO_PASS_WIREFRAME) {
+		_two_pass_wireframe = !_two_pass_wireframe;
+	} else {
+		if (value == MESH_SAMPLE_METAL || value == MESH_SAMPLE_GLASS
+				|| value == MESH_SAMPLE_FABRIC) {
+			_mesh_sample_mat = value;
+		} else if (value == MESH_BROTHER_BLENDER_BLACK
+				|| value == MESH_BROTHER_BLENDER_WHITE) {
+			_mesh_brother_color = value;
+		} else if (value == MESH_MONKEY_BLENDER_BLACK
+				|| value == MESH_MONKEY_BLENDER_WHITE) {
+			_mesh_monkey_color = value;
+		} else if (value == ROOM_WALLS_BRICK || value == ROOM_WALLS_DRY_WALLS
+				|| value == ROOM_WALLS_STUCCO) {
+			_walls_mode = value;
+		} else if (value == SMOOTH_SHADING || value == FLAT_SHADING) {
+			_shading_model = value;
+		} else if (value == POINT_LIGHT_ON || value == POINT_LIGHT_OFF) {
+			_pointLightState = value;
+		} else if (value == SPOT_LIGHT_ON || value == SPOT_LIGHT_OFF) {
+			_spotLightState = value;
+		} else if (value == UPPER_LIGHT_WHITE || value == UPPER_LIGHT_ORANGE) {
+			_upper_light_color = value;
+		} else if (value == FRONT_LIGHT_WHITE || value == FRONT_LIGHT_TURQUOISE) {
+			_front_light_color = value;
+		} else if (value == ORIGIN_HIDDEN || value == ORIGIN_VISIBLE) {
+			_origin_visibility = value;
+		} else if (value == LIGHTING_FIXED_FUNCTION
+				|| value == LIGHTING_PER_PIXEL) {
+			_lighting_path = value;
+		}
+	}
+}
+
+void setUpFaceNormal(FLTVECTPLUS p1, FLTVECTPLUS p2, FLTVECTPLUS p3) {
+	GLfloat* normal = (GLfloat *) malloc(3 * sizeof(GLfloat));
+	calculateNormal(p1, p2, p3, &normal);
+	glNormal3fv(normal);
+	free(normal);
+}
+
+void setUpFaceNormal(TRIANGLEPLUS triangle) {
+	setUpFaceNormal(*triangle.p1, *triangle.p2, *triangle.p3);
+}
+
+/*
+ * GL state cache
+ *
+ * Materials, lights, the enables below, the polygon mode and the shade
+ * model are set through a shadow copy of that state; a call that would not
+ * change it is dropped, and issued and dropped calls are counted per frame.
+ * Code that pushes attributes with pushAttrib() restores them with
+ * popAttrib(), which forgets the shadow of the pushed groups only. Light
+ * positions and spot directions are cached in
+ * eye space and sent with an identity modelview, since GL transforms them
+ * by whatever matrix is current.
+ */
+#define CACHED_LIGHTS 8
+#define CAP_LIGHTING CACHED_LIGHTS
+#define CAP_NORMALIZE (CACHED_LIGHTS + 1)
+#define CACHED_CAPS (CACHED_LIGHTS + 2)
+#define MATERIAL_PARAMETERS 5
+#define LIGHT_AMBIENT 0
+#define LIGHT_DIFFUSE 1
+#define LIGHT_SPECULAR 2
+#define LIGHT_POSITION 3
+#define LIGHT_DIRECTION 4
+#define LIGHT_CUTOFF 5
+#define LIGHT_EXPONENT 6
+#define LIGHT_PARAMETERS 7
+#define SLOT_MATERIAL 0
+#define SLOT_CAP (SLOT_MATERIAL + MATERIAL_PARAMETERS)
+#define SLOT_POLYGON_MODE (SLOT_CAP + CACHED_CAPS)
+#define SLOT_SHADE_MODEL (SLOT_POLYGON_MODE + 1)
+#define SLOT_LIGHT (SLOT_SHADE_MODEL + 1)
+#define STATE_SLOTS (SLOT_LIGHT + CACHED_LIGHTS * LIGHT_PARAMETERS)
+
+typedef struct {
+	GLfloat value[4];
+	bool known;
+} STATESLOT;
+
+STATESLOT _state[STATE_SLOTS];
+long long _state_issued = 0;
+long long _state_elided = 0;
+
+/* true when the call has to be issued; the shadow then holds value */
+bool stateChanged(int slot, const GLfloat* value, int count) {
+	STATESLOT* state = &_state[slot];
+	if (state->known
+			&& memcmp(state->value, value, count * sizeof(GLfloat)) == 0) {
+		_state_elided++;
+		return false;
+	}
+	memcpy(state->value, value, count * sizeof(GLfloat));
+	state->known = true;
+	_state_issued++;
+	return true;
+}
+
+void forgetSlots(int first, int count) {
+	for (int i = first; i < first + count; i++) {
+		_state[i].known = false;
+	}
+}
+
+/* the mask of each pushAttrib() still on GL's attribute stack */
+GLbitfield _pushed_attribs[16];
+int _pushed_attrib_count = 0;
+
+void pushAttrib(GLbitfield mask) {
+	glPushAttrib(mask);
+	_pushed_attribs[_pushed_attrib_count++] = mask;
+}
+
+void popAttrib() {
+	glPopAttrib();
+	GLbitfield mask = _pushed_attribs[--_pushed_attrib_count];
+	if (mask & GL_LIGHTING_BIT) {
+		forgetSlots(SLOT_MATERIAL, MATERIAL_PARAMETERS);
+		forgetSlots(SLOT_CAP, CAP_LIGHTING + 1);
+		forgetSlots(SLOT_SHADE_MODEL, 1);
+		forgetSlots(SLOT_LIGHT, CACHED_LIGHTS * LIGHT_PARAMETERS);
+	}
+	if (mask & GL_ENABLE_BIT) {
+		forgetSlots(SLOT_CAP, CACHED_CAPS);
+	}
+	if (mask & GL_TRANSFORM_BIT) {
+		forgetSlots(SLOT_CAP + CAP_NORMALIZE, 1);
+	}
+	if (mask & GL_POLYGON_BIT) {
+		forgetSlots(SLOT_POLYGON_MODE, 1);
+	}
+}
+
+int capabilitySlot(GLenum cap) {
+	if (cap >= GL_LIGHT0 && cap < GL_LIGHT0 + CACHED_LIGHTS) {
+		return SLOT_CAP + cap - GL_LIGHT0;
+	} else if (cap == GL_LIGHTING) {
+		return SLOT_CAP + CAP_LIGHTING;
+	} else if (cap == GL_NORMALIZE) {
+		return SLOT_CAP + CAP_NORMALIZE;
+	}
+	return -1;
+}
+
+void setCapability(GLenum cap, bool enabled) {
+	GLfloat value = enabled ? 1.0f : 0.0f;
+	int slot = capabilitySlot(cap);
+	if (slot >= 0 && !stateChanged(slot, &value, 1)) {
+		return;
+	}
+	if (enabled) {
+		glEnable(cap);
+	} else {
+		glDisable(cap);
+	}
+}
+
+void setPolygonMode(GLenum mode) {
+	GLfloat value = mode;
+	if (stateChanged(SLOT_POLYGON_MODE, &value, 1)) {
+		glPolygonMode(GL_FRONT_AND_BACK, mode);
+	}
+}
+
+void setShadeModel(GLenum model) {
+	GLfloat value = model;
+	if (stateChanged(SLOT_SHADE_MODEL, &value, 1)) {
+		glShadeModel(model);
+	}
+}
+
+/* GL_POSITION and GL_SPOT_DIRECTION in eye space */
+void setLightParameter(GLenum light, GLenum name, const GLfloat* value) {
+	int parameter = LIGHT_AMBIENT;
+	int count = 4;
+	if (name == GL_DIFFUSE) {
+		parameter = LIGHT_DIFFUSE;
+	} else if (name == GL_SPECULAR) {
+		parameter = LIGHT_SPECULAR;
+	} else if (name == GL_POSITION) {
+		parameter = LIGHT_POSITION;
+	} else if (name == GL_SPOT_DIRECTION) {
+		parameter = LIGHT_DIRECTION;
+		count = 3;
+	} else if (name == GL_SPOT_CUTOFF) {
+		parameter = LIGHT_CUTOFF;
+		count = 1;
+	} else if (name == GL_SPOT_EXPONENT) {
+		parameter = LIGHT_EXPONENT;
+		count = 1;
+	}
+	int slot = SLOT_LIGHT + (light - GL_LIGHT0) * LIGHT_PARAMETERS + parameter;
+	if (!stateChanged(slot, value, count)) {
+		return;
+	}
+	if (parameter == LIGHT_POSITION || parameter == LIGHT_DIRECTION) {
+		glPushMatrix();
+		glLoadIdentity();
+		glLightfv(light, name, value);
+		glPopMatrix();
+	} else {
+		glLightfv(light, name, value);
+	}
+}
+
+void setMaterialParameter(int parameter, GLenum name, const GLfloat* value,
+		int count) {
+	if (stateChanged(SLOT_MATERIAL + parameter, value, count)) {
+		glMaterialfv(GL_FRONT_AND_BACK, name, value);
+	}
+}
+
+void applyMaterial(const MATERIAL* material) {
+	setMaterialParameter(0, GL_EMISSION, material->emission, 4);
+	setMaterialParameter(1, GL_AMBIENT, material->ambient, 4);
+	setMaterialParameter(2, GL_DIFFUSE, material->diffuse, 4);
+	setMaterialParameter(3, GL_SPECULAR, material->specular, 4);
+	setMaterialParameter(4, GL_SHININESS, &material->shininess, 1);
+}
+
+void setMaterial(MATERIAL* material, const GLfloat* emission,
+		const GLfloat* ambient, const GLfloat* diffuse, const GLfloat* specular,
+		float shininess) {
+	memcpy(material->emission, emission, 4 * sizeof(GLfloat));
+	memcpy(material->ambient, ambient, 4 * sizeof(GLfloat));
+	memcpy(material->diffuse, diffuse, 4 * sizeof(GLfloat));
+	memcpy(material->specular, specular, 4 * sizeof(GLfloat));
+	material->shininess = shininess;
+}
+
+void getSampleMeshMaterial(MATERIAL* material) {
+	GLfloat emission[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat ambient[4] = { 0.3, 0.0, 0.0, 1.0 };
+	GLfloat diffuse[4] = { 0.0, 0.4, 0.0, 1.0 };
+	float shine = 0.0;
+	GLfloat shininess[4] = { 0.0, 0.0, 0.0, 1.0 };
+	if (_view->sampleMaterial == MESH_SAMPLE_METAL) {
+		shininess[0] = 0.5;
+		shininess[1] = 0.5;
+		shininess[2] = 0.5;
+		shininess[3] = 1.0;
+		shine = 25.0;
+	} else if (_view->sampleMaterial == MESH_SAMPLE_GLASS) {
+		shininess[0] = diffuse[0] = 0.75;
+		shininess[1] = diffuse[1] = 0.75;
+		shininess[2] = diffuse[2] = 0.75;
+		diffuse[3] = 0.3;
+		shine = 100.0;
+	}
+	setMaterial(material, emission, ambient, diffuse, shininess, shine);
+}
+
+void getBrotherBlenderMaterial(MATERIAL* material) {
+	GLfloat emission[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat ambient[4] = { 0.6, 0.33, 0.0, 1.0 };
+	GLfloat diffuse[4] = { 0.66, 0.33, 0.0, 1.0 };
+	GLfloat shininess[4] = { 0.66, 0.33, 0.0, 1.0 };
+	if (_view->brotherColor == MESH_BROTHER_BLENDER_WHITE) {
+		ambient[0] = diffuse[0] = shininess[0] = 1.0;
+		ambient[1] = diffuse[1] = shininess[1] = 1.0;
+		ambient[2] = diffuse[2] = shininess[2] = 1.0;
+	}
+	setMaterial(material, emission, ambient, diffuse, shininess, 15.0);
+}
+
+void getBlenderMonkeyMaterial(MATERIAL* material) {
+	GLfloat emission[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat ambient[4] = { 0.3, 0.3, 0.3, 1.0 };
+	GLfloat diffuse[4] = { 0.3, 0.3, 0.3, 1.0 };
+	GLfloat shininess[4] = { 0.3, 0.3, 0.3, 1.0 };
+	if (_view->monkeyColor == MESH_MONKEY_BLENDER_BLACK) {
+		ambient[0] = diffuse[0] = shininess[0] = 0.66;
+		ambient[1] = diffuse[1] = shininess[1] = 0.1;
+		ambient[2] = diffuse[2] = shininess[2] = 0.1;
+	}
+	setMaterial(material, emission, ambient, diffuse, shininess, 25.0);
+}
+
+void getRoomWallsMaterial(MATERIAL* material) {
+	GLfloat emission[4] = { 0.1, 0.1, 0.1, 1.0 };
+	GLfloat ambient[4] = { 0.2, 0.2, 0.0, 1.0 };
+	GLfloat diffuse[4] = { 0.0, 0.3, 0.0, 1.0 };
+	GLfloat shininess[4] = { 0.1, 0.0, 0.4, 1.0 };
+	float shine = 10.0;
+	if (_view->wallsMode == ROOM_WALLS_DRY_WALLS) {
+		shininess[0] = shininess[1] = shininess[2]  = 0.0;
+		ambient[0] = diffuse[0] = 0.4;
+		ambient[1] = diffuse[1] = 0.4;
+		ambient[2] = diffuse[2] = 0.4;
+		shine = 0.0;
+	} else if (_view->wallsMode == ROOM_WALLS_BRICK) {
+		ambient[0] = diffuse[0] = shininess[0] = 0.4;
+		ambient[1] = diffuse[1] = shininess[1] = 0.2;
+		ambient[2] = diffuse[2] = shininess[2] = 0.0;
+		shine = 20.0;
+	}
+	setMaterial(material, emission, ambient, diffuse, shininess, shine);
+}
+
+void getTablesMaterial(MATERIAL* material) {
+	GLfloat emission[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat ambient[4] = { 0.2, 0.1, 0.0, 1.0 };
+	GLfloat diffuse[4] = { 0.2, 0.1, 0.0, 1.0 };
+	GLfloat shininess[4] = { 0.2, 0.1, 0.0, 1.0 };
+	setMaterial(material, emission, ambient, diffuse, shininess, 25.0);
+}
+
+void getLampBasesMaterial(MATERIAL* material) {
+	GLfloat emission[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat diffuse[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat shininess[4] = { 0.0, 0.0, 0.0, 1.0 };
+	setMaterial(material, emission, ambient, diffuse, shininess, 25.0);
+}
+
+void getLampPointMaterial(MATERIAL* material) {
+	GLfloat emission[4] = { 1.0, 1.0, 1.0, 1.0 };
+	GLfloat ambient[4] = { 1.0, 1.0, 1.0, 1.0 };
+	GLfloat diffuse[4] = { 1.0, 1.0, 1.0, 1.0 };
+	GLfloat shininess[4] = { 1.0, 1.0, 1.0, 1.0 };
+	setMaterial(material, emission, ambient, diffuse, shininess, 25.0);
+}
+
+void getLampSpotlightMaterial(MATERIAL* material) {
+	GLfloat emission[4] = { 0.0, 0.0, 1.0, 1.0 };
+	GLfloat ambient[4] = { 0.0, 0.0, 1.0, 1.0 };
+	GLfloat diffuse[4] = { 0.0, 0.0, 1.0, 1.0 };
+	GLfloat shininess[4] = { 0.0, 0.0, 1.0, 1.0 };
+	setMaterial(material, emission, ambient, diffuse, shininess, 25.0);
+}
+
+/*
+ * 4x4 matrices are column major, like OpenGL. The mat* helpers multiply
+ * on the right the same way glTranslatef/glScalef/glRotatef do, so the
+ * CPU side can mirror what the GL matrix stack builds.
+ */
+void matIdentity(float* m) {
+	memset(m, 0, 16 * sizeof(float));
+	m[0] = m[5] = m[10] = m[15] = 1.0f;
+}
+
+void matMultiply(const float* a, const float* b, float* out) {
+	float r[16];
+	for (int col = 0; col < 4; col++) {
+		for (int row = 0; row < 4; row++) {
+			r[col * 4 + row] = a[row] * b[col * 4]
+					+ a[4 + row] * b[col * 4 + 1]
+					+ a[8 + row] * b[col * 4 + 2]
+					+ a[12 + row] * b[col * 4 + 3];
+		}
+	}
+	memcpy(out, r, 16 * sizeof(float));
+}
+
+void matTranslate(float* m, float x, float y, float z) {
+	float t[16];
+	matIdentity(t);
+	t[12] = x;
+	t[13] = y;
+	t[14] = z;
+	matMultiply(m, t, m);
+}
+
+void matScale(float* m, float x, float y, float z) {
+	float s[16];
+	matIdentity(s);
+	s[0] = x;
+	s[5] = y;
+	s[10] = z;
+	matMultiply(m, s, m);
+}
+
+void matRotate(float* m, float angle, float x, float y, float z) {
+	float len = sqrt(x * x + y * y + z * z);
+	if (len == 0.0f) {
+		return;
+	}
+	x /= len;
+	y /= len;
+	z /= len;
+	float c = cos(angle * PI / 180.0);
+	float s = sin(angle * PI / 180.0);
+	float r[16];
+	matIdentity(r);
+	r[0] = x * x * (1 - c) + c;
+	r[1] = y * x * (1 - c) + z * s;
+	r[2] = x * z * (1 - c) - y * s;
+	r[4] = x * y * (1 - c) - z * s;
+	r[5] = y * y * (1 - c) + c;
+	r[6] = y * z * (1 - c) + x * s;
+	r[8] = x * z * (1 - c) + y * s;
+	r[9] = y * z * (1 - c) - x * s;
+	r[10] = z * z * (1 - c) + c;
+	matMultiply(m, r, m);
+}
+
+void matPerspective(float* m, float fovy, float aspect, float zNear,
+		float zFar) {
+	float f = 1.0f / tan(fovy * PI / 360.0);
+	memset(m, 0, 16 * sizeof(float));
+	m[0] = f / aspect;
+	m[5] = f;
+	m[10] = (zFar + zNear) / (zNear - zFar);
+	m[11] = -1.0f;
+	m[14] = 2.0f * zFar * zNear / (zNear - zFar);
+}
+
+void matTransformPoint(const float* m, float x, float y, float z,
+		float* out) {
+	out[0] = m[0] * x + m[4] * y + m[8] * z + m[12];
+	out[1] = m[1] * x + m[5] * y + m[9] * z + m[13];
+	out[2] = m[2] * x + m[6] * y + m[10] * z + m[14];
+	out[3] = m[3] * x + m[7] * y + m[11] * z + m[15];
+}
+
+void matTransformVector(const float* m, float x, float y, float z,
+		float* out) {
+	out[0] = m[0] * x + m[4] * y + m[8] * z;
+	out[1] = m[1] * x + m[5] * y + m[9] * z;
+	out[2] = m[2] * x + m[6] * y + m[10] * z;
+	out[3] = 0.0f;
+}
+
+/* cofactor expansion, same as gluInvertMatrix */
+bool matInvert(const float* m, float* out) {
+	float inv[16];
+	inv[0] = m[5] * m[10] * m[15] - m[5] * m[11] * m[14] - m[9] * m[6] * m[15]
+			+ m[9] * m[7] * m[14] + m[13] * m[6] * m[11] - m[13] * m[7] * m[10];
+	inv[4] = -m[4] * m[10] * m[15] + m[4] * m[11] * m[14] + m[8] * m[6] * m[15]
+			- m[8] * m[7] * m[14] - m[12] * m[6] * m[11] + m[12] * m[7] * m[10];
+	inv[8] = m[4] * m[9] * m[15] - m[4] * m[11] * m[13] - m[8] * m[5] * m[15]
+			+ m[8] * m[7] * m[13] + m[12] * m[5] * m[11] - m[12] * m[7] * m[9];
+	inv[12] = -m[4] * m[9] * m[14] + m[4] * m[10] * m[13] + m[8] * m[5] * m[14]
+			- m[8] * m[6] * m[13] - m[12] * m[5] * m[10] + m[12] * m[6] * m[9];
+	inv[1] = -m[1] * m[10] * m[15] + m[1] * m[11] * m[14] + m[9] * m[2] * m[15]
+			- m[9] * m[3] * m[14] - m[13] * m[2] * m[11] + m[13] * m[3] * m[10];
+	inv[5] = m[0] * m[10] * m[15] - m[0] * m[11] * m[14] - m[8] * m[2] * m[15]
+			+ m[8] * m[3] * m[14] + m[12] * m[2] * m[11] - m[12] * m[3] * m[10];
+	inv[9] = -m[0] * m[9] * m[15] + m[0] * m[11] * m[13] + m[8] * m[1] * m[15]
+			- m[8] * m[3] * m[13] - m[12] * m[1] * m[11] + m[12] * m[3] * m[9];
+	inv[13] = m[0] * m[9] * m[14] - m[0] * m[10] * m[13] - m[8] * m[1] * m[14]
+			+ m[8] * m[2] * m[13] + m[12] * m[1] * m[10] - m[12] * m[2] * m[9];
+	inv[2] = m[1] * m[6] * m[15] - m[1] * m[7] * m[14] - m[5] * m[2] * m[15]
+			+ m[5] * m[3] * m[14] + m[13] * m[2] * m[7] - m[13] * m[3] * m[6];
+	inv[6] = -m[0] * m[6] * m[15] + m[0] * m[7] * m[14] + m[4] * m[2] * m[15]
+			- m[4] * m[3] * m[14] - m[12] * m[2] * m[7] + m[12] * m[3] * m[6];
+	inv[10] = m[0] * m[5] * m[15] - m[0] * m[7] * m[13] - m[4] * m[1] * m[15]
+			+ m[4] * m[3] * m[13] + m[12] * m[1] * m[7] - m[12] * m[3] * m[5];
+	inv[14] = -m[0] * m[5] * m[14] + m[0] * m[6] * m[13] + m[4] * m[1] * m[14]
+			- m[4] * m[2] * m[13] - m[12] * m[1] * m[6] + m[12] * m[2] * m[5];
+	inv[3] = -m[1] * m[6] * m[11] + m[1] * m[7] * m[10] + m[5] * m[2] * m[11]
+			- m[5] * m[3] * m[10] - m[9] * m[2] * m[7] + m[9] * m[3] * m[6];
+	inv[7] = m[0] * m[6] * m[11] - m[0] * m[7] * m[10] - m[4] * m[2] * m[11]
+			+ m[4] * m[3] * m[10] + m[8] * m[2] * m[7] - m[8] * m[3] * m[6];
+	inv[11] = -m[0] * m[5] * m[11] + m[0] * m[7] * m[9] + m[4] * m[1] * m[11]
+			- m[4] * m[3] * m[9] - m[8] * m[1] * m[7] + m[8] * m[3] * m[5];
+	inv[15] = m[0] * m[5] * m[10] - m[0] * m[6] * m[9] - m[4] * m[1] * m[10]
+			+ m[4] * m[2] * m[9] + m[8] * m[1] * m[6] - m[8] * m[2] * m[5];
+	float det = m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12];
+	if (det == 0.0f) {
+		return false;
+	}
+	for (int i = 0; i < 16; i++) {
+		out[i] = inv[i] / det;
+	}
+	return true;
+}
+
+/*
+ * Frame job graph
+ *
+ * A small work-stealing scheduler for the CPU side of a frame. Every worker
+ * owns a queue; it takes its own jobs from the back and steals from the
+ * front of the other queues when it runs dry. Jobs are nodes of a
+ * per-frame graph: a job is queued once all jobs it depends on finished.
+ * The GLUT thread is worker 0 and helps until the graph is done, so GL
+ * calls never leave it.
+ */
+#define MAX_JOBS 512
+#define MAX_WORKERS 16
+
+typedef void (*JOBFUNC)(int index);
+
+typedef struct {
+	const char* name;
+	JOBFUNC func;
+	int index;
+	std::atomic<int> pending;
+	std::vector<int> successors;
+	double ms;
+} JOB;
+
+typedef struct {
+	std::mutex lock;
+	std::deque<int> jobs;
+} JOBQUEUE;
+
+typedef struct {
+	double ms;
+	double max_ms;
+	int count;
+} JOBSTAT;
+
+JOB _jobs[MAX_JOBS];
+int _job_count = 0;
+JOBQUEUE _job_queues[MAX_WORKERS];
+int _worker_count = 1;
+std::thread* _workers[MAX_WORKERS];
+std::atomic<bool> _jobs_shutdown(false);
+std::atomic<int> _jobs_remaining(0);
+std::atomic<int> _jobs_queued(0);
+std::mutex _job_wake_lock;
+std::condition_variable _job_wake;
+std::map<std::string, JOBSTAT> _job_stats;
+
+int addJob(const char* name, JOBFUNC func, int index) {
+	assert(_job_count < MAX_JOBS);
+	JOB* job = &_jobs[_job_count];
+	job->name = name;
+	job->func = func;
+	job->index = index;
+	job->pending = 0;
+	job->successors.clear();
+	job->ms = 0.0;
+	return _job_count++;
+}
+
+void addJobDependency(int before, int after) {
+	_jobs[before].successors.push_back(after);
+	_jobs[after].pending++;
+}
+
+void pushJob(int worker, int job) {
+	{
+		std::lock_guard<std::mutex> guard(_job_queues[worker].lock);
+		_job_queues[worker].jobs.push_back(job);
+	}
+	{
+		std::lock_guard<std::mutex> guard(_job_wake_lock);
+		_jobs_queued++;
+	}
+	_job_wake.notify_one();
+}
+
+bool takeJob(int worker, int* job) {
+	for (int i = 0; i < _worker_count; i++) {
+		int victim = (worker + i) % _worker_count;
+		std::lock_guard<std::mutex> guard(_job_queues[victim].lock);
+		if (_job_queues[victim].jobs.empty()) {
+			continue;
+		}
+		if (victim == worker) {
+			*job = _job_queues[victim].jobs.back();
+			_job_queues[victim].jobs.pop_back();
+		} else {
+			*job = _job_queues[victim].jobs.front();
+			_job_queues[victim].jobs.pop_front();
+		}
+		_jobs_queued--;
+		return true;
+	}
+	return false;
+}
+
+void runJob(int worker, int id) {
+	JOB* job = &_jobs[id];
+	double start = nowMs();
+	job->func(job->index);
+	job->ms = nowMs() - start;
+	for (size_t i = 0; i < job->successors.size(); i++) {
+		if (--_jobs[job->successors[i]].pending == 0) {
+			pushJob(worker, job->successors[i]);
+		}
+	}
+	_jobs_remaining--;
+}
+
+void jobWorker(int worker) {
+	int job;
+	while (!_jobs_shutdown) {
+		if (takeJob(worker, &job)) {
+			runJob(worker, job);
+			continue;
+		}
+		std::unique_lock<std::mutex> guard(_job_wake_lock);
+		_job_wake.wait(guard, [] {return _jobs_queued > 0 || _jobs_shutdown;});
+	}
+}
+
+void stopJobSystem() {
+	{
+		std::lock_guard<std::mutex> guard(_job_wake_lock);
+		_jobs_shutdown = true;
+	}
+	_job_wake.notify_all();
+	for (int i = 1; i < _worker_count; i++) {
+		_workers[i]->join();
+		delete _workers[i];
+	}
+	_worker_count = 1;
+}
+
+void initJobSystem() {
+	int threads = std::thread::hardware_concurrency();
+	_worker_count = std::max(1, std::min(threads, MAX_WORKERS));
+	for (int i = 1; i < _worker_count; i++) {
+		_workers[i] = new std::thread(jobWorker, i);
+	}
+	atexit(stopJobSystem);
+}
+
+void runJobGraph() {
+	_jobs_remaining = _job_count;
+	int next = 0;
+	for (int i = 0; i < _job_count; i++) {
+		if (_jobs[i].pending == 0) {
+			pushJob(next, i);
+			next = (next + 1) % _worker_count;
+		}
+	}
+	int job;
+	while (_jobs_remaining > 0) {
+		if (takeJob(0, &job)) {
+			runJob(0, job);
+		} else {
+			std::this_thread::yield();
+		}
+	}
+	for (int i = 0; i < _job_count; i++) {
+		JOBSTAT* stat = &_job_stats[_jobs[i].name];
+		stat->ms += _jobs[i].ms;
+		stat->max_ms = std::max(stat->max_ms, _jobs[i].ms);
+		stat->count++;
+	}
+	_job_count = 0;
+}
+
+/*
+ * Scene graph
+ *
+ * Nodes hold a local transform and cache their world matrix and world
+ * bounds. Changing a local transform only queues the node; the next
+ * updateSceneGraph() recomputes that node's subtree and refits the bounds
+ * of its ancestors, so moving one object costs its depth, not the scene.
+ * Node 0 carries the mouse transformations, node 1 the room placement.
+ * The world bounds of a node enclose its whole subtree: culling rejects
+ * subtrees with them and picking builds its top level from them.
+ */
+typedef struct {
+	const char* name;
+	int parent;
+	int depth;
+	std::vector<int> children;
+	int object;
+	float local[16];
+	float world[16];
+	float bmin[3];
+	float bmax[3];
+	float wmin[3];
+	float wmax[3];
+	bool dirty;
+} SCENENODE;
+
+#define NODE_SCENE 0
+#define NODE_ROOM 1
+
+std::vector<SCENENODE> _nodes;
+std::vector<int> _dirty_nodes;
+int _scene_graph_version = 0;
+
+int addSceneNode(const char* name, int parent) {
+	SCENENODE node;
+	node.name = name;
+	node.parent = parent;
+	node.depth = parent < 0 ? 0 : _nodes[parent].depth + 1;
+	node.object = -1;
+	matIdentity(node.local);
+	matIdentity(node.world);
+	emptyBounds(node.bmin, node.bmax);
+	emptyBounds(node.wmin, node.wmax);
+	node.dirty = false;
+	int index = _nodes.size();
+	_nodes.push_back(node);
+	if (parent >= 0) {
+		_nodes[parent].children.push_back(index);
+	}
+	_dirty_nodes.push_back(index);
+	_nodes[index].dirty = true;
+	return index;
+}
+
+void setNodeLocal(int index, const float* local) {
+	SCENENODE* node = &_nodes[index];
+	if (memcmp(node->local, local, 16 * sizeof(float)) == 0) {
+		return;
+	}
+	memcpy(node->local, local, 16 * sizeof(float));
+	if (!node->dirty) {
+		node->dirty = true;
+		_dirty_nodes.push_back(index);
+	}
+}
+
+void transformBounds(const float* m, const float* bmin, const float* bmax,
+		float* outMin, float* outMax) {
+	emptyBounds(outMin, outMax);
+	if (bmin[0] > bmax[0]) {
+		return;
+	}
+	for (int corner = 0; corner < 8; corner++) {
+		float p[4];
+		matTransformPoint(m, (corner & 1) ? bmax[0] : bmin[0],
+				(corner & 2) ? bmax[1] : bmin[1],
+				(corner & 4) ? bmax[2] : bmin[2], p);
+		growBounds(outMin, outMax, p[0], p[1], p[2]);
+	}
+}
+
+/* the node's own box in world space, grown by its children's */
+void refitNodeBounds(int index) {
+	SCENENODE* node = &_nodes[index];
+	transformBounds(node->world, node->bmin, node->bmax, node->wmin,
+			node->wmax);
+	for (size_t i = 0; i < node->children.size(); i++) {
+		const SCENENODE* child = &_nodes[node->children[i]];
+		if (child->wmin[0] > child->wmax[0]) {
+			continue;
+		}
+		growBounds(node->wmin, node->wmax, child->wmin[0], child->wmin[1],
+				child->wmin[2]);
+		growBounds(node->wmin, node->wmax, child->wmax[0], child->wmax[1],
+				child->wmax[2]);
+	}
+}
+
+void updateNodeSubtree(int index) {
+	SCENENODE* node = &_nodes[index];
+	if (node->parent >= 0) {
+		matMultiply(_nodes[node->parent].world, node->local, node->world);
+	} else {
+		memcpy(node->world, node->local, 16 * sizeof(float));
+	}
+	node->dirty = false;
+	for (size_t i = 0; i < node->children.size(); i++) {
+		updateNodeSubtree(node->children[i]);
+	}
+	refitNodeBounds(index);
+}
+
+bool compareNodeDepth(int a, int b) {
+	return _nodes[a].depth < _nodes[b].depth;
+}
+
+/* deepest first, so a node is refitted after all of its children */
+bool compareRefitOrder(int a, int b) {
+	if (_nodes[a].depth != _nodes[b].depth) {
+		return _nodes[a].depth > _nodes[b].depth;
+	}
+	return a < b;
+}
+
+/*
+ * Ancestors are refitted bottom-up from their children's cached bounds,
+ * once each however many of their descendants moved, so they shrink again
+ * when a child moves back in.
+ */
+void updateSceneGraph() {
+	if (_dirty_nodes.empty()) {
+		return;
+	}
+	std::sort(_dirty_nodes.begin(), _dirty_nodes.end(), compareNodeDepth);
+	std::vector<int> ancestors;
+	for (size_t i = 0; i < _dirty_nodes.size(); i++) {
+		int index = _dirty_nodes[i];
+		if (!_nodes[index].dirty) {
+			continue;
+		}
+		updateNodeSubtree(index);
+		for (int p = _nodes[index].parent; p >= 0; p = _nodes[p].parent) {
+			ancestors.push_back(p);
+		}
+	}
+	std::sort(ancestors.begin(), ancestors.end(), compareRefitOrder);
+	ancestors.erase(std::unique(ancestors.begin(), ancestors.end()),
+			ancestors.end());
+	for (size_t i = 0; i < ancestors.size(); i++) {
+		refitNodeBounds(ancestors[i]);
+	}
+	_dirty_nodes.clear();
+	_scene_graph_version++;
+}
+
+/* the mouse transformations that drawObjects() used to apply */
+void updateSceneTransform() {
+	float local[16];
+	matIdentity(local);
+	matTranslate(local, _view->translate[0] / 10.0,
+			_view->translate[1] / 10.0, _view->translate[2]);
+	matScale(local, _view->scale, _view->scale, _view->scale);
+	matRotate(local, -_view->rotate[1], 1.0f, 0.0f, 0.0f);
+	matRotate(local, _view->rotate[0], 0.0f, 1.0f, 0.0f);
+	matRotate(local, _view->rotate[2], 0.0f, 0.0f, 1.0f);
+	setNodeLocal(NODE_SCENE, local);
+}
+
+/*
+ * Scene objects and per-frame draw commands
+ *
+ * Every object hangs off a scene graph node. The jobs fill one
+ * DRAWCOMMAND per object; drawAll() then submits the visible ones in sort
+ * key order.
+ */
+#define MAX_OBJECTS 4096
+#define LOD_FULL 0
+#define LOD_MEDIUM 1
+#define LOD_LOW 2
+
+typedef struct {
+	const char* name;
+	RawMesh* raw;
+	SurFaceMesh* off;
+	void (*material)(MATERIAL*);
+	MATERIAL fixed;
+	float rgb[3];
+	int node;
+	float bmin[3];
+	float bmax[3];
+	bool occluder;
+} SCENEOBJECT;
+
+typedef struct {
+	int object;
+	bool visible;
+	int lod;
+	float mvp[16];
+	float depth;
+	float pixels;
+	unsigned int sortKey;
+	MATERIAL material;
+	float model[16];
+	unsigned int lights;
+	bool transparent;
+} DRAWCOMMAND;
+
+SCENEOBJECT _objects[MAX_OBJECTS];
+int _object_count = 0;
+DRAWCOMMAND _commands[MAX_OBJECTS];
+int _draw_order[MAX_OBJECTS];
+int _draw_count = 0;
+float _frame_mvp[16];
+float _frame_projection[16];
+float _frame_view[16];
+
+int addSceneObject(const char* name, RawMesh* raw, SurFaceMesh* off,
+		void (*material)(MATERIAL*), int parent) {
+	assert(_object_count < MAX_OBJECTS);
+	SCENEOBJECT* object = &_objects[_object_count];
+	object->name = name;
+	object->raw = raw;
+	object->off = off;
+	object->material = material;
+	object->rgb[0] = 0.15;
+	object->rgb[1] = 0.15;
+	object->rgb[2] = 0.85;
+	object->occluder = false;
+	memcpy(object->bmin, raw ? raw->bmin : off->bmin, 3 * sizeof(float));
+	memcpy(object->bmax, raw ? raw->bmax : off->bmax, 3 * sizeof(float));
+	object->node = addSceneNode(name, parent);
+	SCENENODE* node = &_nodes[object->node];
+	node->object = _object_count;
+	memcpy(node->bmin, object->bmin, 3 * sizeof(float));
+	memcpy(node->bmax, object->bmax, 3 * sizeof(float));
+	return _object_count++;
+}
+
+const float* getObjectWorld(const SCENEOBJECT* object) {
+	return _nodes[object->node].world;
+}
+
+/* the furnished room, under the room node or a tile of a generated scene */
+void addRoomObjects(int room) {
+	int walls = addSceneObject("room walls", _room_walls_mesh, 0,
+			getRoomWallsMaterial, room);
+	_objects[walls].occluder = true;
+	int brother = addSceneObject("brother blender", _brother_blender_mesh, 0,
+			getBrotherBlenderMaterial, room);
+	_objects[brother].rgb[0] = _objects[brother].rgb[1] =
+			_objects[brother].rgb[2] = 0.1;
+	int monkey = addSceneObject("blender monkey", _blender_monkey_mesh, 0,
+			getBlenderMonkeyMaterial, room);
+	_objects[monkey].rgb[0] = _objects[monkey].rgb[1] =
+			_objects[monkey].rgb[2] = 0.0;
+	addSceneObject("tables", _tables_mesh, 0, getTablesMaterial, room);
+	addSceneObject("lamp bases", _lamp_bases_mesh, 0, getLampBasesMaterial,
+			room);
+	addSceneObject("lamp point", _lamp_point_mesh, 0, getLampPointMaterial,
+			room);
+	addSceneObject("lamp spotlight", _lamp_spotlight_mesh, 0,
+			getLampSpotlightMaterial, room);
+	int sample = addSceneObject("mesh sample", 0, _surfmesh,
+			getSampleMeshMaterial, room);
+	float local[16];
+	matIdentity(local);
+	matTranslate(local, 0.3, 2.0, 0.4);
+	matScale(local, 0.05, 0.05, 0.05);
+	setNodeLocal(_objects[sample].node, local);
+}
+
+void initSceneObjects() {
+	_object_count = 0;
+	_nodes.clear();
+	_dirty_nodes.clear();
+	addSceneNode("scene", -1);
+	int room = addSceneNode("room", NODE_SCENE);
+	float local[16];
+	matIdentity(local);
+	matScale(local, 3.0, 3.0, 3.0);
+	matRotate(local, -80, 1.0, 0.0, 0.0);
+	setNodeLocal(room, local);
+	addRoomObjects(room);
+	updateSceneTransform();
+	updateSceneGraph();
+}
+
+/* projection and camera of myResize() and setUpDisplay() */
+void computeFrameMatrix() {
+	float aspect = (float) _current_width / (float) _current_height;
+	matPerspective(_frame_projection, _current_fov, aspect, 1.0f, 300.0f);
+	matIdentity(_frame_view);
+	matTranslate(_frame_view, 0.0f, 0.0f, -60.0f);
+	matMultiply(_frame_projection, _frame_view, _frame_mvp);
+}
+
+bool boxInFrustum(const float* mvp, const float* bmin, const float* bmax) {
+	int outside[6] = { 0, 0, 0, 0, 0, 0 };
+	for (int corner = 0; corner < 8; corner++) {
+		float clip[4];
+		matTransformPoint(mvp, (corner & 1) ? bmax[0] : bmin[0],
+				(corner & 2) ? bmax[1] : bmin[1],
+				(corner & 4) ? bmax[2] : bmin[2], clip);
+		for (int axis = 0; axis < 3; axis++) {
+			if (clip[axis] < -clip[3]) {
+				outside[axis * 2]++;
+			}
+			if (clip[axis] > clip[3]) {
+				outside[axis * 2 + 1]++;
+			}
+		}
+	}
+	for (int plane = 0; plane < 6; plane++) {
+		if (outside[plane] == 8) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Parents come before their children in _nodes, so one forward pass
+ * rejects whole subtrees by their cached world bounds. Leaves are left to
+ * jobVisibility, which tests the object's own box anyway.
+ */
+std::vector<char> _node_culled;
+
+void cullSceneNodes() {
+	_node_culled.resize(_nodes.size());
+	for (size_t i = 0; i < _nodes.size(); i++) {
+		const SCENENODE* node = &_nodes[i];
+		if (node->parent >= 0 && _node_culled[node->parent]) {
+			_node_culled[i] = true;
+		} else if (node->children.empty()) {
+			_node_culled[i] = false;
+		} else {
+			_node_culled[i] = !boxInFrustum(_frame_mvp, node->wmin,
+					node->wmax);
+		}
+	}
+}
+
+void jobVisibility(int i) {
+	SCENEOBJECT* object = &_objects[i];
+	DRAWCOMMAND* command = &_commands[i];
+	command->object = i;
+	if (_node_culled[object->node]) {
+		command->visible = false;
+		return;
+	}
+	matMultiply(_frame_mvp, getObjectWorld(object), command->mvp);
+	command->visible = boxInFrustum(command->mvp, object->bmin, object->bmax);
+}
+
+/*
+ * Only one level of detail exists per mesh, so the projected size is used
+ * to drop objects smaller than a pixel; the level is kept on the command.
+ */
+void jobLod(int i) {
+	SCENEOBJECT* object = &_objects[i];
+	DRAWCOMMAND* command = &_commands[i];
+	if (!command->visible) {
+		return;
+	}
+	float center[4];
+	float edge[4];
+	matTransformPoint(command->mvp, (object->bmin[0] + object->bmax[0]) / 2,
+			(object->bmin[1] + object->bmax[1]) / 2,
+			(object->bmin[2] + object->bmax[2]) / 2, center);
+	matTransformPoint(command->mvp, object->bmax[0], object->bmax[1],
+			object->bmax[2], edge);
+	if (center[3] <= 1.0f || edge[3] <= 0.0f) {
+		command->pixels = _current_height;
+	} else {
+		float dx = edge[0] / edge[3] - center[0] / center[3];
+		float dy = edge[1] / edge[3] - center[1] / center[3];
+		command->pixels = sqrt(dx * dx + dy * dy) * _current_height / 2.0f;
+	}
+	if (command->pixels >= 64.0f) {
+		command->lod = LOD_FULL;
+	} else if (command->pixels >= 8.0f) {
+		command->lod = LOD_MEDIUM;
+	} else {
+		command->lod = LOD_LOW;
+	}
+	if (command->pixels < 1.0f) {
+		command->visible = false;
+	}
+	command->depth = center[3];
+}
+
+/*
+ * Occluders first, then front to back, so the depth test rejects hidden
+ * fragments early and the occlusion queries see the walls.
+ */
+void jobSortKey(int i) {
+	DRAWCOMMAND* command = &_commands[i];
+	if (!command->visible) {
+		return;
+	}
+	float depth = command->depth / 300.0f;
+	if (depth < 0.0f) {
+		depth = 0.0f;
+	} else if (depth > 1.0f) {
+		depth = 1.0f;
+	}
+	command->sortKey = ((_objects[i].occluder ? 0u : 1u) << 24)
+			| ((unsigned int) (depth * 0xffff) << 8) | (i & 0xff);
+}
+
+void jobBuildCommand(int i) {
+	DRAWCOMMAND* command = &_commands[i];
+	if (!command->visible) {
+		return;
+	}
+	if (_objects[i].material) {
+		_objects[i].material(&command->material);
+	} else {
+		command->material = _objects[i].fixed;
+	}
+	command->transparent = command->material.diffuse[3] < 1.0f;
+	memcpy(command->model, getObjectWorld(&_objects[i]), 16 * sizeof(float));
+}
+
+/*
+ * Transparency
+ *
+ * Objects whose material has a diffuse alpha below one (the sample mesh
+ * as Glass) are left out of the opaque pass and drawn last, back to front,
+ * blended and without depth writes. Their triangles are sorted back to
+ * front too, by the clip w of their centers, on a job per object. The
+ * previous frame's order is kept: it is reused as is while the object's
+ * transform does not change, and otherwise patched with an insertion sort
+ * as long as that takes under TRANSPARENT_MAX_MOVES shifts per triangle.
+ * Past that a radix sort is cheaper, so the rest of the frame's changes go
+ * to it; its passes skip digits every key shares. The drawing order goes
+ * out as an index list into the mesh's streams.
+ */
+#define TRANSPARENT_MAX_MOVES 1
+#define RADIX_BITS 11
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define SORT_REUSED 0
+#define SORT_INCREMENTAL 1
+#define SORT_RADIX 2
+
+typedef struct {
+	std::vector<unsigned int> order;
+	std::vector<unsigned int> keys;
+	std::vector<unsigned int> scratch;
+	std::vector<unsigned int> indices;
+	float mvp[16];
+	bool flat;
+	GLuint buffer;
+	long long triangles;
+	int sorts[3];
+	double ms;
+} TRIANGLESORT;
+
+TRIANGLESORT _triangle_sorts[MAX_OBJECTS];
+int _transparent_order[MAX_OBJECTS];
+int _transparent_count = 0;
+
+/* a float's bits as an unsigned int that sorts the same way */
+unsigned int floatKey(float value) {
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+}
+
+/* insertion sort by key; false, half done, once it passes maxMoves */
+bool insertionSortByKey(std::vector<unsigned int>& order,
+		const std::vector<unsigned int>& keys, long long maxMoves) {
+	long long moves = 0;
+	for (size_t i = 1; i < order.size(); i++) {
+		unsigned int item = order[i];
+		unsigned int key = keys[item];
+		size_t j = i;
+		while (j > 0 && keys[order[j - 1]] > key) {
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = item;
+		moves += i - j;
+		if (moves > maxMoves) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* least significant digit first, RADIX_BITS at a time, stable */
+void radixSortByKey(std::vector<unsigned int>& order,
+		const std::vector<unsigned int>& keys,
+		std::vector<unsigned int>& scratch) {
+	scratch.resize(order.size());
+	for (int shift = 0; shift < 32; shift += RADIX_BITS) {
+		unsigned int counts[RADIX_BUCKETS] = { 0 };
+		for (size_t i = 0; i < order.size(); i++) {
+			counts[(keys[order[i]] >> shift) & (RADIX_BUCKETS - 1)]++;
+		}
+		if (counts[(keys[order[0]] >> shift) & (RADIX_BUCKETS - 1)]
+				== order.size()) {
+			continue;
+		}
+		unsigned int offset = 0;
+		for (int b = 0; b < RADIX_BUCKETS; b++) {
+			unsigned int count = counts[b];
+			counts[b] = offset;
+			offset += count;
+		}
+		for (size_t i = 0; i < order.size(); i++) {
+			unsigned int item = order[i];
+			scratch[counts[(keys[item] >> shift) & (RADIX_BUCKETS - 1)]++] =
+					item;
+		}
+		order.swap(scratch);
+	}
+}
+
+/* sorts order back to front by the clip w of the triangle centers */
+int sortTransparentTriangles(TRIANGLESORT* sort, const float* mvp,
+		const std::vector<float>& centers) {
+	int count = centers.size() / 3;
+	if ((int) sort->order.size() == count
+			&& memcmp(sort->mvp, mvp, sizeof(sort->mvp)) == 0) {
+		return SORT_REUSED;
+	}
+	memcpy(sort->mvp, mvp, sizeof(sort->mvp));
+	sort->keys.resize(count);
+	for (int t = 0; t < count; t++) {
+		const float* c = &centers[3 * t];
+		float w = mvp[3] * c[0] + mvp[7] * c[1] + mvp[11] * c[2] + mvp[15];
+		sort->keys[t] = ~floatKey(w);
+	}
+	if ((int) sort->order.size() == count
+			&& insertionSortByKey(sort->order, sort->keys,
+					(long long) TRANSPARENT_MAX_MOVES * count)) {
+		return SORT_INCREMENTAL;
+	}
+	if ((int) sort->order.size() != count) {
+		sort->order.resize(count);
+		for (int t = 0; t < count; t++) {
+			sort->order[t] = t;
+		}
+	}
+	if (count > 0) {
+		radixSortByKey(sort->order, sort->keys, sort->scratch);
+	}
+	return SORT_RADIX;
+}
+
+MESHSTREAMS* getObjectStreams(const SCENEOBJECT* object) {
+	return object->off ? object->off->streams : object->raw->streams;
+}
+
+void jobSortTriangles(int i) {
+	DRAWCOMMAND* command = &_commands[i];
+	MESHSTREAMS* streams = getObjectStreams(&_objects[i]);
+	if (!command->visible || !command->transparent || !streams) {
+		return;
+	}
+	double start = nowMs();
+	TRIANGLESORT* sort = &_triangle_sorts[i];
+	int how = sortTransparentTriangles(sort, command->mvp, streams->centers);
+	sort->sorts[how]++;
+	sort->triangles += sort->order.size();
+	bool flat = _view->shadingModel == FLAT_SHADING;
+	if (how == SORT_REUSED && sort->flat == flat) {
+		sort->ms += nowMs() - start;
+		return;
+	}
+	sort->flat = flat;
+	sort->indices.resize(3 * sort->order.size());
+	for (size_t t = 0; t < sort->order.size(); t++) {
+		for (int k = 0; k < 3; k++) {
+			unsigned int corner = 3 * sort->order[t] + k;
+			sort->indices[3 * t + k] =
+					flat ? corner : streams->indices[corner];
+		}
+	}
+	sort->ms += nowMs() - start;
+}
+
+bool compareTransparent(int a, int b) {
+	return _commands[a].depth > _commands[b].depth;
+}
+
+bool compareCommands(int a, int b) {
+	return _commands[a].sortKey < _commands[b].sortKey;
+}
+
+void jobSortCommands(int) {
+	_draw_count = 0;
+	for (int i = 0; i < _object_count; i++) {
+		if (_commands[i].visible) {
+			_draw_order[_draw_count++] = i;
+		}
+	}
+	std::sort(_draw_order, _draw_order + _draw_count, compareCommands);
+	_transparent_count = 0;
+	for (int i = 0; i < _draw_count; i++) {
+		if (_commands[_draw_order[i]].transparent) {
+			_transparent_order[_transparent_count++] = _draw_order[i];
+		}
+	}
+	std::sort(_transparent_order, _transparent_order + _transparent_count,
+			compareTransparent);
+	countCulledLights();
+}
+
+/*
+ * A generated scene has more objects than MAX_JOBS allows jobs, so past
+ * OBJECT_BATCHES objects a job runs its function over a batch of
+ * consecutive objects. The dependencies between the batches are the ones
+ * between the objects.
+ */
+#define OBJECT_BATCHES 64
+
+int _object_batch = 1;
+
+template<JOBFUNC func> void jobObjectBatch(int batch) {
+	int last = std::min(_object_count, (batch + 1) * _object_batch);
+	for (int i = batch * _object_batch; i < last; i++) {
+		func(i);
+	}
+}
+
+void buildFrameJobs() {
+	updateSceneTransform();
+	updateSceneGraph();
+	computeFrameMatrix();
+	cullSceneNodes();
+	updateStreamedMesh();
+	buildLightJobs();
+	collectFrameLights();
+	_object_batch = (_object_count + OBJECT_BATCHES - 1) / OBJECT_BATCHES;
+	_object_batch = std::max(1, _object_batch);
+	int batches = (_object_count + _object_batch - 1) / _object_batch;
+	int sort = addJob("sort commands", jobSortCommands, 0);
+	for (int i = 0; i < batches; i++) {
+		int visibility = addJob("visibility", jobObjectBatch<jobVisibility>,
+				i);
+		int lod = addJob("lod", jobObjectBatch<jobLod>, i);
+		int key = addJob("sort key", jobObjectBatch<jobSortKey>, i);
+		int build = addJob("build command", jobObjectBatch<jobBuildCommand>,
+				i);
+		int lights = addJob("cull lights", jobObjectBatch<jobCullLights>, i);
+		int triangles = addJob("sort triangles",
+				jobObjectBatch<jobSortTriangles>, i);
+		addJobDependency(visibility, lod);
+		addJobDependency(lod, key);
+		addJobDependency(visibility, build);
+		addJobDependency(visibility, lights);
+		addJobDependency(key, sort);
+		addJobDependency(build, sort);
+		addJobDependency(lights, sort);
+		addJobDependency(build, triangles);
+		addJobDependency(lod, triangles);
+		addJobDependency(triangles, sort);
+	}
+}
+
+/*
+ * Per-pixel clustered lighting
+ *
+ * A GLSL path that reproduces the fixed-function model set up in
+ * setUpLight0/1, setUpSpotlight, setUpPointlight and setUpLighting:
+ * Blinn-Phong with a local viewer, two-sided lighting, spot cutoff and
+ * exponent, and the glMaterial state of every object through
+ * gl_FrontMaterial. It is not limited to GL_LIGHT0-7.
+ *
+ * The view frustum is cut into CLUSTER_X x CLUSTER_Y tiles and CLUSTER_Z
+ * exponential depth slices. Lights with a range are assigned to the
+ * clusters their sphere touches, on a job, and uploaded as float
+ * textures; a fragment only loops over the lights of its cluster. The
+ * scene's own lights have no range (constant attenuation, like GL) and
+ * are passed as uniforms instead.
+ */
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_COUNT (CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+#define CLUSTER_TEXTURE_WIDTH 1024
+#define CLUSTER_MAX_INDICES (CLUSTER_TEXTURE_WIDTH * 256)
+#define MAX_GLOBAL_LIGHTS 8
+#define NEAR_PLANE 1.0f
+#define FAR_PLANE 300.0f
+
+typedef struct {
+	float position[4];
+	float color[3];
+	float direction[3];
+	float cutoff;
+	float exponent;
+	float range;
+	int node;
+	GLenum id;
+} LIGHT;
+
+/* a light after it was moved into eye space for the current frame */
+typedef struct {
+	float position[4];
+	float color[4];
+	float spot[4];
+} EYELIGHT;
+
+std::vector<LIGHT> _extra_lights;
+std::vector<EYELIGHT> _eye_lights;
+std::vector<EYELIGHT> _global_lights;
+std::vector<float> _cluster_grid;
+std::vector<float> _cluster_indices;
+std::vector<std::vector<int> > _cluster_lists;
+int _cluster_max_lights = 0;
+int _cluster_dropped_lights = 0;
+
+/* a float texture that keeps its storage and only grows */
+typedef struct {
+	GLuint id;
+	int width;
+	int height;
+} DATATEXTURE;
+
+GLuint _lighting_program = 0;
+DATATEXTURE _light_texture = { 0, 0, 0 };
+DATATEXTURE _cluster_texture = { 0, 0, 0 };
+DATATEXTURE _index_texture = { 0, 0, 0 };
+bool _lighting_program_failed = false;
+GLint _barycentric_location = -1;
+
+void setLight(LIGHT* light, float x, float y, float z, float r, float g,
+		float b, int node) {
+	light->position[0] = x;
+	light->position[1] = y;
+	light->position[2] = z;
+	light->position[3] = 1.0f;
+	light->color[0] = r;
+	light->color[1] = g;
+	light->color[2] = b;
+	light->direction[0] = 0.0f;
+	light->direction[1] = -1.0f;
+	light->direction[2] = 0.0f;
+	light->cutoff = 180.0f;
+	light->exponent = 0.0f;
+	light->range = 0.0f;
+	light->node = node;
+	light->id = 0;
+}
+
+/* the same four lights display() sets up for the fixed-function path */
+void collectSceneLights(std::vector<LIGHT>& lights) {
+	LIGHT light;
+	setLight(&light, _view->light0[0], _view->light0[1], _view->light0[2],
+			1.0, 1.0, 1.0, -1);
+	if (_view->frontLightColor == FRONT_LIGHT_TURQUOISE) {
+		light.color[0] = 0.0;
+	}
+	light.id = GL_LIGHT0;
+	lights.push_back(light);
+
+	setLight(&light, _view->light1[0], _view->light1[1], _view->light1[2],
+			1.0, 1.0, 1.0, -1);
+	if (_view->upperLightColor == UPPER_LIGHT_ORANGE) {
+		light.color[1] = 0.5;
+		light.color[2] = 0.0;
+	}
+	light.cutoff = 80.0;
+	light.id = GL_LIGHT1;
+	lights.push_back(light);
+
+	if (_view->spotLight == SPOT_LIGHT_ON) {
+		setLight(&light, -1.2, -5.8, 0.2, 1.0, 1.0, 1.0, NODE_ROOM);
+		light.direction[0] = -2.0;
+		light.direction[1] = 1.0;
+		light.direction[2] = -0.1;
+		light.cutoff = 40.0;
+		light.id = GL_LIGHT2;
+		lights.push_back(light);
+	}
+	if (_view->pointLight == POINT_LIGHT_ON) {
+		setLight(&light, 2.1, -6.2, 0.2, 1.0, 1.0, 1.0, NODE_ROOM);
+		light.id = GL_LIGHT3;
+		lights.push_back(light);
+	}
+}
+
+/* --lights N: point lamps scattered through the room, like setUpPointlight */
+void addExtraLights(int count) {
+	float lo[3];
+	float hi[3];
+	emptyBounds(lo, hi);
+	for (int i = 0; i < _object_count; i++) {
+		growBounds(lo, hi, _objects[i].bmin[0], _objects[i].bmin[1],
+				_objects[i].bmin[2]);
+		growBounds(lo, hi, _objects[i].bmax[0], _objects[i].bmax[1],
+				_objects[i].bmax[2]);
+	}
+	srand(459);
+	for (int i = 0; i < count; i++) {
+		LIGHT light;
+		float p[3];
+		for (int k = 0; k < 3; k++) {
+			p[k] = lo[k] + (hi[k] - lo[k]) * (rand() / (float) RAND_MAX);
+		}
+		setLight(&light, p[0], p[1], p[2], 0.2 + 0.8 * rand() / RAND_MAX,
+				0.2 + 0.8 * rand() / RAND_MAX, 0.2 + 0.8 * rand() / RAND_MAX,
+				NODE_ROOM);
+		light.range = 1.5f;
+		_extra_lights.push_back(light);
+	}
+}
+
+void toEyeLight(const LIGHT* light, EYELIGHT* eye) {
+	float m[16];
+	if (light->node >= 0) {
+		matMultiply(_frame_view, _nodes[light->node].world, m);
+	} else {
+		memcpy(m, _frame_view, 16 * sizeof(float));
+	}
+	matTransformPoint(m, light->position[0], light->position[1],
+			light->position[2], eye->position);
+	float d[4];
+	matTransformVector(m, light->direction[0], light->direction[1],
+			light->direction[2], d);
+	float len = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+	/* ranges are given in the light's own space */
+	float scale = sqrt(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+	eye->position[3] = light->range * scale;
+	memcpy(eye->color, light->color, 3 * sizeof(float));
+	eye->color[3] = light->exponent;
+	for (int k = 0; k < 3; k++) {
+		eye->spot[k] = len > 0.0f ? d[k] / len : 0.0f;
+	}
+	eye->spot[3] =
+			light->cutoff >= 180.0f ? -2.0f : cos(light->cutoff * PI / 180.0);
+}
+
+int clusterSlice(float depth) {
+	if (depth <= NEAR_PLANE) {
+		return 0;
+	}
+	int slice = (int) (log(depth / NEAR_PLANE) / log(FAR_PLANE / NEAR_PLANE)
+			* CLUSTER_Z);
+	return std::max(0, std::min(slice, CLUSTER_Z - 1));
+}
+
+/* conservative: the screen rectangle of the sphere's bounding box */
+void jobAssignLights(int) {
+	_cluster_lists.resize(CLUSTER_COUNT);
+	for (int c = 0; c < CLUSTER_COUNT; c++) {
+		_cluster_lists[c].clear();
+	}
+	for (size_t i = 0; i < _eye_lights.size(); i++) {
+		const float* p = _eye_lights[i].position;
+		float r = p[3];
+		float zmin = -p[2] - r;
+		float zmax = -p[2] + r;
+		if (zmax < NEAR_PLANE || zmin > FAR_PLANE) {
+			continue;
+		}
+		int x0 = 0, x1 = CLUSTER_X - 1, y0 = 0, y1 = CLUSTER_Y - 1;
+		if (zmin > NEAR_PLANE) {
+			float lo[2] = { 1e30f, 1e30f };
+			float hi[2] = { -1e30f, -1e30f };
+			for (int corner = 0; corner < 8; corner++) {
+				float clip[4];
+				matTransformPoint(_frame_projection,
+						p[0] + ((corner & 1) ? r : -r),
+						p[1] + ((corner & 2) ? r : -r),
+						p[2] + ((corner & 4) ? r : -r), clip);
+				for (int k = 0; k < 2; k++) {
+					lo[k] = std::min(lo[k], clip[k] / clip[3]);
+					hi[k] = std::max(hi[k], clip[k] / clip[3]);
+				}
+			}
+			if (hi[0] < -1.0f || lo[0] > 1.0f || hi[1] < -1.0f || lo[1] > 1.0f) {
+				continue;
+			}
+			x0 = std::max(0, (int) ((lo[0] + 1.0f) / 2.0f * CLUSTER_X));
+			x1 = std::min(CLUSTER_X - 1, (int) ((hi[0] + 1.0f) / 2.0f * CLUSTER_X));
+			y0 = std::max(0, (int) ((lo[1] + 1.0f) / 2.0f * CLUSTER_Y));
+			y1 = std::min(CLUSTER_Y - 1, (int) ((hi[1] + 1.0f) / 2.0f * CLUSTER_Y));
+		}
+		int z0 = clusterSlice(zmin);
+		int z1 = clusterSlice(zmax);
+		for (int z = z0; z <= z1; z++) {
+			for (int y = y0; y <= y1; y++) {
+				for (int x = x0; x <= x1; x++) {
+					_cluster_lists[(z * CLUSTER_Y + y) * CLUSTER_X + x].push_back(i);
+				}
+			}
+		}
+	}
+	_cluster_grid.resize(4 * CLUSTER_COUNT);
+	_cluster_indices.clear();
+	_cluster_max_lights = 0;
+	_cluster_dropped_lights = 0;
+	for (int c = 0; c < CLUSTER_COUNT; c++) {
+		int listed = _cluster_lists[c].size();
+		int count = std::min(listed,
+				CLUSTER_MAX_INDICES - (int) _cluster_indices.size() / 4);
+		_cluster_dropped_lights += listed - count;
+		_cluster_grid[4 * c] = _cluster_indices.size() / 4;
+		_cluster_grid[4 * c + 1] = count;
+		_cluster_grid[4 * c + 2] = 0.0f;
+		_cluster_grid[4 * c + 3] = 0.0f;
+		for (int k = 0; k < count; k++) {
+			_cluster_indices.push_back(_cluster_lists[c][k]);
+			_cluster_indices.push_back(0.0f);
+			_cluster_indices.push_back(0.0f);
+			_cluster_indices.push_back(0.0f);
+		}
+		_cluster_max_lights = std::max(_cluster_max_lights, count);
+	}
+}
+
+/* called from buildFrameJobs() once the scene graph is up to date */
+void buildLightJobs() {
+	if (!usesLightingProgram()) {
+		return;
+	}
+	std::vector<LIGHT> lights;
+	collectSceneLights(lights);
+	_global_lights.clear();
+	_eye_lights.clear();
+	for (size_t i = 0; i < lights.size(); i++) {
+		EYELIGHT eye;
+		toEyeLight(&lights[i], &eye);
+		if (_global_lights.size() < MAX_GLOBAL_LIGHTS) {
+			_global_lights.push_back(eye);
+		}
+	}
+	for (size_t i = 0; i < _extra_lights.size(); i++) {
+		EYELIGHT eye;
+		toEyeLight(&_extra_lights[i], &eye);
+		_eye_lights.push_back(eye);
+	}
+	addJob("assign lights", jobAssignLights, 0);
+}
+
+static const char* LIGHTING_VERTEX_SHADER =
+		"#version 120\n"
+		"uniform float pointSize;\n"
+		"attribute vec3 barycentric;\n"
+		"varying vec3 eyePosition;\n"
+		"varying vec3 eyeNormal;\n"
+		"varying vec3 edgeDistance;\n"
+		"void main() {\n"
+		"	eyePosition = vec3(gl_ModelViewMatrix * gl_Vertex);\n"
+		"	eyeNormal = gl_NormalMatrix * gl_Normal;\n"
+		"	edgeDistance = barycentric;\n"
+		"	if (pointSize > 0.0) {\n"
+		"		gl_PointSize = clamp(pointSize / max(-eyePosition.z, 1.0), 1.0,\n"
+		"				16.0);\n"
+		"	}\n"
+		"	gl_Position = ftransform();\n"
+		"}\n";
+
+static const char* LIGHTING_FRAGMENT_SHADER =
+		"#version 120\n"
+		"uniform sampler2D lightData;\n"
+		"uniform sampler2D clusterData;\n"
+		"uniform sampler2D indexData;\n"
+		"uniform vec2 lightSize;\n"
+		"uniform vec2 clusterSize;\n"
+		"uniform vec2 indexSize;\n"
+		"uniform vec3 clusterCount;\n"
+		"uniform vec2 viewport;\n"
+		"uniform vec2 depthRange;\n"
+		"uniform int globalCount;\n"
+		"uniform bool flatShading;\n"
+		"uniform bool wireframe;\n"
+		"uniform vec4 globalPosition[8];\n"
+		"uniform vec4 globalColor[8];\n"
+		"uniform vec4 globalSpot[8];\n"
+		"varying vec3 eyePosition;\n"
+		"varying vec3 eyeNormal;\n"
+		"varying vec3 edgeDistance;\n"
+		"vec4 fetch(sampler2D data, vec2 size, float index) {\n"
+		"	float y = floor(index / size.x);\n"
+		"	float x = index - y * size.x;\n"
+		"	return texture2D(data, vec2((x + 0.5) / size.x, (y + 0.5) / size.y));\n"
+		"}\n"
+		"vec3 shade(vec3 P, vec3 N, vec3 V, vec4 position, vec4 color, vec4 spot) {\n"
+		"	vec3 L = position.xyz - P;\n"
+		"	float d = length(L);\n"
+		"	L /= d;\n"
+		"	float attenuation = 1.0;\n"
+		"	if (position.w > 0.0) {\n"
+		"		float x = clamp(d / position.w, 0.0, 1.0);\n"
+		"		attenuation = (1.0 - x * x) * (1.0 - x * x);\n"
+		"	}\n"
+		"	if (spot.w > -1.5) {\n"
+		"		float s = dot(-L, spot.xyz);\n"
+		"		if (s < spot.w) {\n"
+		"			return vec3(0.0);\n"
+		"		}\n"
+		"		attenuation *= pow(max(s, 0.0), color.w);\n"
+		"	}\n"
+		"	float NdotL = dot(N, L);\n"
+		"	if (NdotL <= 0.0) {\n"
+		"		return vec3(0.0);\n"
+		"	}\n"
+		"	vec3 H = normalize(L + V);\n"
+		"	float specular = gl_FrontMaterial.shininess > 0.0\n"
+		"			? pow(max(dot(N, H), 0.0), gl_FrontMaterial.shininess)\n"
+		"			: 1.0;\n"
+		"	return attenuation * color.rgb * (NdotL * gl_FrontMaterial.diffuse.rgb\n"
+		"			+ specular * gl_FrontMaterial.specular.rgb);\n"
+		"}\n"
+		"void main() {\n"
+		"	vec3 N = normalize(eyeNormal);\n"
+		"	if (flatShading) {\n"
+		"		vec3 face = normalize(cross(dFdx(eyePosition), dFdy(eyePosition)));\n"
+		"		N = dot(face, N) < 0.0 ? -face : face;\n"
+		"	}\n"
+		"	if (!gl_FrontFacing) {\n"
+		"		N = -N;\n"
+		"	}\n"
+		"	vec3 V = normalize(-eyePosition);\n"
+		"	vec3 color = gl_FrontMaterial.emission.rgb\n"
+		"			+ gl_LightModel.ambient.rgb * gl_FrontMaterial.ambient.rgb;\n"
+		"	for (int i = 0; i < globalCount; i++) {\n"
+		"		color += shade(eyePosition, N, V, globalPosition[i], globalColor[i],\n"
+		"				globalSpot[i]);\n"
+		"	}\n"
+		"	vec2 tile = floor(gl_FragCoord.xy / viewport * clusterCount.xy);\n"
+		"	float slice = floor(log(max(-eyePosition.z, depthRange.x) / depthRange.x)\n"
+		"			/ log(depthRange.y / depthRange.x) * clusterCount.z);\n"
+		"	slice = clamp(slice, 0.0, clusterCount.z - 1.0);\n"
+		"	tile = clamp(tile, vec2(0.0), clusterCount.xy - 1.0);\n"
+		"	vec4 cluster = fetch(clusterData, clusterSize,\n"
+		"			(slice * clusterCount.y + tile.y) * clusterCount.x + tile.x);\n"
+		"	for (float i = 0.0; i < cluster.y; i += 1.0) {\n"
+		"		float light = fetch(indexData, indexSize, cluster.x + i).r;\n"
+		"		color += shade(eyePosition, N, V, fetch(lightData, lightSize, 3.0 * light),\n"
+		"				fetch(lightData, lightSize, 3.0 * light + 1.0),\n"
+		"				fetch(lightData, lightSize, 3.0 * light + 2.0));\n"
+		"	}\n"
+		"	if (wireframe) {\n"
+		"		vec3 width = fwidth(edgeDistance);\n"
+		"		vec3 edge = smoothstep(0.5 * width, 1.5 * width, edgeDistance);\n"
+		"		color = mix(vec3(1.0), color, min(min(edge.x, edge.y), edge.z));\n"
+		"	}\n"
+		"	gl_FragColor = vec4(color, gl_FrontMaterial.diffuse.a);\n"
+		"}\n";
+
+GLuint compileShader(GLenum type, const char* source) {
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, 0);
+	glCompileShader(shader);
+	GLint ok;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if (!ok) {
+		char log[4096];
+		glGetShaderInfoLog(shader, sizeof(log), 0, log);
+		printf("shader error: %s\n", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+GLuint linkProgram(const char* vertexSource, const char* fragmentSource) {
+	GLuint vertex = compileShader(GL_VERTEX_SHADER, vertexSource);
+	GLuint fragment = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+	if (!vertex || !fragment) {
+		return 0;
+	}
+	GLuint program = glCreateProgram();
+	glAttachShader(program, vertex);
+	glAttachShader(program, fragment);
+	glLinkProgram(program);
+	GLint ok;
+	glGetProgramiv(program, GL_LINK_STATUS, &ok);
+	if (!ok) {
+		char log[4096];
+		glGetProgramInfoLog(program, sizeof(log), 0, log);
+		printf("shader link error: %s\n", log);
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+void createDataTexture(DATATEXTURE* texture, int texels) {
+	glGenTextures(1, &texture->id);
+	glBindTexture(GL_TEXTURE_2D, texture->id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	texture->width = CLUSTER_TEXTURE_WIDTH;
+	texture->height = (texels + CLUSTER_TEXTURE_WIDTH - 1)
+			/ CLUSTER_TEXTURE_WIDTH;
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, texture->width,
+			texture->height, 0, GL_RGBA, GL_FLOAT, 0);
+}
+
+/*
+ * RGBA float texels, wrapped into rows of CLUSTER_TEXTURE_WIDTH. The
+ * storage is only re-specified when the data outgrows it; every other
+ * frame just replaces the rows in use.
+ */
+void uploadDataTexture(DATATEXTURE* texture, int unit,
+		const std::vector<float>& data, GLint sizeUniform) {
+	int texels = data.size() / 4;
+	int width = texture->width;
+	int rows = (texels + width - 1) / width;
+	glActiveTexture(GL_TEXTURE0 + unit);
+	glBindTexture(GL_TEXTURE_2D, texture->id);
+	if (rows > texture->height) {
+		texture->height = std::max(rows, 2 * texture->height);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, width, texture->height,
+				0, GL_RGBA, GL_FLOAT, 0);
+	}
+	if (texels >= width) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, texels / width,
+				GL_RGBA, GL_FLOAT, &data[0]);
+	}
+	if (texels % width > 0) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, texels / width, texels % width,
+				1, GL_RGBA, GL_FLOAT, &data[4 * (texels - texels % width)]);
+	}
+	glUniform2f(sizeUniform, width, texture->height);
+}
+
+bool initLightingProgram() {
+	if (_lighting_program || _lighting_program_failed) {
+		return _lighting_program != 0;
+	}
+	_lighting_program = linkProgram(LIGHTING_VERTEX_SHADER,
+			LIGHTING_FRAGMENT_SHADER);
+	if (!_lighting_program) {
+		_lighting_program_failed = true;
+		printf("per-pixel lighting is not available, using fixed function\n");
+		return false;
+	}
+	_barycentric_location = glGetAttribLocation(_lighting_program,
+			"barycentric");
+	createDataTexture(&_light_texture, CLUSTER_TEXTURE_WIDTH);
+	createDataTexture(&_cluster_texture, CLUSTER_COUNT);
+	createDataTexture(&_index_texture, CLUSTER_COUNT);
+	return true;
+}
+
+bool singlePassWireframe() {
+	return _view->polygonMode == POLYGON_MODE_LINE_FILL
+			&& !_view->twoPassWireframe;
+}
+
+/* the program also draws the single pass wireframe, see drawAllWithMode() */
+bool usesLightingProgram() {
+	return (_view->lightingPath == LIGHTING_PER_PIXEL || singlePassWireframe())
+			&& (_headless || initLightingProgram());
+}
+
+void beginClusteredLighting() {
+	if (!usesLightingProgram()) {
+		return;
+	}
+	GLuint program = _lighting_program;
+	glUseProgram(program);
+	std::vector<float> lights(12 * _eye_lights.size());
+	for (size_t i = 0; i < _eye_lights.size(); i++) {
+		memcpy(&lights[12 * i], &_eye_lights[i], 12 * sizeof(float));
+	}
+	uploadDataTexture(&_light_texture, 0, lights,
+			glGetUniformLocation(program, "lightSize"));
+	uploadDataTexture(&_cluster_texture, 1, _cluster_grid,
+			glGetUniformLocation(program, "clusterSize"));
+	uploadDataTexture(&_index_texture, 2, _cluster_indices,
+			glGetUniformLocation(program, "indexSize"));
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(glGetUniformLocation(program, "lightData"), 0);
+	glUniform1i(glGetUniformLocation(program, "clusterData"), 1);
+	glUniform1i(glGetUniformLocation(program, "indexData"), 2);
+	glUniform3f(glGetUniformLocation(program, "clusterCount"), CLUSTER_X,
+			CLUSTER_Y, CLUSTER_Z);
+	glUniform2f(glGetUniformLocation(program, "viewport"), _render_width,
+			_render_height);
+	glUniform2f(glGetUniformLocation(program, "depthRange"), NEAR_PLANE,
+			FAR_PLANE);
+	glUniform1i(glGetUniformLocation(program, "flatShading"),
+			_view->shadingModel == FLAT_SHADING);
+	glUniform1i(glGetUniformLocation(program, "wireframe"), 0);
+	glUniform1f(glGetUniformLocation(program, "pointSize"), 0.0f);
+	int count = _global_lights.size();
+	std::vector<float> position(4 * MAX_GLOBAL_LIGHTS);
+	std::vector<float> color(4 * MAX_GLOBAL_LIGHTS);
+	std::vector<float> spot(4 * MAX_GLOBAL_LIGHTS);
+	for (int i = 0; i < count; i++) {
+		memcpy(&position[4 * i], _global_lights[i].position, 4 * sizeof(float));
+		memcpy(&color[4 * i], _global_lights[i].color, 4 * sizeof(float));
+		memcpy(&spot[4 * i], _global_lights[i].spot, 4 * sizeof(float));
+	}
+	glUniform1i(glGetUniformLocation(program, "globalCount"), count);
+	glUniform4fv(glGetUniformLocation(program, "globalPosition"),
+			MAX_GLOBAL_LIGHTS, &position[0]);
+	glUniform4fv(glGetUniformLocation(program, "globalColor"),
+			MAX_GLOBAL_LIGHTS, &color[0]);
+	glUniform4fv(glGetUniformLocation(program, "globalSpot"),
+			MAX_GLOBAL_LIGHTS, &spot[0]);
+}
+
+void endClusteredLighting() {
+	if (_lighting_program) {
+		glUseProgram(0);
+	}
+}
+
+void printLightingStats() {
+	if (_view->lightingPath != LIGHTING_PER_PIXEL) {
+		return;
+	}
+	printf("    per-pixel lighting: %d scene lights, %d clustered lights, "
+			"%d indices, %d max per cluster, %d dropped\n",
+			(int) _global_lights.size(), (int) _eye_lights.size(),
+			(int) _cluster_indices.size() / 4, _cluster_max_lights,
+			_cluster_dropped_lights);
+}
+
+/*
+ * Single pass wireframe
+ *
+ * "Lines and Fill" used to draw everything twice, filled and then as
+ * lines, which doubled the vertex and material traffic and left the lines
+ * fighting the surface for depth. It now draws the surface once, from
+ * unindexed streams with a barycentric coordinate per corner, and the
+ * lighting program blends an anti-aliased white edge in where one of the
+ * coordinates falls within a pixel of zero. "Two Pass Line and Fill" puts
+ * the old way back for comparison; the frame time of each way is kept
+ * from the start and printed with the stats, the GPU time from a
+ * GL_TIME_ELAPSED query unless dynamic resolution already times the frame.
+ */
+#define WIREFRAME_QUERIES 4
+
+GLuint _barycentric_buffer = 0;
+int _barycentric_triangles = 0;
+bool _draw_wireframe = false;
+GLuint _wireframe_queries[WIREFRAME_QUERIES];
+int _wireframe_query_way[WIREFRAME_QUERIES];
+bool _wireframe_query_pending[WIREFRAME_QUERIES];
+int _wireframe_query_frame = 0;
+bool _wireframe_query_active = false;
+bool _wireframe_queries_ready = false;
+double _wireframe_cpu_ms[2] = { 0.0, 0.0 };
+double _wireframe_gpu_ms[2] = { 0.0, 0.0 };
+int _wireframe_frames[2] = { 0, 0 };
+int _wireframe_gpu_samples[2] = { 0, 0 };
+
+/* 0 for the single pass, 1 for the two passes */
+int wireframeWay() {
+	return singlePassWireframe() && usesLightingProgram() ? 0 : 1;
+}
+
+/* (1,0,0), (0,1,0), (0,0,1) for each of count triangles */
+void reserveBarycentrics(int count) {
+	if (count <= _barycentric_triangles) {
+		return;
+	}
+	std::vector<float> data(9 * count, 0.0f);
+	for (int c = 0; c < 3 * count; c++) {
+		data[3 * c + c % 3] = 1.0f;
+	}
+	if (!_barycentric_buffer) {
+		glGenBuffers(1, &_barycentric_buffer);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, _barycentric_buffer);
+	glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(float), &data[0],
+			GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	_barycentric_triangles = count;
+}
+
+void drawWireframeStreams(MESHSTREAMS* streams, bool flat) {
+	if (streams->triangles == 0 || _barycentric_location < 0) {
+		return;
+	}
+	if (!streams->uploaded) {
+		uploadMeshStreams(streams);
+	}
+	reserveBarycentrics(streams->triangles);
+	GLint wireframe = glGetUniformLocation(_lighting_program, "wireframe");
+	glUniform1i(wireframe, 1);
+	glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+	glBindBuffer(GL_ARRAY_BUFFER, _barycentric_buffer);
+	glEnableVertexAttribArray(_barycentric_location);
+	glVertexAttribPointer(_barycentric_location, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glBindBuffer(GL_ARRAY_BUFFER,
+			flat ? streams->flatBuffer : streams->wireBuffer);
+	glInterleavedArrays(GL_N3F_V3F, 0, 0);
+	glDrawArrays(GL_TRIANGLES, 0, 3 * streams->triangles);
+	glDisableVertexAttribArray(_barycentric_location);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glPopClientAttrib();
+	glUniform1i(wireframe, 0);
+}
+
+void beginWireframeTiming() {
+	_wireframe_query_active = false;
+	if (_view->polygonMode != POLYGON_MODE_LINE_FILL
+			|| _view->dynamicResolution) {
+		return;
+	}
+	if (!_wireframe_queries_ready) {
+		glGenQueries(WIREFRAME_QUERIES, _wireframe_queries);
+		for (int i = 0; i < WIREFRAME_QUERIES; i++) {
+			_wireframe_query_pending[i] = false;
+		}
+		_wireframe_queries_ready = true;
+	}
+	int slot = _wireframe_query_frame % WIREFRAME_QUERIES;
+	if (_wireframe_query_pending[slot]) {
+		GLint available = 0;
+		glGetQueryObjectiv(_wireframe_queries[slot], GL_QUERY_RESULT_AVAILABLE,
+				&available);
+		if (available) {
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(_wireframe_queries[slot], GL_QUERY_RESULT,
+					&ns);
+			int way = _wireframe_query_way[slot];
+			_wireframe_gpu_ms[way] += ns / 1000000.0;
+			_wireframe_gpu_samples[way]++;
+		}
+		_wireframe_query_pending[slot] = false;
+	}
+	_wireframe_query_way[slot] = wireframeWay();
+	glBeginQuery(GL_TIME_ELAPSED, _wireframe_queries[slot]);
+	_wireframe_query_active = true;
+}
+
+void endWireframeTiming() {
+	if (!_wireframe_query_active) {
+		return;
+	}
+	glEndQuery(GL_TIME_ELAPSED);
+	_wireframe_query_pending[_wireframe_query_frame % WIREFRAME_QUERIES] =
+			true;
+	_wireframe_query_frame++;
+}
+
+void recordWireframeFrame(double ms) {
+	if (_view->polygonMode != POLYGON_MODE_LINE_FILL) {
+		return;
+	}
+	int way = wireframeWay();
+	_wireframe_cpu_ms[way] += ms;
+	_wireframe_frames[way]++;
+}
+
+void printWireframeStats() {
+	const char* WAYS[2] = { "single pass", "two pass" };
+	for (int way = 0; way < 2; way++) {
+		if (_wireframe_frames[way] == 0) {
+			continue;
+		}
+		printf("    line and fill, %-11s %6.2f ms cpu", WAYS[way],
+				_wireframe_cpu_ms[way] / _wireframe_frames[way]);
+		if (_wireframe_gpu_samples[way] > 0) {
+			printf(" %6.2f ms gpu",
+					_wireframe_gpu_ms[way] / _wireframe_gpu_samples[way]);
+		}
+		printf("  (%d frames)\n", _wireframe_frames[way]);
+	}
+}
+
+/*
+ * Point clouds
+ *
+ * Point mode draws each mesh's point stream, every welded vertex once,
+ * instead of sending the triangles through as GL_POINT polygons, which
+ * transformed and lit a shared vertex once for each of its triangles.
+ * Points shrink with distance, through GL_POINT_DISTANCE_ATTENUATION or
+ * the lighting program's gl_PointSize. With more than _point_budget
+ * points in the frustum, every object draws the same fraction of its stream,
+ * which is shuffled so a prefix is an even sample; no object draws more
+ * points than the pixels it covers, and the points grow to close the gaps
+ * left by the ones not drawn.
+ */
+#define POINT_SIZE 2.0f
+#define POINT_MAX_SIZE 16.0f
+#define POINT_DEPTH 60.0f
+
+long long _point_budget = 2000000;
+float _point_fraction = 1.0f;
+bool _draw_points = false;
+long long _point_stats_drawn = 0;
+long long _point_stats_total = 0;
+int _point_stats_frames = 0;
+
+/* the share of every stream drawn this frame, before drawAll() */
+void updatePointBudget() {
+	long long total = 0;
+	for (int i = 0; i < _draw_count; i++) {
+		MESHSTREAMS* streams = getObjectStreams(&_objects[_draw_order[i]]);
+		if (streams) {
+			total += streams->vertices;
+		}
+	}
+	_point_fraction = 1.0f;
+	if (total > _point_budget) {
+		_point_fraction = (float) _point_budget / total;
+	}
+	_point_stats_total += total;
+	_point_stats_frames++;
+}
+
+void beginPoints() {
+	pushAttrib(GL_POINT_BIT | GL_ENABLE_BIT);
+	GLfloat attenuation[3] = { 0.0f, 0.0f, 1.0f / (POINT_DEPTH * POINT_DEPTH) };
+	glPointParameterfv(GL_POINT_DISTANCE_ATTENUATION, attenuation);
+	glPointParameterf(GL_POINT_SIZE_MIN, 1.0f);
+	glPointParameterf(GL_POINT_SIZE_MAX, POINT_MAX_SIZE);
+	if (usesLightingProgram()) {
+		glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+		glUniform1i(glGetUniformLocation(_lighting_program, "flatShading"), 0);
+	}
+	updatePointBudget();
+	_draw_points = true;
+}
+
+void endPoints() {
+	_draw_points = false;
+	if (usesLightingProgram()) {
+		glUniform1f(glGetUniformLocation(_lighting_program, "pointSize"), 0.0f);
+		glUniform1i(glGetUniformLocation(_lighting_program, "flatShading"),
+				_view->shadingModel == FLAT_SHADING);
+	}
+	popAttrib();
+}
+
+void drawPointStreams(MESHSTREAMS* streams, const DRAWCOMMAND* command) {
+	if (streams->vertices == 0) {
+		return;
+	}
+	if (!streams->uploaded) {
+		uploadMeshStreams(streams);
+	}
+	int count = (int) ceil(streams->vertices * _point_fraction);
+	float covered = PI * command->pixels * command->pixels;
+	if (count > covered) {
+		count = std::max(1, (int) covered);
+	}
+	count = std::min(count, streams->vertices);
+	float size = std::min(POINT_SIZE * sqrt((float) streams->vertices / count),
+			POINT_MAX_SIZE);
+	_point_stats_drawn += count;
+	glPointSize(size);
+	if (usesLightingProgram()) {
+		glUniform1f(glGetUniformLocation(_lighting_program, "pointSize"),
+				size * POINT_DEPTH);
+	}
+	glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+	glBindBuffer(GL_ARRAY_BUFFER, streams->pointBuffer);
+	glInterleavedArrays(GL_N3F_V3F, 0, 0);
+	glDrawArrays(GL_POINTS, 0, count);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glPopClientAttrib();
+}
+
+void printPointStats() {
+	if (_point_stats_frames == 0) {
+		return;
+	}
+	printf("    points: %.0f of %.0f drawn per frame, budget %lld\n",
+			(double) _point_stats_drawn / _point_stats_frames,
+			(double) _point_stats_total / _point_stats_frames, _point_budget);
+	_point_stats_drawn = 0;
+	_point_stats_total = 0;
+	_point_stats_frames = 0;
+}
+
+/*
+ * Per-object light culling
+ *
+ * Every frame each visible object's bounding sphere, in eye space, is
+ * tested against the cone of every spot light and the range of every
+ * light that has one; drawCommand() then only enables the GL lights that
+ * can reach the object. Point lights without attenuation reach everything.
+ * The test is conservative behind a spot light's apex.
+ */
+std::vector<LIGHT> _frame_lights;
+std::vector<EYELIGHT> _frame_eye_lights;
+unsigned int _frame_all_lights = 0;
+int _light_pairs = 0;
+int _light_pairs_culled = 0;
+
+void collectFrameLights() {
+	_frame_lights.clear();
+	_frame_eye_lights.clear();
+	collectSceneLights(_frame_lights);
+	_frame_all_lights = 0;
+	for (size_t i = 0; i < _frame_lights.size(); i++) {
+		EYELIGHT eye;
+		toEyeLight(&_frame_lights[i], &eye);
+		_frame_eye_lights.push_back(eye);
+		_frame_all_lights |= 1u << (_frame_lights[i].id - GL_LIGHT0);
+	}
+}
+
+bool lightReachesSphere(const EYELIGHT* light, const float* center,
+		float radius) {
+	float v[3];
+	for (int k = 0; k < 3; k++) {
+		v[k] = center[k] - light->position[k];
+	}
+	float distance2 = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+	float range = light->position[3];
+	if (range > 0.0f && distance2 > (range + radius) * (range + radius)) {
+		return false;
+	}
+	float cosine = light->spot[3];
+	if (cosine < -1.5f || cosine <= 0.0f || distance2 <= radius * radius) {
+		return true;
+	}
+	/* signed distance from the center to the cone's side */
+	float along = v[0] * light->spot[0] + v[1] * light->spot[1]
+			+ v[2] * light->spot[2];
+	float across = sqrt(std::max(0.0f, distance2 - along * along));
+	float sine = sqrt(1.0f - cosine * cosine);
+	return cosine * across - sine * along <= radius;
+}
+
+void jobCullLights(int i) {
+	DRAWCOMMAND* command = &_commands[i];
+	command->lights = _frame_all_lights;
+	if (!command->visible || !_view->lightCulling) {
+		return;
+	}
+	SCENEOBJECT* object = &_objects[i];
+	float modelView[16];
+	matMultiply(_frame_view, getObjectWorld(object), modelView);
+	float center[4];
+	matTransformPoint(modelView, (object->bmin[0] + object->bmax[0]) / 2,
+			(object->bmin[1] + object->bmax[1]) / 2,
+			(object->bmin[2] + object->bmax[2]) / 2, center);
+	float scale = 0.0f;
+	for (int c = 0; c < 3; c++) {
+		scale = std::max(scale,
+				modelView[4 * c] * modelView[4 * c]
+						+ modelView[4 * c + 1] * modelView[4 * c + 1]
+						+ modelView[4 * c + 2] * modelView[4 * c + 2]);
+	}
+	float half[3];
+	for (int k = 0; k < 3; k++) {
+		half[k] = (object->bmax[k] - object->bmin[k]) / 2;
+	}
+	float radius = sqrt(scale)
+			* sqrt(half[0] * half[0] + half[1] * half[1] + half[2] * half[2]);
+	for (size_t l = 0; l < _frame_lights.size(); l++) {
+		if (!lightReachesSphere(&_frame_eye_lights[l], center, radius)) {
+			command->lights &= ~(1u << (_frame_lights[l].id - GL_LIGHT0));
+		}
+	}
+}
+
+/* the state cache drops the lights whose state does not change */
+void applyLightMask(unsigned int mask) {
+	for (int l = 0; l < CACHED_LIGHTS; l++) {
+		if (_frame_all_lights & (1u << l)) {
+			setCapability(GL_LIGHT0 + l, (mask & (1u << l)) != 0);
+		}
+	}
+}
+
+/* runs in jobSortCommands() */
+void countCulledLights() {
+	int lights = _frame_lights.size();
+	_light_pairs = 0;
+	_light_pairs_culled = 0;
+	for (int i = 0; i < _draw_count; i++) {
+		unsigned int mask = _commands[_draw_order[i]].lights;
+		_light_pairs += lights;
+		for (int l = 0; l < lights; l++) {
+			if (!(mask & (1u << (_frame_lights[l].id - GL_LIGHT0)))) {
+				_light_pairs_culled++;
+			}
+		}
+	}
+}
+
+/*
+ * Ray picking
+ *
+ * Every mesh gets a bounding volume hierarchy built with the surface area
+ * heuristic (binned, BVH_BINS buckets per axis); it is stored on the mesh
+ * so it is built once. A small top-level BVH over the scene objects' room
+ * space bounds picks the candidate objects, whose own BVH is then walked
+ * with the ray moved into object space. Meshes of BVH_PARALLEL_TRIANGLES
+ * or more stop the build at BVH_SPLIT_DEPTH; the subtrees left there are
+ * built as jobs of their own and merged afterwards.
+ */
+#define BVH_BINS 12
+#define BVH_LEAF_SIZE 4
+#define BVH_MAX_LEAF_SIZE 16
+#define BVH_STACK_SIZE 128
+#define BVH_PARALLEL_TRIANGLES 16384
+#define BVH_SPLIT_DEPTH 4
+
+typedef struct {
+	int object;
+	int triangle;
+	float t;
+	float barycentric[3];
+} PICKRESULT;
+
+typedef bool (*BVHHITFUNC)(void* context, int primitive, const float* origin,
+		const float* direction, PICKRESULT* hit);
+
+/* a subtree left at BVH_SPLIT_DEPTH, built into nodes of its own */
+typedef struct {
+	BVH* bvh;
+	const float* boxes;
+	const float* centroids;
+	int node;
+	int first;
+	int count;
+	std::vector<BVHNODE> nodes;
+} BVHSPLIT;
+
+BVH* _scene_bvh = 0;
+PICKRESULT _picked = { -1, -1, 0.0f, { 0.0f, 0.0f, 0.0f } };
+
+float boxArea(const float* bmin, const float* bmax) {
+	float dx = bmax[0] - bmin[0];
+	float dy = bmax[1] - bmin[1];
+	float dz = bmax[2] - bmin[2];
+	if (dx < 0.0f || dy < 0.0f || dz < 0.0f) {
+		return 0.0f;
+	}
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+void bvhMakeLeaf(std::vector<BVHNODE>& nodes, int node, int first,
+		int count) {
+	nodes[node].first = first;
+	nodes[node].count = count;
+}
+
+/*
+ * boxes holds bmin/bmax (6 floats) and centroids 3 floats per primitive;
+ * with splits, nodes at BVH_SPLIT_DEPTH are queued there instead of built
+ */
+void bvhBuildNode(std::vector<BVHNODE>& nodes, int* indices,
+		const float* boxes, const float* centroids, int node, int first,
+		int count, int depth, std::vector<BVHSPLIT>* splits) {
+	float cmin[3];
+	float cmax[3];
+	BVHNODE* n = &nodes[node];
+	emptyBounds(n->bmin, n->bmax);
+	emptyBounds(cmin, cmax);
+	for (int i = first; i < first + count; i++) {
+		const float* box = boxes + 6 * indices[i];
+		const float* c = centroids + 3 * indices[i];
+		growBounds(n->bmin, n->bmax, box[0], box[1], box[2]);
+		growBounds(n->bmin, n->bmax, box[3], box[4], box[5]);
+		growBounds(cmin, cmax, c[0], c[1], c[2]);
+	}
+	if (count <= BVH_LEAF_SIZE) {
+		bvhMakeLeaf(nodes, node, first, count);
+		return;
+	}
+	if (splits && depth == BVH_SPLIT_DEPTH) {
+		BVHSPLIT split;
+		split.bvh = 0;
+		split.boxes = boxes;
+		split.centroids = centroids;
+		split.node = node;
+		split.first = first;
+		split.count = count;
+		splits->push_back(split);
+		return;
+	}
+
+	float bestCost = 1e30f;
+	int bestAxis = -1;
+	int bestBin = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		float extent = cmax[axis] - cmin[axis];
+		if (extent <= 1e-12f) {
+			continue;
+		}
+		int binCount[BVH_BINS] = { 0 };
+		float binMin[BVH_BINS][3];
+		float binMax[BVH_BINS][3];
+		for (int b = 0; b < BVH_BINS; b++) {
+			emptyBounds(binMin[b], binMax[b]);
+		}
+		for (int i = first; i < first + count; i++) {
+			const float* box = boxes + 6 * indices[i];
+			const float* c = centroids + 3 * indices[i];
+			int b = (int) (BVH_BINS * (c[axis] - cmin[axis]) / extent);
+			b = std::min(b, BVH_BINS - 1);
+			binCount[b]++;
+			growBounds(binMin[b], binMax[b], box[0], box[1], box[2]);
+			growBounds(binMin[b], binMax[b], box[3], box[4], box[5]);
+		}
+		/* sweep from the right, then evaluate every split from the left */
+		float rightArea[BVH_BINS];
+		int rightCount[BVH_BINS];
+		float rmin[3];
+		float rmax[3];
+		emptyBounds(rmin, rmax);
+		int total = 0;
+		for (int b = BVH_BINS - 1; b > 0; b--) {
+			if (binCount[b] > 0) {
+				growBounds(rmin, rmax, binMin[b][0], binMin[b][1], binMin[b][2]);
+				growBounds(rmin, rmax, binMax[b][0], binMax[b][1], binMax[b][2]);
+			}
+			total += binCount[b];
+			rightArea[b] = boxArea(rmin, rmax);
+			rightCount[b] = total;
+		}
+		float lmin[3];
+		float lmax[3];
+		emptyBounds(lmin, lmax);
+		total = 0;
+		for (int b = 0; b < BVH_BINS - 1; b++) {
+			if (binCount[b] > 0) {
+				growBounds(lmin, lmax, binMin[b][0], binMin[b][1], binMin[b][2]);
+				growBounds(lmin, lmax, binMax[b][0], binMax[b][1], binMax[b][2]);
+			}
+			total += binCount[b];
+			if (total == 0 || rightCount[b + 1] == 0) {
+				continue;
+			}
+			float cost = boxArea(lmin, lmax) * total
+					+ rightArea[b + 1] * rightCount[b + 1];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = b;
+			}
+		}
+	}
+
+	float leafCost = boxArea(n->bmin, n->bmax) * count;
+	if (bestAxis < 0
+			|| (bestCost >= leafCost && count <= BVH_MAX_LEAF_SIZE)) {
+		bvhMakeLeaf(nodes, node, first, count);
+		return;
+	}
+
+	int* begin = indices + first;
+	float extent = cmax[bestAxis] - cmin[bestAxis];
+	float lo = cmin[bestAxis];
+	int* middle = std::partition(begin, begin + count, [&](int prim) {
+		int b = (int) (BVH_BINS * (centroids[3 * prim + bestAxis] - lo) / extent);
+		return std::min(b, BVH_BINS - 1) <= bestBin;
+	});
+	int leftCount = middle - begin;
+	if (leftCount == 0 || leftCount == count) {
+		leftCount = count / 2;
+	}
+
+	int children = nodes.size();
+	nodes.resize(children + 2);
+	nodes[node].first = children;
+	nodes[node].count = 0;
+	bvhBuildNode(nodes, indices, boxes, centroids, children, first, leftCount,
+			depth + 1, splits);
+	bvhBuildNode(nodes, indices, boxes, centroids, children + 1,
+			first + leftCount, count - leftCount, depth + 1, splits);
+}
+
+/* children always come after their parent */
+void bvhMeasureDepth(BVH* bvh) {
+	std::vector<int> depth(bvh->nodes.size(), 1);
+	bvh->depth = 1;
+	for (size_t i = 0; i < bvh->nodes.size(); i++) {
+		const BVHNODE* node = &bvh->nodes[i];
+		if (node->count == 0 && node->first > (int) i) {
+			depth[node->first] = depth[node->first + 1] = depth[i] + 1;
+			bvh->depth = std::max(bvh->depth, depth[i] + 1);
+		}
+	}
+}
+
+BVH* beginBVH(const float* boxes, const float* centroids, int count,
+		std::vector<BVHSPLIT>* splits) {
+	BVH* bvh = new BVH;
+	bvh->indices.resize(count);
+	for (int i = 0; i < count; i++) {
+		bvh->indices[i] = i;
+	}
+	bvh->nodes.reserve(2 * count / BVH_LEAF_SIZE + 1);
+	bvh->nodes.resize(1);
+	if (count == 0) {
+		emptyBounds(bvh->nodes[0].bmin, bvh->nodes[0].bmax);
+		bvhMakeLeaf(bvh->nodes, 0, 0, 0);
+	} else {
+		bvhBuildNode(bvh->nodes, &bvh->indices[0], boxes, centroids, 0, 0,
+				count, 0, splits);
+	}
+	bvhMeasureDepth(bvh);
+	return bvh;
+}
+
+BVH* buildBVH(const float* boxes, const float* centroids, int count) {
+	return beginBVH(boxes, centroids, count, 0);
+}
+
+/* the split's primitives are its own range of the shared indices */
+void buildBVHSplit(BVHSPLIT* split) {
+	split->nodes.resize(1);
+	bvhBuildNode(split->nodes, &split->bvh->indices[0], split->boxes,
+			split->centroids, 0, split->first, split->count, 0, 0);
+}
+
+/* the split's root replaces its node, the rest is appended */
+void mergeBVHSplit(BVHSPLIT* split) {
+	std::vector<BVHNODE>& nodes = split->bvh->nodes;
+	int offset = nodes.size() - 1;
+	for (size_t i = 0; i < split->nodes.size(); i++) {
+		BVHNODE node = split->nodes[i];
+		if (node.count == 0) {
+			node.first += offset;
+		}
+		if (i == 0) {
+			nodes[split->node] = node;
+		} else {
+			nodes.push_back(node);
+		}
+	}
+	split->nodes.clear();
+}
+
+void getTriangle(const SCENEOBJECT* object, int triangle, float* v) {
+	if (object->off) {
+		INT3VECTPLUS* face = &object->off->face[triangle];
+		FLTVECTPLUS* p[3] = { &object->off->vertex[face->a],
+				&object->off->vertex[face->b], &object->off->vertex[face->c] };
+		for (int k = 0; k < 3; k++) {
+			v[3 * k] = p[k]->x;
+			v[3 * k + 1] = p[k]->y;
+			v[3 * k + 2] = p[k]->z;
+		}
+	} else {
+		TRIANGLEPLUS* t = &object->raw->list[triangle];
+		FLTVECTPLUS* p[3] = { t->p1, t->p2, t->p3 };
+		for (int k = 0; k < 3; k++) {
+			v[3 * k] = p[k]->x;
+			v[3 * k + 1] = p[k]->y;
+			v[3 * k + 2] = p[k]->z;
+		}
+	}
+}
+
+int getTriangleCount(const SCENEOBJECT* object) {
+	return object->off ? object->off->nf : object->raw->count;
+}
+
+BVH** getMeshBVH(SCENEOBJECT* object) {
+	return object->off ? &object->off->bvh : &object->raw->bvh;
+}
+
+typedef struct {
+	SCENEOBJECT* object;
+	std::vector<float> boxes;
+	std::vector<float> centroids;
+	std::vector<BVHSPLIT> splits;
+} MESHBVHBUILD;
+
+std::deque<MESHBVHBUILD> _bvh_builds;
+std::vector<BVHSPLIT*> _bvh_splits;
+
+void jobBuildMeshBVH(int i) {
+	MESHBVHBUILD* build = &_bvh_builds[i];
+	SCENEOBJECT* object = build->object;
+	int count = getTriangleCount(object);
+	std::vector<float>& boxes = build->boxes;
+	std::vector<float>& centroids = build->centroids;
+	boxes.resize(6 * count);
+	centroids.resize(3 * count);
+	for (int t = 0; t < count; t++) {
+		float v[9];
+		getTriangle(object, t, v);
+		float* box = &boxes[6 * t];
+		emptyBounds(box, box + 3);
+		for (int k = 0; k < 3; k++) {
+			growBounds(box, box + 3, v[3 * k], v[3 * k + 1], v[3 * k + 2]);
+			centroids[3 * t + k] = (v[k] + v[3 + k] + v[6 + k]) / 3.0f;
+		}
+	}
+	*getMeshBVH(object) = beginBVH(boxes.empty() ? 0 : &boxes[0],
+			centroids.empty() ? 0 : &centroids[0], count,
+			count >= BVH_PARALLEL_TRIANGLES ? &build->splits : 0);
+}
+
+void jobBuildBVHSplit(int i) {
+	buildBVHSplit(_bvh_splits[i]);
+}
+
+void getSceneBoxes(std::vector<float>& boxes, std::vector<float>& centroids) {
+	boxes.resize(6 * _object_count);
+	centroids.resize(3 * _object_count);
+	for (int i = 0; i < _object_count; i++) {
+		SCENEOBJECT* object = &_objects[i];
+		const SCENENODE* node = &_nodes[object->node];
+		float* box = &boxes[6 * i];
+		memcpy(box, node->wmin, 3 * sizeof(float));
+		memcpy(box + 3, node->wmax, 3 * sizeof(float));
+		for (int k = 0; k < 3; k++) {
+			centroids[3 * i + k] = (box[k] + box[3 + k]) / 2.0f;
+		}
+	}
+}
+
+/* children always come after their parent, so a reverse sweep refits */
+void refitBVH(BVH* bvh, const float* boxes) {
+	for (int i = bvh->nodes.size() - 1; i >= 0; i--) {
+		BVHNODE* node = &bvh->nodes[i];
+		emptyBounds(node->bmin, node->bmax);
+		if (node->count > 0) {
+			for (int p = node->first; p < node->first + node->count; p++) {
+				const float* box = boxes + 6 * bvh->indices[p];
+				growBounds(node->bmin, node->bmax, box[0], box[1], box[2]);
+				growBounds(node->bmin, node->bmax, box[3], box[4], box[5]);
+			}
+			continue;
+		}
+		for (int c = node->first; c < node->first + 2; c++) {
+			const BVHNODE* child = &bvh->nodes[c];
+			growBounds(node->bmin, node->bmax, child->bmin[0], child->bmin[1],
+					child->bmin[2]);
+			growBounds(node->bmin, node->bmax, child->bmax[0], child->bmax[1],
+					child->bmax[2]);
+		}
+	}
+}
+
+int _scene_bvh_version = -1;
+int _scene_bvh_objects = 0;
+
+/*
+ * The top level follows the scene graph: it is rebuilt when objects are
+ * added and refitted when any world transform changed.
+ */
+void updateSceneBVH() {
+	updateSceneTransform();
+	updateSceneGraph();
+	if (_scene_bvh && _scene_bvh_version == _scene_graph_version) {
+		return;
+	}
+	std::vector<float> boxes;
+	std::vector<float> centroids;
+	getSceneBoxes(boxes, centroids);
+	if (!_scene_bvh || _scene_bvh_objects != _object_count) {
+		delete _scene_bvh;
+		_scene_bvh = buildBVH(&boxes[0], &centroids[0], _object_count);
+		_scene_bvh_objects = _object_count;
+	} else {
+		refitBVH(_scene_bvh, &boxes[0]);
+	}
+	_scene_bvh_version = _scene_graph_version;
+}
+
+/* one job per mesh, then one per subtree of the large meshes */
+void initPicking() {
+	/* instances share their mesh's tree */
+	std::set<BVH**> meshes;
+	for (int i = 0; i < _object_count; i++) {
+		if (!*getMeshBVH(&_objects[i])
+				&& meshes.insert(getMeshBVH(&_objects[i])).second) {
+			_bvh_builds.push_back(MESHBVHBUILD());
+			_bvh_builds.back().object = &_objects[i];
+			addJob("build bvh", jobBuildMeshBVH, _bvh_builds.size() - 1);
+		}
+	}
+	double start = nowMs();
+	runJobGraph();
+	for (size_t i = 0; i < _bvh_builds.size(); i++) {
+		std::vector<BVHSPLIT>& splits = _bvh_builds[i].splits;
+		for (size_t k = 0; k < splits.size(); k++) {
+			splits[k].bvh = *getMeshBVH(_bvh_builds[i].object);
+			_bvh_splits.push_back(&splits[k]);
+		}
+	}
+	for (size_t i = 0; i < _bvh_splits.size(); i++) {
+		addJob("build bvh split", jobBuildBVHSplit, i);
+	}
+	runJobGraph();
+	for (size_t i = 0; i < _bvh_builds.size(); i++) {
+		std::vector<BVHSPLIT>& splits = _bvh_builds[i].splits;
+		for (size_t k = 0; k < splits.size(); k++) {
+			mergeBVHSplit(&splits[k]);
+		}
+		if (!splits.empty()) {
+			bvhMeasureDepth(splits[0].bvh);
+		}
+	}
+	_bvh_builds.clear();
+	_bvh_splits.clear();
+	updateSceneBVH();
+	printf("BVH build: %.1f ms for %d objects\n", nowMs() - start,
+			_object_count);
+}
+
+bool rayBox(const float* origin, const float* inverse, const float* bmin,
+		const float* bmax, float tmax, float* tnear) {
+	float t0 = 0.0f;
+	float t1 = tmax;
+	for (int axis = 0; axis < 3; axis++) {
+		float ta = (bmin[axis] - origin[axis]) * inverse[axis];
+		float tb = (bmax[axis] - origin[axis]) * inverse[axis];
+		if (ta > tb) {
+			std::swap(ta, tb);
+		}
+		t0 = std::max(t0, ta);
+		t1 = std::min(t1, tb);
+		if (t0 > t1) {
+			return false;
+		}
+	}
+	*tnear = t0;
+	return true;
+}
+
+/* Moller-Trumbore; t is in units of the (unnormalized) ray direction */
+bool rayTriangle(const float* origin, const float* direction, const float* v,
+		float* t, float* u, float* w) {
+	float e1[3] = { v[3] - v[0], v[4] - v[1], v[5] - v[2] };
+	float e2[3] = { v[6] - v[0], v[7] - v[1], v[8] - v[2] };
+	float p[3] = { direction[1] * e2[2] - direction[2] * e2[1], direction[2]
+			* e2[0] - direction[0] * e2[2], direction[0] * e2[1]
+			- direction[1] * e2[0] };
+	float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+	if (fabs(det) < 1e-20f) {
+		return false;
+	}
+	float inv = 1.0f / det;
+	float s[3] = { origin[0] - v[0], origin[1] - v[1], origin[2] - v[2] };
+	*u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv;
+	if (*u < 0.0f || *u > 1.0f) {
+		return false;
+	}
+	float q[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2],
+			s[0] * e1[1] - s[1] * e1[0] };
+	*w = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2])
+			* inv;
+	if (*w < 0.0f || *u + *w > 1.0f) {
+		return false;
+	}
+	*t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv;
+	return *t > 0.0f;
+}
+
+/* nearest child first; hit->t is the current closest distance */
+bool bvhTraverse(const BVH* bvh, const float* origin, const float* direction,
+		BVHHITFUNC hitFunc, void* context, PICKRESULT* hit) {
+	float inverse[3];
+	for (int k = 0; k < 3; k++) {
+		inverse[k] = 1.0f / direction[k];
+	}
+	bool found = false;
+	/* a walk holds at most one pending sibling per level, plus two */
+	int local[BVH_STACK_SIZE];
+	std::vector<int> deep;
+	int* stack = local;
+	if (bvh->depth + 1 > BVH_STACK_SIZE) {
+		deep.resize(bvh->depth + 1);
+		stack = &deep[0];
+	}
+	int top = 0;
+	float tnear;
+	if (!rayBox(origin, inverse, bvh->nodes[0].bmin, bvh->nodes[0].bmax,
+			hit->t, &tnear)) {
+		return false;
+	}
+	stack[top++] = 0;
+	while (top > 0) {
+		const BVHNODE* node = &bvh->nodes[stack[--top]];
+		if (node->count > 0) {
+			for (int i = node->first; i < node->first + node->count; i++) {
+				if (hitFunc(context, bvh->indices[i], origin, direction, hit)) {
+					found = true;
+				}
+			}
+			continue;
+		}
+		float tl;
+		float tr;
+		const BVHNODE* left = &bvh->nodes[node->first];
+		const BVHNODE* right = &bvh->nodes[node->first + 1];
+		bool hl = rayBox(origin, inverse, left->bmin, left->bmax, hit->t, &tl);
+		bool hr = rayBox(origin, inverse, right->bmin, right->bmax, hit->t,
+				&tr);
+		if (hl && hr) {
+			if (tl < tr) {
+				stack[top++] = node->first + 1;
+				stack[top++] = node->first;
+			} else {
+				stack[top++] = node->first;
+				stack[top++] = node->first + 1;
+			}
+		} else if (hl) {
+			stack[top++] = node->first;
+		} else if (hr) {
+			stack[top++] = node->first + 1;
+		}
+	}
+	return found;
+}
+
+bool hitTriangle(void* context, int triangle, const float* origin,
+		const float* direction, PICKRESULT* hit) {
+	SCENEOBJECT* object = (SCENEOBJECT*) context;
+	float v[9];
+	float t;
+	float u;
+	float w;
+	getTriangle(object, triangle, v);
+	if (!rayTriangle(origin, direction, v, &t, &u, &w) || t >= hit->t) {
+		return false;
+	}
+	hit->object = object - _objects;
+	hit->triangle = triangle;
+	hit->t = t;
+	hit->barycentric[0] = 1.0f - u - w;
+	hit->barycentric[1] = u;
+	hit->barycentric[2] = w;
+	return true;
+}
+
+/* context is the object array the top level was built over */
+bool hitObject(void* context, int i, const float* origin,
+		const float* direction, PICKRESULT* hit) {
+	SCENEOBJECT* object = (SCENEOBJECT*) context + i;
+	float inverse[16];
+	float o[4];
+	float d[4];
+	matInvert(getObjectWorld(object), inverse);
+	matTransformPoint(inverse, origin[0], origin[1], origin[2], o);
+	matTransformVector(inverse, direction[0], direction[1], direction[2], d);
+	return bvhTraverse(*getMeshBVH(object), o, d, hitTriangle, object, hit);
+}
+
+/* window coordinates to a ray in world space, then through both levels */
+bool pickRay(int x, int y, PICKRESULT* hit) {
+	updateSceneBVH();
+	computeFrameMatrix();
+	float inverse[16];
+	if (!matInvert(_frame_mvp, inverse)) {
+		return false;
+	}
+	float ndcX = 2.0f * x / _current_width - 1.0f;
+	float ndcY = 1.0f - 2.0f * y / _current_height;
+	float nearPoint[4];
+	float farPoint[4];
+	matTransformPoint(inverse, ndcX, ndcY, -1.0f, nearPoint);
+	matTransformPoint(inverse, ndcX, ndcY, 1.0f, farPoint);
+	float origin[3];
+	float direction[3];
+	for (int k = 0; k < 3; k++) {
+		origin[k] = nearPoint[k] / nearPoint[3];
+		direction[k] = farPoint[k] / farPoint[3] - origin[k];
+	}
+	hit->object = -1;
+	hit->triangle = -1;
+	hit->t = 1.0f;
+	return bvhTraverse(_scene_bvh, origin, direction, hitObject, _objects,
+			hit);
+}
+
+void pickAtMouse(int x, int y, bool report) {
+	double start = nowMs();
+	PICKRESULT hit;
+	bool found = pickRay(x, y, &hit);
+	double us = (nowMs() - start) * 1000.0;
+	if (found) {
+		_picked = hit;
+	} else {
+		_picked.object = -1;
+	}
+	if (!report) {
+		return;
+	}
+	if (found) {
+		printf("picked %s: triangle %d, barycentric (%.3f, %.3f, %.3f), "
+				"%.1f us\n", _objects[hit.object].name, hit.triangle,
+				hit.barycentric[0], hit.barycentric[1], hit.barycentric[2], us);
+	} else {
+		printf("picked nothing, %.1f us\n", us);
+	}
+}
+
+void drawPickedTriangle() {
+	if (_picked.object < 0) {
+		return;
+	}
+	SCENEOBJECT* object = &_objects[_picked.object];
+	float v[9];
+	getTriangle(object, _picked.triangle, v);
+	glPushMatrix();
+	glMultMatrixf(getObjectWorld(object));
+	pushAttrib(GL_ENABLE_BIT | GL_POLYGON_BIT | GL_CURRENT_BIT);
+	glDisable(GL_LIGHTING);
+	glDisable(GL_DEPTH_TEST);
+	glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	glColor3f(1.0, 1.0, 0.0);
+	glBegin(GL_TRIANGLES);
+	glVertex3fv(v);
+	glVertex3fv(v + 3);
+	glVertex3fv(v + 6);
+	glEnd();
+	popAttrib();
+	glPopMatrix();
+}
+
+/*
+ * Out-of-core meshes
+ *
+ * convertToChunked() streams a RAW file of any size into a chunk file: the
+ * triangles are binned into a uniform grid over the mesh bounds, every
+ * cell becomes one or more chunks of at most CHUNK_MAX_TRIANGLES, and
+ * every chunk starts on a page boundary so it can be mapped on its own.
+ * Vertices are stored as GL_N3F_V3F (face normal, position) and drawn
+ * straight from the mapping.
+ *
+ * At view time only the chunks that pass the frustum test are mapped,
+ * a few per frame on the job workers, and the least recently visible
+ * ones are unmapped whenever the resident size exceeds the budget.
+ */
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+#define CHUNK_MAGIC 0x314b4843
+#define CHUNK_PAGE 4096
+#define CHUNK_TARGET_TRIANGLES 65536
+#define CHUNK_MAX_TRIANGLES 262144
+#define CHUNK_MAX_CELLS 4096
+#define CHUNK_CELL_BUFFER 64
+#define CHUNK_PAGE_INS_PER_FRAME 8
+#define CHUNK_TRIANGLE_BYTES (3 * 6 * sizeof(float))
+
+typedef struct {
+	unsigned int magic;
+	unsigned int chunkCount;
+	long long triangles;
+	float bmin[3];
+	float bmax[3];
+} CHUNKHEADER;
+
+typedef struct {
+	long long offset;
+	int count;
+	float bmin[3];
+	float bmax[3];
+} CHUNKENTRY;
+
+typedef struct {
+	CHUNKENTRY entry;
+	char* data;
+	int lastVisible;
+	bool visible;
+} STREAMCHUNK;
+
+typedef struct {
+	int fd;
+	FILE* file;
+	CHUNKHEADER header;
+	STREAMCHUNK* chunks;
+	int node;
+	long long budget;
+	std::atomic<long long> resident;
+	int frame;
+	int visibleChunks;
+	int drawnChunks;
+	int pageIns;
+	int evictions;
+	double pageInMs;
+	double pageInMaxMs;
+} STREAMEDMESH;
+
+STREAMEDMESH* _streamed_mesh = 0;
+long long _stream_budget_mb = 512;
+std::vector<int> _stream_requests;
+
+long long alignPage(long long offset) {
+	return (offset + CHUNK_PAGE - 1) / CHUNK_PAGE * CHUNK_PAGE;
+}
+
+bool readRawHeader(FILE* fin, long long* count) {
+	char line[256];
+	while (fgets(line, 256, fin) != NULL) {
+		if (line[0] == 'R' && line[1] == 'A' && line[2] == 'W') /* RAW format */
+			return fscanf(fin, "%lld\n", count) == 1;
+	}
+	return false;
+}
+
+bool readRawTriangle(FILE* fin, float* v) {
+	return fscanf(fin, "%f %f %f %f %f %f %f %f %f\n", &v[0], &v[1], &v[2],
+			&v[3], &v[4], &v[5], &v[6], &v[7], &v[8]) == 9;
+}
+
+int chunkCell(const float* v, const float* bmin, const float* extent,
+		const int* grid) {
+	int cell[3];
+	for (int k = 0; k < 3; k++) {
+		float c = (v[k] + v[3 + k] + v[6 + k]) / 3.0f;
+		cell[k] = extent[k] > 0.0f ? (int) ((c - bmin[k]) / extent[k] * grid[k]) : 0;
+		cell[k] = std::max(0, std::min(cell[k], grid[k] - 1));
+	}
+	return (cell[2] * grid[1] + cell[1]) * grid[0] + cell[0];
+}
+
+void writeChunkTriangle(const float* v, float* out) {
+	float e1[3] = { v[3] - v[0], v[4] - v[1], v[5] - v[2] };
+	float e2[3] = { v[6] - v[0], v[7] - v[1], v[8] - v[2] };
+	float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e2[2] * e1[0],
+			e1[0] * e2[1] - e1[1] * e2[0] };
+	for (int k = 0; k < 3; k++) {
+		memcpy(out + 6 * k, n, 3 * sizeof(float));
+		memcpy(out + 6 * k + 3, v + 3 * k, 3 * sizeof(float));
+	}
+}
+
+/* three streaming passes: bounds, cell counts, then the binned write */
+int convertToChunked(const char* input, const char* output) {
+	double start = nowMs();
+	FILE* fin = fopen(input, "r");
+	if (fin == NULL) {
+		printf("read error... %s\n", input);
+		return 65;
+	}
+	long long declared;
+	if (!readRawHeader(fin, &declared)) {
+		printf("Errors: reading mesh .... %s\n", input);
+		fclose(fin);
+		return 65;
+	}
+	long long dataStart = ftell64(fin);
+
+	CHUNKHEADER header;
+	header.magic = CHUNK_MAGIC;
+	header.triangles = 0;
+	emptyBounds(header.bmin, header.bmax);
+	float v[9];
+	while (readRawTriangle(fin, v)) {
+		for (int k = 0; k < 3; k++) {
+			growBounds(header.bmin, header.bmax, v[3 * k], v[3 * k + 1],
+					v[3 * k + 2]);
+		}
+		header.triangles++;
+	}
+	if (header.triangles != declared) {
+		printf("warning: header says %lld triangles, file has %lld\n",
+				declared, header.triangles);
+	}
+
+	/* cells proportional to the extent, about CHUNK_TARGET_TRIANGLES each */
+	float extent[3];
+	for (int k = 0; k < 3; k++) {
+		extent[k] = header.bmax[k] - header.bmin[k];
+	}
+	float largest = std::max(extent[0], std::max(extent[1], extent[2]));
+	double cells = std::min((double) CHUNK_MAX_CELLS,
+			std::max(1.0, (double) header.triangles / CHUNK_TARGET_TRIANGLES));
+	int grid[3];
+	for (int k = 0; k < 3; k++) {
+		grid[k] = std::max(1, (int) (cbrt(cells) * extent[k] / largest + 0.5));
+	}
+	int cellCount = grid[0] * grid[1] * grid[2];
+
+	std::vector<long long> cellTriangles(cellCount, 0);
+	fseek64(fin, dataStart, SEEK_SET);
+	while (readRawTriangle(fin, v)) {
+		cellTriangles[chunkCell(v, header.bmin, extent, grid)]++;
+	}
+
+	/* chunk table: every cell split into pieces of CHUNK_MAX_TRIANGLES */
+	std::vector<CHUNKENTRY> entries;
+	std::vector<int> cellFirstChunk(cellCount);
+	for (int c = 0; c < cellCount; c++) {
+		cellFirstChunk[c] = entries.size();
+		for (long long done = 0; done < cellTriangles[c];
+				done += CHUNK_MAX_TRIANGLES) {
+			CHUNKENTRY entry;
+			entry.count = (int) std::min((long long) CHUNK_MAX_TRIANGLES,
+					cellTriangles[c] - done);
+			emptyBounds(entry.bmin, entry.bmax);
+			entries.push_back(entry);
+		}
+	}
+	header.chunkCount = entries.size();
+	long long offset = alignPage(
+			sizeof(CHUNKHEADER) + entries.size() * sizeof(CHUNKENTRY));
+	for (size_t i = 0; i < entries.size(); i++) {
+		entries[i].offset = offset;
+		offset = alignPage(offset + entries[i].count * CHUNK_TRIANGLE_BYTES);
+	}
+
+	FILE* fout = fopen(output, "wb");
+	if (fout == NULL) {
+		printf("write error... %s\n", output);
+		fclose(fin);
+		return 65;
+	}
+	std::vector<long long> cellWritten(cellCount, 0);
+	std::vector<long long> cellFlushed(cellCount, 0);
+	std::vector<std::vector<float> > buffers(cellCount);
+	/* a flush may span two chunks of the same cell */
+	auto flushCell = [&](int c) {
+		std::vector<float>& buffer = buffers[c];
+		long long index = cellFlushed[c];
+		for (size_t t = 0; t < buffer.size() / 18; t++, index++) {
+			long long inChunk = index % CHUNK_MAX_TRIANGLES;
+			if (t == 0 || inChunk == 0) {
+				CHUNKENTRY* entry = &entries[cellFirstChunk[c]
+						+ index / CHUNK_MAX_TRIANGLES];
+				fseek64(fout, entry->offset + inChunk * CHUNK_TRIANGLE_BYTES,
+						SEEK_SET);
+			}
+			fwrite(&buffer[18 * t], CHUNK_TRIANGLE_BYTES, 1, fout);
+		}
+		cellFlushed[c] = index;
+		buffer.clear();
+	};
+	fseek64(fin, dataStart, SEEK_SET);
+	while (readRawTriangle(fin, v)) {
+		int c = chunkCell(v, header.bmin, extent, grid);
+		CHUNKENTRY* entry = &entries[cellFirstChunk[c]
+				+ cellWritten[c] / CHUNK_MAX_TRIANGLES];
+		for (int k = 0; k < 3; k++) {
+			growBounds(entry->bmin, entry->bmax, v[3 * k], v[3 * k + 1],
+					v[3 * k + 2]);
+		}
+		cellWritten[c]++;
+		size_t at = buffers[c].size();
+		buffers[c].resize(at + 18);
+		writeChunkTriangle(v, &buffers[c][at]);
+		if (at / 18 + 1 == CHUNK_CELL_BUFFER) {
+			flushCell(c);
+		}
+	}
+	for (int c = 0; c < cellCount; c++) {
+		flushCell(c);
+	}
+	/* pad the last chunk to a whole page so every mapping is in the file */
+	if (offset > 0) {
+		fseek64(fout, offset - 1, SEEK_SET);
+		fputc(0, fout);
+	}
+	fseek64(fout, 0, SEEK_SET);
+	fwrite(&header, sizeof(CHUNKHEADER), 1, fout);
+	if (!entries.empty()) {
+		fwrite(&entries[0], sizeof(CHUNKENTRY), entries.size(), fout);
+	}
+	fclose(fout);
+	fclose(fin);
+	printf("%s: %lld triangles in %u chunks (%dx%dx%d grid), %.1f MB, "
+			"%.1f s\n", output, header.triangles, header.chunkCount, grid[0],
+			grid[1], grid[2], offset / 1048576.0, (nowMs() - start) / 1000.0);
+	return 0;
+}
+
+STREAMEDMESH* openChunkedMesh(const char* file, long long budget) {
+	FILE* fin = fopen(file, "rb");
+	if (fin == NULL) {
+		printf("read error... %s\n", file);
+		exit(65);
+	}
+	STREAMEDMESH* mesh = new STREAMEDMESH;
+	if (fread(&mesh->header, sizeof(CHUNKHEADER), 1, fin) != 1
+			|| mesh->header.magic != CHUNK_MAGIC) {
+		printf("Errors: reading mesh .... %s is not a chunk file\n", file);
+		exit(65);
+	}
+	fseek64(fin, 0, SEEK_END);
+	long long size = ftell64(fin);
+	fseek64(fin, sizeof(CHUNKHEADER), SEEK_SET);
+	if (mesh->header.chunkCount
+			> (size - sizeof(CHUNKHEADER)) / sizeof(CHUNKENTRY)) {
+		printf("Errors: reading mesh .... %s is truncated\n", file);
+		exit(65);
+	}
+	std::vector<CHUNKENTRY> entries(mesh->header.chunkCount);
+	if (!entries.empty() && fread(&entries[0], sizeof(CHUNKENTRY),
+			entries.size(), fin) != entries.size()) {
+		printf("Errors: reading mesh .... %s is truncated\n", file);
+		exit(65);
+	}
+	/* every chunk is mapped whole, so all of its pages must be in the file */
+	for (size_t i = 0; i < entries.size(); i++) {
+		const CHUNKENTRY* entry = &entries[i];
+		if (entry->count < 0 || entry->count > CHUNK_MAX_TRIANGLES
+				|| entry->offset < 0 || entry->offset % CHUNK_PAGE != 0
+				|| entry->offset > size - alignPage(
+						entry->count * CHUNK_TRIANGLE_BYTES)) {
+			printf("Errors: reading mesh .... %s: chunk %d is damaged or "
+					"truncated\n", file, (int) i);
+			exit(65);
+		}
+	}
+	mesh->chunks = new STREAMCHUNK[entries.size()];
+	for (size_t i = 0; i < entries.size(); i++) {
+		mesh->chunks[i].entry = entries[i];
+		mesh->chunks[i].data = 0;
+		mesh->chunks[i].lastVisible = -1;
+		mesh->chunks[i].visible = false;
+	}
+#ifdef _WIN32
+	mesh->file = fin;
+	mesh->fd = -1;
+#else
+	fclose(fin);
+	mesh->file = 0;
+	mesh->fd = open(file, O_RDONLY);
+	if (mesh->fd < 0) {
+		perror(file);
+		exit(65);
+	}
+#endif
+	mesh->budget = budget;
+	mesh->resident = 0;
+	mesh->frame = 0;
+	mesh->visibleChunks = mesh->drawnChunks = 0;
+	mesh->pageIns = mesh->evictions = 0;
+	mesh->pageInMs = mesh->pageInMaxMs = 0.0;
+
+	/* fit the scan into the room: about 20 units across, centered */
+	float* bmin = mesh->header.bmin;
+	float* bmax = mesh->header.bmax;
+	float largest = std::max(bmax[0] - bmin[0],
+			std::max(bmax[1] - bmin[1], bmax[2] - bmin[2]));
+	float scale = largest > 0.0f ? 20.0f / largest : 1.0f;
+	mesh->node = addSceneNode("streamed mesh", NODE_SCENE);
+	memcpy(_nodes[mesh->node].bmin, bmin, 3 * sizeof(float));
+	memcpy(_nodes[mesh->node].bmax, bmax, 3 * sizeof(float));
+	float local[16];
+	matIdentity(local);
+	matScale(local, scale, scale, scale);
+	matTranslate(local, -(bmin[0] + bmax[0]) / 2, -(bmin[1] + bmax[1]) / 2,
+			-(bmin[2] + bmax[2]) / 2);
+	setNodeLocal(mesh->node, local);
+	printf("%s: %lld triangles in %u chunks, budget %.0f MB\n", file,
+			mesh->header.triangles, mesh->header.chunkCount,
+			budget / 1048576.0);
+	return mesh;
+}
+
+long long chunkBytes(const STREAMCHUNK* chunk) {
+	return alignPage(chunk->entry.count * CHUNK_TRIANGLE_BYTES);
+}
+
+/* runs on a job worker; the mapping is touched so the latency is real */
+void jobPageInChunk(int i) {
+	STREAMEDMESH* mesh = _streamed_mesh;
+	STREAMCHUNK* chunk = &mesh->chunks[_stream_requests[i]];
+	long long bytes = chunkBytes(chunk);
+	double start = nowMs();
+#ifdef _WIN32
+	char* data = (char*) malloc(bytes);
+	size_t size = chunk->entry.count * CHUNK_TRIANGLE_BYTES;
+	static std::mutex fileLock;
+	{
+		std::lock_guard<std::mutex> guard(fileLock);
+		if (fseek64(mesh->file, chunk->entry.offset, SEEK_SET) != 0
+				|| fread(data, 1, size, mesh->file) != size) {
+			free(data);
+			return;
+		}
+	}
+#else
+	char* data = (char*) mmap(0, bytes, PROT_READ, MAP_PRIVATE, mesh->fd,
+			chunk->entry.offset);
+	if (data == MAP_FAILED) {
+		return;
+	}
+	volatile char sum = 0;
+	for (long long b = 0; b < bytes; b += CHUNK_PAGE) {
+		sum += data[b];
+	}
+#endif
+	double ms = nowMs() - start;
+	chunk->data = data;
+	mesh->resident += bytes;
+	static std::mutex statLock;
+	std::lock_guard<std::mutex> guard(statLock);
+	mesh->pageIns++;
+	mesh->pageInMs += ms;
+	mesh->pageInMaxMs = std::max(mesh->pageInMaxMs, ms);
+}
+
+void evictChunk(STREAMEDMESH* mesh, STREAMCHUNK* chunk) {
+	long long bytes = chunkBytes(chunk);
+#ifdef _WIN32
+	free(chunk->data);
+#else
+	munmap(chunk->data, bytes);
+#endif
+	chunk->data = 0;
+	mesh->resident -= bytes;
+	mesh->evictions++;
+}
+
+bool compareChunkAge(const STREAMCHUNK* a, const STREAMCHUNK* b) {
+	return a->lastVisible < b->lastVisible;
+}
+
+/*
+ * Called before the frame jobs: decides visibility, evicts the least
+ * recently visible chunks to make room and queues the page-ins.
+ */
+void updateStreamedMesh() {
+	STREAMEDMESH* mesh = _streamed_mesh;
+	if (!mesh) {
+		return;
+	}
+	mesh->frame++;
+	float mvp[16];
+	matMultiply(_frame_mvp, _nodes[mesh->node].world, mvp);
+	std::vector<STREAMCHUNK*> wanted;
+	std::vector<STREAMCHUNK*> resident;
+	mesh->visibleChunks = 0;
+	for (unsigned int i = 0; i < mesh->header.chunkCount; i++) {
+		STREAMCHUNK* chunk = &mesh->chunks[i];
+		chunk->visible = boxInFrustum(mvp, chunk->entry.bmin, chunk->entry.bmax);
+		if (chunk->visible) {
+			chunk->lastVisible = mesh->frame;
+			mesh->visibleChunks++;
+			if (!chunk->data) {
+				wanted.push_back(chunk);
+			}
+		}
+		if (chunk->data) {
+			resident.push_back(chunk);
+		}
+	}
+	std::sort(resident.begin(), resident.end(), compareChunkAge);
+	size_t next = 0;
+	long long incoming = 0;
+	_stream_requests.clear();
+	for (size_t i = 0; i < wanted.size()
+			&& _stream_requests.size() < CHUNK_PAGE_INS_PER_FRAME; i++) {
+		long long bytes = chunkBytes(wanted[i]);
+		while (mesh->resident + incoming + bytes > mesh->budget
+				&& next < resident.size()
+				&& resident[next]->lastVisible < mesh->frame) {
+			evictChunk(mesh, resident[next++]);
+		}
+		if (mesh->resident + incoming + bytes > mesh->budget) {
+			break;
+		}
+		incoming += bytes;
+		_stream_requests.push_back(wanted[i] - mesh->chunks);
+	}
+	for (size_t i = 0; i < _stream_requests.size(); i++) {
+		addJob("page in chunk", jobPageInChunk, i);
+	}
+}
+
+void drawStreamedMesh() {
+	STREAMEDMESH* mesh = _streamed_mesh;
+	if (!mesh) {
+		return;
+	}
+	MATERIAL material;
+	GLfloat emission[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat ambient[4] = { 0.3, 0.3, 0.3, 1.0 };
+	GLfloat diffuse[4] = { 0.6, 0.6, 0.6, 1.0 };
+	GLfloat specular[4] = { 0.2, 0.2, 0.2, 1.0 };
+	setMaterial(&material, emission, ambient, diffuse, specular, 10.0);
+	applyMaterial(&material);
+	glPushMatrix();
+	glMultMatrixf(_nodes[mesh->node].world);
+	glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+	mesh->drawnChunks = 0;
+	for (unsigned int i = 0; i < mesh->header.chunkCount; i++) {
+		STREAMCHUNK* chunk = &mesh->chunks[i];
+		if (!chunk->visible || !chunk->data) {
+			continue;
+		}
+		glInterleavedArrays(GL_N3F_V3F, 0, chunk->data);
+		glDrawArrays(GL_TRIANGLES, 0, chunk->entry.count * 3);
+		mesh->drawnChunks++;
+	}
+	glPopClientAttrib();
+	glPopMatrix();
+}
+
+void printStreamStats() {
+	STREAMEDMESH* mesh = _streamed_mesh;
+	if (!mesh) {
+		return;
+	}
+	printf("    streamed: %.1f of %.0f MB resident, %d visible / %d drawn / "
+			"%u chunks, %d page-ins (%.2f ms avg, %.2f ms max), %d evictions\n",
+			mesh->resident / 1048576.0, mesh->budget / 1048576.0,
+			mesh->visibleChunks, mesh->drawnChunks, mesh->header.chunkCount,
+			mesh->pageIns, mesh->pageIns ? mesh->pageInMs / mesh->pageIns : 0.0,
+			mesh->pageInMaxMs, mesh->evictions);
+	mesh->pageIns = 0;
+	mesh->evictions = 0;
+	mesh->pageInMs = 0.0;
+	mesh->pageInMaxMs = 0.0;
+}
+
+void drawCommand(const DRAWCOMMAND* command) {
+	SCENEOBJECT* object = &_objects[command->object];
+	glPushMatrix();
+	applyMaterial(&command->material);
+	glMultMatrixf(command->model);
+	MESHSTREAMS* streams = object->off ? object->off->streams
+			: object->raw->streams;
+	if (_draw_points) {
+		drawPointStreams(streams, command);
+	} else if (_draw_wireframe) {
+		drawWireframeStreams(streams, _view->shadingModel == FLAT_SHADING);
+	} else {
+		drawMeshStreams(streams, _view->shadingModel == FLAT_SHADING);
+	}
+	glPopMatrix();
+}
+
+/*
+ * Occlusion culling
+ *
+ * After the frame is drawn, every visible object that is not an occluder
+ * gets a GL_SAMPLES_PASSED query for its bounding box, with color and depth
+ * writes off. The result is read back on a later frame, only once it is
+ * available, so the CPU never waits on the GPU; an object whose box passed
+ * no samples is skipped by drawAll() until a query sees it again. The price
+ * is that an object coming out from behind a wall can show up one frame
+ * late.
+ */
+GLuint _occlusion_queries[MAX_OBJECTS];
+bool _query_pending[MAX_OBJECTS];
+bool _occluded[MAX_OBJECTS];
+int _occluded_count = 0;
+bool _occlusion_ready = false;
+
+void initOcclusionQueries() {
+	glGenQueries(MAX_OBJECTS, _occlusion_queries);
+	for (int i = 0; i < MAX_OBJECTS; i++) {
+		_query_pending[i] = false;
+		_occluded[i] = false;
+	}
+	_occlusion_ready = true;
+}
+
+/* collects finished queries, called before the frame is drawn */
+void updateOcclusion() {
+	_occluded_count = 0;
+	if (!_occlusion_ready) {
+		initOcclusionQueries();
+	}
+	for (int i = 0; i < _object_count; i++) {
+		if (_query_pending[i]) {
+			GLint available = 0;
+			glGetQueryObjectiv(_occlusion_queries[i],
+					GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available) {
+				GLuint samples = 0;
+				glGetQueryObjectuiv(_occlusion_queries[i], GL_QUERY_RESULT,
+						&samples);
+				_occluded[i] = samples == 0;
+				_query_pending[i] = false;
+			}
+		}
+		if (!_view->occlusionCulling || !_commands[i].visible) {
+			_occluded[i] = false;
+		}
+		if (_occluded[i]) {
+			_occluded_count++;
+		}
+	}
+}
+
+/* a box cut by the near plane would be clipped away, so it is never hidden */
+bool boxCrossesNearPlane(const float* mvp, const float* bmin,
+		const float* bmax) {
+	for (int corner = 0; corner < 8; corner++) {
+		float clip[4];
+		matTransformPoint(mvp, (corner & 1) ? bmax[0] : bmin[0],
+				(corner & 2) ? bmax[1] : bmin[1],
+				(corner & 4) ? bmax[2] : bmin[2], clip);
+		if (clip[3] <= NEAR_PLANE) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void issueOcclusionQueries() {
+	if (!_view->occlusionCulling) {
+		return;
+	}
+	pushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT
+			| GL_POLYGON_BIT);
+	glDisable(GL_LIGHTING);
+	glDisable(GL_CULL_FACE);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthMask(GL_FALSE);
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	for (int i = 0; i < _draw_count; i++) {
+		const DRAWCOMMAND* command = &_commands[_draw_order[i]];
+		const SCENEOBJECT* object = &_objects[command->object];
+		int index = command->object;
+		if (object->occluder || _query_pending[index]) {
+			continue;
+		}
+		if (boxCrossesNearPlane(command->mvp, object->bmin, object->bmax)) {
+			_occluded[index] = false;
+			continue;
+		}
+		glPushMatrix();
+		glMultMatrixf(command->model);
+		glBeginQuery(GL_SAMPLES_PASSED, _occlusion_queries[index]);
+		drawBox(object->bmin, object->bmax);
+		glEndQuery(GL_SAMPLES_PASSED);
+		glPopMatrix();
+		_query_pending[index] = true;
+	}
+	popAttrib();
+}
+
+/* position and spot direction in the space of node, see toEyeLight() */
+void placeLight(GLenum light, const float* position, const float* direction,
+		int node) {
+	float m[16];
+	if (node >= 0) {
+		matMultiply(_frame_view, _nodes[node].world, m);
+	} else {
+		memcpy(m, _frame_view, 16 * sizeof(float));
+	}
+	float eye[4];
+	matTransformPoint(m, position[0], position[1], position[2], eye);
+	setLightParameter(light, GL_POSITION, eye);
+	if (direction) {
+		matTransformVector(m, direction[0], direction[1], direction[2], eye);
+		setLightParameter(light, GL_SPOT_DIRECTION, eye);
+	}
+}
+
+void setUpSpotlight() {
+	setCapability(GL_LIGHT2, true);
+	GLfloat pos[4] = { -1.2, -5.8, 0.2, 1.0 };
+	GLfloat direction[3] = { -2.0, 1.0, -0.1 };
+	placeLight(GL_LIGHT2, pos, direction, NODE_ROOM);
+	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat diffuse[4] = { 1.0, 1.0, 1.0, 1.0 };
+	GLfloat specular[4] = { 1.0, 1.0, 1.0, 1.0 };
+	setLightParameter(GL_LIGHT2, GL_AMBIENT, ambient);
+	setLightParameter(GL_LIGHT2, GL_DIFFUSE, diffuse);
+	setLightParameter(GL_LIGHT2, GL_SPECULAR, specular);
+	GLfloat cutoff = 40.0;
+	GLfloat exponent = 0.0;
+	setLightParameter(GL_LIGHT2, GL_SPOT_CUTOFF, &cutoff);
+	setLightParameter(GL_LIGHT2, GL_SPOT_EXPONENT, &exponent);
+}
+
+void setUpPointlight() {
+	setCapability(GL_LIGHT3, true);
+	GLfloat pos[4] = { 2.1, -6.2, 0.2, 1.0 };
+	placeLight(GL_LIGHT3, pos, 0, NODE_ROOM);
+	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat diffuse[4] = { 1.0, 1.0, 1.0, 1.0 };
+	GLfloat specular[4] = { 1.0, 1.0, 1.0, 1.0 };
+	setLightParameter(GL_LIGHT3, GL_AMBIENT, ambient);
+	setLightParameter(GL_LIGHT3, GL_DIFFUSE, diffuse);
+	setLightParameter(GL_LIGHT3, GL_SPECULAR, specular);
+}
+
+/* the lamps in the room, set before the geometry they light */
+void setUpRoomLights() {
+	if (_view->spotLight == SPOT_LIGHT_ON) {
+		setUpSpotlight();
+	} else {
+		setCapability(GL_LIGHT2, false);
+	}
+	if (_view->pointLight == POINT_LIGHT_ON) {
+		setUpPointlight();
+	} else {
+		setCapability(GL_LIGHT3, false);
+	}
+}
+
+void drawAll(bool withColor) {
+	for (int i = 0; i < _draw_count; i++) {
+		const DRAWCOMMAND* command = &_commands[_draw_order[i]];
+		if (!_occluded[_draw_order[i]]
+				&& !(withColor && command->transparent)) {
+			applyLightMask(command->lights);
+			drawCommand(command);
+		}
+	}
+	applyLightMask(_frame_all_lights);
+	drawStreamedMesh();
+	if (withColor) {
+		drawPickedTriangle();
+	}
+}
+
+void drawSortedStreams(MESHSTREAMS* streams, TRIANGLESORT* sort, bool flat) {
+	if (!streams->uploaded) {
+		uploadMeshStreams(streams);
+	}
+	if (!sort->buffer) {
+		glGenBuffers(1, &sort->buffer);
+	}
+	glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+	glBindBuffer(GL_ARRAY_BUFFER,
+			flat ? streams->flatBuffer : streams->smoothBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sort->buffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+			sort->indices.size() * sizeof(unsigned int), &sort->indices[0],
+			GL_STREAM_DRAW);
+	glInterleavedArrays(GL_N3F_V3F, 0, 0);
+	glDrawElements(GL_TRIANGLES, sort->indices.size(), GL_UNSIGNED_INT, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glPopClientAttrib();
+}
+
+/* after everything opaque, including the light markers */
+void drawTransparent() {
+	if (_transparent_count == 0) {
+		return;
+	}
+	bool program = usesLightingProgram();
+	if (program) {
+		glUseProgram(_lighting_program);
+	}
+	pushAttrib(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_POLYGON_BIT);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glDepthMask(GL_FALSE);
+	if (_view->polygonMode == POLYGON_MODE_POINT) {
+		setPolygonMode(GL_POINT);
+	} else if (_view->polygonMode == POLYGON_MODE_LINE) {
+		setPolygonMode(GL_LINE);
+	} else {
+		setPolygonMode(GL_FILL);
+	}
+	bool flat = _view->shadingModel == FLAT_SHADING;
+	for (int i = 0; i < _transparent_count; i++) {
+		int index = _transparent_order[i];
+		const DRAWCOMMAND* command = &_commands[index];
+		MESHSTREAMS* streams = getObjectStreams(&_objects[index]);
+		if (_occluded[index]) {
+			continue;
+		}
+		applyLightMask(command->lights);
+		if (!streams || _triangle_sorts[index].indices.empty()) {
+			drawCommand(command);
+			continue;
+		}
+		glPushMatrix();
+		applyMaterial(&command->material);
+		glMultMatrixf(command->model);
+		drawSortedStreams(streams, &_triangle_sorts[index], flat);
+		glPopMatrix();
+	}
+	applyLightMask(_frame_all_lights);
+	popAttrib();
+	if (program) {
+		glUseProgram(0);
+	}
+}
+
+void printTransparencyStats(int frames) {
+	long long triangles = 0;
+	int sorts[3] = { 0, 0, 0 };
+	double ms = 0.0;
+	for (int i = 0; i < _object_count; i++) {
+		TRIANGLESORT* sort = &_triangle_sorts[i];
+		triangles += sort->triangles;
+		ms += sort->ms;
+		for (int k = 0; k < 3; k++) {
+			sorts[k] += sort->sorts[k];
+			sort->sorts[k] = 0;
+		}
+		sort->triangles = 0;
+		sort->ms = 0.0;
+	}
+	if (sorts[SORT_REUSED] + sorts[SORT_INCREMENTAL] + sorts[SORT_RADIX]
+			== 0) {
+		return;
+	}
+	printf("    transparency: %.0f triangles, %.3f ms sorting per frame, "
+			"%d reused, %d incremental, %d radix\n",
+			(double) triangles / frames, ms / frames, sorts[SORT_REUSED],
+			sorts[SORT_INCREMENTAL], sorts[SORT_RADIX]);
+}
+
+void drawAllWithMode() {
+	if (_view->polygonMode == POLYGON_MODE_FILL) {
+		setPolygonMode(GL_FILL);
+		drawAll(true);
+	} else if (_view->polygonMode == POLYGON_MODE_POINT) {
+		setPolygonMode(GL_POINT);
 		glPointSize(2.0);
-		drawAll(true, true);
-	} else if (_polygon_render_mode == POLYGON_MODE_LINE) {
-		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-		drawAll(true, true);
+		beginPoints();
+		drawAll(true);
+		endPoints();
+	} else if (_view->polygonMode == POLYGON_MODE_LINE) {
+		setPolygonMode(GL_LINE);
+		drawAll(true);
+	} else if (wireframeWay() == 0) {
+		setPolygonMode(GL_FILL);
+		_draw_wireframe = true;
+		drawAll(true);
+		_draw_wireframe = false;
+	} else {
+		setPolygonMode(GL_FILL);
+		drawAll(true);
+		setPolygonMode(GL_LINE);
+		glColor3f(1.0, 1.0, 1.0);
+		drawAll(false);
+	}
+}
+
+void setUpDisplay() {
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glLoadIdentity();
+	gluLookAt(0.0f, 0.0f, 60.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f);
+}
+
+void cleanUpDisplay() {
+	glFlush();
+	glutSwapBuffers();
+}
+
+/*
+ * Primitive cache
+ *
+ * Unit spheres, cones and boxes are built once per tessellation level into
+ * vertex and index buffers (GL_N3F_V3F, unsigned short indices) instead of
+ * being regenerated by glutSolidSphere() every frame. The level is picked
+ * from the primitive's projected radius in pixels; level 1 has the 10 x 10
+ * tessellation the markers always had. The box has a single level and is
+ * what the occlusion queries draw.
+ */
+#define PRIMITIVE_SPHERE 0
+#define PRIMITIVE_CONE 1
+#define PRIMITIVE_BOX 2
+#define PRIMITIVE_SHAPES 3
+#define PRIMITIVE_LEVELS 4
+
+static const int PRIMITIVE_SLICES[PRIMITIVE_LEVELS] = { 6, 10, 16, 32 };
+static const float PRIMITIVE_PIXELS[PRIMITIVE_LEVELS] = { 0.0f, 8.0f, 32.0f,
+		128.0f };
+
+typedef struct {
+	GLuint vertices;
+	GLuint indices;
+	int count;
+} PRIMITIVE;
+
+PRIMITIVE _primitives[PRIMITIVE_SHAPES][PRIMITIVE_LEVELS];
+bool _primitives_ready = false;
+
+void addPrimitiveVertex(std::vector<float>& data, float nx, float ny,
+		float nz, float x, float y, float z) {
+	data.push_back(nx);
+	data.push_back(ny);
+	data.push_back(nz);
+	data.push_back(x);
+	data.push_back(y);
+	data.push_back(z);
+}
+
+/* radius 1 around the origin, poles on z like glutSolidSphere() */
+void buildSphere(int slices, int stacks, std::vector<float>& data,
+		std::vector<unsigned short>& indices) {
+	for (int i = 0; i <= stacks; i++) {
+		float phi = PI * i / stacks;
+		for (int j = 0; j <= slices; j++) {
+			float theta = 2.0f * PI * j / slices;
+			float x = sin(phi) * cos(theta);
+			float y = sin(phi) * sin(theta);
+			float z = cos(phi);
+			addPrimitiveVertex(data, x, y, z, x, y, z);
+		}
+	}
+	for (int i = 0; i < stacks; i++) {
+		for (int j = 0; j < slices; j++) {
+			unsigned short a = i * (slices + 1) + j;
+			unsigned short b = a + slices + 1;
+			unsigned short quad[6] = { a, b, (unsigned short) (a + 1), b,
+					(unsigned short) (b + 1), (unsigned short) (a + 1) };
+			indices.insert(indices.end(), quad, quad + 6);
+		}
+	}
+}
+
+/* apex at the origin, opening along +z to a base of radius 1 at z = 1 */
+void buildCone(int slices, std::vector<float>& data,
+		std::vector<unsigned short>& indices) {
+	float n = sqrt(0.5f);
+	for (int j = 0; j <= slices; j++) {
+		float theta = 2.0f * PI * j / slices;
+		float c = cos(theta);
+		float s = sin(theta);
+		addPrimitiveVertex(data, c * n, s * n, -n, 0.0f, 0.0f, 0.0f);
+		addPrimitiveVertex(data, c * n, s * n, -n, c, s, 1.0f);
+		addPrimitiveVertex(data, 0.0f, 0.0f, 1.0f, c, s, 1.0f);
+	}
+	unsigned short center = data.size() / 6;
+	addPrimitiveVertex(data, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f);
+	for (int j = 0; j < slices; j++) {
+		unsigned short a = 3 * j;
+		unsigned short next = 3 * (j + 1);
+		unsigned short side[6] = { a, (unsigned short) (next + 1),
+				(unsigned short) (a + 1), center, (unsigned short) (a + 2),
+				(unsigned short) (next + 2) };
+		indices.insert(indices.end(), side, side + 6);
+	}
+}
+
+/* [-1, 1] on every axis */
+void buildBox(std::vector<float>& data, std::vector<unsigned short>& indices) {
+	for (int axis = 0; axis < 3; axis++) {
+		for (int sign = -1; sign <= 1; sign += 2) {
+			unsigned short base = data.size() / 6;
+			int u = (axis + 1) % 3;
+			int v = (axis + 2) % 3;
+			for (int corner = 0; corner < 4; corner++) {
+				float p[3];
+				float n[3] = { 0.0f, 0.0f, 0.0f };
+				p[axis] = sign;
+				n[axis] = sign;
+				p[u] = (corner == 1 || corner == 2) ? 1.0f : -1.0f;
+				p[v] = (corner >= 2) ? 1.0f : -1.0f;
+				addPrimitiveVertex(data, n[0], n[1], n[2], p[0], p[1], p[2]);
+			}
+			unsigned short quad[6] = { base, (unsigned short) (base + 1),
+					(unsigned short) (base + 2), base,
+					(unsigned short) (base + 2), (unsigned short) (base + 3) };
+			if (sign < 0) {
+				std::swap(quad[1], quad[2]);
+				std::swap(quad[4], quad[5]);
+			}
+			indices.insert(indices.end(), quad, quad + 6);
+		}
+	}
+}
+
+void initPrimitives() {
+	for (int shape = 0; shape < PRIMITIVE_SHAPES; shape++) {
+		for (int level = 0; level < PRIMITIVE_LEVELS; level++) {
+			if (shape == PRIMITIVE_BOX && level > 0) {
+				_primitives[shape][level] = _primitives[shape][0];
+				continue;
+			}
+			std::vector<float> data;
+			std::vector<unsigned short> indices;
+			int slices = PRIMITIVE_SLICES[level];
+			if (shape == PRIMITIVE_SPHERE) {
+				buildSphere(slices, slices, data, indices);
+			} else if (shape == PRIMITIVE_CONE) {
+				buildCone(slices, data, indices);
+			} else {
+				buildBox(data, indices);
+			}
+			PRIMITIVE* primitive = &_primitives[shape][level];
+			glGenBuffers(1, &primitive->vertices);
+			glBindBuffer(GL_ARRAY_BUFFER, primitive->vertices);
+			glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(float),
+					&data[0], GL_STATIC_DRAW);
+			glGenBuffers(1, &primitive->indices);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, primitive->indices);
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+					indices.size() * sizeof(unsigned short), &indices[0],
+					GL_STATIC_DRAW);
+			primitive->count = indices.size();
+		}
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	_primitives_ready = true;
+}
+
+/* projected radius in pixels of a sphere at the origin of modelView */
+int primitiveLevel(const float* modelView, float radius) {
+	float depth = -modelView[14];
+	if (depth <= NEAR_PLANE) {
+		return PRIMITIVE_LEVELS - 1;
+	}
+	float scale = sqrt(modelView[0] * modelView[0]
+			+ modelView[1] * modelView[1] + modelView[2] * modelView[2]);
+	float pixels = radius * scale * _frame_projection[5] * _render_height
+			/ 2.0f / depth;
+	int level = 0;
+	while (level + 1 < PRIMITIVE_LEVELS
+			&& pixels >= PRIMITIVE_PIXELS[level + 1]) {
+		level++;
+	}
+	return level;
+}
+
+void drawPrimitive(int shape, int level) {
+	if (!_primitives_ready) {
+		initPrimitives();
+	}
+	const PRIMITIVE* primitive = &_primitives[shape][level];
+	glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+	glBindBuffer(GL_ARRAY_BUFFER, primitive->vertices);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, primitive->indices);
+	glInterleavedArrays(GL_N3F_V3F, 0, 0);
+	glDrawElements(GL_TRIANGLES, primitive->count, GL_UNSIGNED_SHORT, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glPopClientAttrib();
+}
+
+void drawSphere(const float* modelView, float radius) {
+	int level = primitiveLevel(modelView, radius);
+	glPushMatrix();
+	glLoadMatrixf(modelView);
+	glScalef(radius, radius, radius);
+	drawPrimitive(PRIMITIVE_SPHERE, level);
+	glPopMatrix();
+}
+
+/* the unit box scaled onto bmin..bmax in the current modelview */
+void drawBox(const float* bmin, const float* bmax) {
+	glPushMatrix();
+	glTranslatef((bmin[0] + bmax[0]) * 0.5f, (bmin[1] + bmax[1]) * 0.5f,
+			(bmin[2] + bmax[2]) * 0.5f);
+	glScalef((bmax[0] - bmin[0]) * 0.5f, (bmax[1] - bmin[1]) * 0.5f,
+			(bmax[2] - bmin[2]) * 0.5f);
+	drawPrimitive(PRIMITIVE_BOX, 0);
+	glPopMatrix();
+}
+
+/* the cone a spot light lights, out to length, from the origin of modelView */
+void drawSpotCone(const float* modelView, const float* direction,
+		float cutoff, float length) {
+	float d[3] = { direction[0], direction[1], direction[2] };
+	float len = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+	for (int k = 0; k < 3; k++) {
+		d[k] /= len;
+	}
+	/* rotate +z onto the direction */
+	float angle = acos(std::max(-1.0f, std::min(1.0f, d[2]))) * 180.0f / PI;
+	float radius = length * tan(std::min(cutoff, 85.0f) * PI / 180.0f);
+	int level = primitiveLevel(modelView, std::max(radius, length));
+	glPushMatrix();
+	glLoadMatrixf(modelView);
+	if (fabs(d[0]) + fabs(d[1]) > 1e-6f) {
+		glRotatef(angle, -d[1], d[0], 0.0f);
+	} else if (d[2] < 0.0f) {
+		glRotatef(180.0f, 1.0f, 0.0f, 0.0f);
+	}
+	glScalef(radius, radius, length);
+	drawPrimitive(PRIMITIVE_CONE, level);
+	glPopMatrix();
+}
+
+void drawSpotCones() {
+	if (!_view->spotCones) {
+		return;
+	}
+	pushAttrib(GL_POLYGON_BIT | GL_LIGHTING_BIT);
+	glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	glDisable(GL_LIGHTING);
+	glColor3f(1.0, 1.0, 0.6);
+	float down[3] = { 0.0, -1.0, 0.0 };
+	float m[16];
+	memcpy(m, _frame_view, 16 * sizeof(float));
+	matTranslate(m, _view->light1[0], _view->light1[1], _view->light1[2]);
+	drawSpotCone(m, down, 80.0f, 10.0f);
+	if (_view->spotLight == SPOT_LIGHT_ON) {
+		float direction[3] = { -2.0, 1.0, -0.1 };
+		matMultiply(_frame_view, _nodes[NODE_ROOM].world, m);
+		matTranslate(m, -1.2f, -5.8f, 0.2f);
+		drawSpotCone(m, direction, 40.0f, 4.0f);
+	}
+	popAttrib();
+}
+
+/* --bench-primitives N: N markers each way, after a warm-up */
+void benchPrimitives(int count) {
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glLoadIdentity();
+	glTranslatef(0.0f, 0.0f, -60.0f);
+	initPrimitives();
+	for (int method = 0; method < 2; method++) {
+		for (int pass = 0; pass < 2; pass++) {
+			glFinish();
+			double start = nowMs();
+			for (int i = 0; i < count; i++) {
+				if (method == 0) {
+					glutSolidSphere(1, 10, 10);
+				} else {
+					drawPrimitive(PRIMITIVE_SPHERE, 1);
+				}
+			}
+			glFinish();
+			double ms = nowMs() - start;
+			if (pass == 1) {
+				printf("%-24s %d spheres %9.3f ms %8.3f us each\n",
+						method == 0 ?
+								"glutSolidSphere(1,10,10)" :
+								"cached sphere level 1", count, ms,
+						ms * 1000.0 / count);
+			}
+		}
+	}
+}
+
+void drawLightSource1() {
+	GLfloat emission[4] = { 1.0, 1.0, 1.0, 1.0 };
+	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat diffuse[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat shininess[4] = { 0.0, 0.0, 0.0, 1.0 };
+	if (_view->upperLightColor == UPPER_LIGHT_ORANGE) {
+		emission[0] = 1.0;
+		emission[1] = 0.5;
+		emission[2] = 0.0;
+	}
+	MATERIAL material;
+	setMaterial(&material, emission, ambient, diffuse, shininess, 25.0);
+	applyMaterial(&material);
+	float m[16];
+	memcpy(m, _frame_view, 16 * sizeof(float));
+	matTranslate(m, _view->light1[0], _view->light1[1], _view->light1[2]);
+	drawSphere(m, 1.0);
+}
+
+void drawLightSource0() {
+	GLfloat emission[4] = { 1.0, 1.0, 1.0, 1.0 };
+	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat diffuse[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat shininess[4] = { 0.0, 0.0, 0.0, 1.0 };
+	if (_view->frontLightColor == FRONT_LIGHT_TURQUOISE) {
+			emission[0] = 0.0;
+			emission[1] = 1.0;
+			emission[2] = 1.0;
+	}
+	MATERIAL material;
+	setMaterial(&material, emission, ambient, diffuse, shininess, 25.0);
+	applyMaterial(&material);
+	float m[16];
+	memcpy(m, _frame_view, 16 * sizeof(float));
+	matTranslate(m, _view->light0[0], _view->light0[1], _view->light0[2]);
+	drawSphere(m, 1.0);
+}
+
+void drawOrigin() {
+	if (_view->origin == ORIGIN_HIDDEN) {
+		return;
+	}
+	GLfloat emission[4] = { 1.0, 0.8, 0.0, 1.0 };
+	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat diffuse[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat shininess[4] = { 0.0, 0.0, 0.0, 1.0 };
+	MATERIAL material;
+	setMaterial(&material, emission, ambient, diffuse, shininess, 0.0);
+	applyMaterial(&material);
+	drawSphere(_frame_view, 0.5);
+}
+
+/* the transformations come from the scene graph, see updateSceneTransform() */
+void drawObjects() {
+	drawAllWithMode();
+}
+
+void setUpLight1() {
+	setCapability(GL_LIGHT1, true);
+	GLfloat direction[3] = { 0.0, -1.0, 0.0 };
+	placeLight(GL_LIGHT1, _view->light1, direction, -1);
+	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat diffuse[4] = { 1.0, 1.0, 1.0, 1.0 };
+	GLfloat specular[4] = { 1.0, 1.0, 1.0, 1.0 };
+	if (_view->upperLightColor == UPPER_LIGHT_ORANGE) {
+		diffuse[0] = specular[0] = 1.0;
+		diffuse[1] = specular[1] = 0.5;
+		diffuse[2] = specular[2] = 0.0;
+	}
+	setLightParameter(GL_LIGHT1, GL_AMBIENT, ambient);
+	setLightParameter(GL_LIGHT1, GL_DIFFUSE, diffuse);
+	setLightParameter(GL_LIGHT1, GL_SPECULAR, specular);
+	GLfloat cutoff = 80.0;
+	GLfloat exponent = 0.0;
+	setLightParameter(GL_LIGHT1, GL_SPOT_CUTOFF, &cutoff);
+	setLightParameter(GL_LIGHT1, GL_SPOT_EXPONENT, &exponent);
+}
+
+void setUpLight0() {
+	setCapability(GL_LIGHT0, true);
+	placeLight(GL_LIGHT0, _view->light0, 0, -1);
+	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat diffuse[4] = { 1.0, 1.0, 1.0, 1.0 };
+	GLfloat specular[4] = { 1.0, 1.0, 1.0, 1.0 };
+	if (_view->frontLightColor == FRONT_LIGHT_TURQUOISE) {
+			diffuse[0] = specular[0] = 0.0;
+			diffuse[1] = specular[1] = 1.0;
+			diffuse[2] = specular[2] = 1.0;
+		}
+	setLightParameter(GL_LIGHT0, GL_AMBIENT, ambient);
+	setLightParameter(GL_LIGHT0, GL_DIFFUSE, diffuse);
+	setLightParameter(GL_LIGHT0, GL_SPECULAR, specular);
+}
+
+void setUpShading() {
+	if (_view->shadingModel == FLAT_SHADING) {
+		setShadeModel(GL_FLAT);
+	} else if (_view->shadingModel == SMOOTH_SHADING) {
+		setShadeModel(GL_SMOOTH);
+	}
+	setCapability(GL_NORMALIZE, true);
+}
+
+/*
+ * Dynamic resolution
+ *
+ * The frame is drawn into the lower left part of an offscreen framebuffer
+ * the size of the window and stretched over the window with a linear blit.
+ * The part that is used follows the frame time, the larger of the CPU time
+ * and the GPU time from a GL_TIME_ELAPSED query read a few frames late, so
+ * it never waits. The time is smoothed, the scale only moves after it has
+ * stayed out of the band [RESOLUTION_LOW, RESOLUTION_HIGH] x budget for
+ * RESOLUTION_FRAMES frames, and it stays within
+ * [RESOLUTION_MIN_SCALE, 1].
+ */
+#define RESOLUTION_QUERIES 4
+#define RESOLUTION_FRAMES 10
+#define RESOLUTION_LOW 0.75f
+#define RESOLUTION_HIGH 1.05f
+#define RESOLUTION_MIN_SCALE 0.4f
+
+float _frame_budget_ms = 16.7f;
+float _resolution_scale = 1.0f;
+float _resolution_frame_ms = 0.0f;
+float _resolution_gpu_ms = 0.0f;
+int _resolution_over = 0;
+int _resolution_under = 0;
+GLuint _resolution_fbo = 0;
+GLuint _resolution_color = 0;
+GLuint _resolution_depth = 0;
+int _resolution_fbo_width = 0;
+int _resolution_fbo_height = 0;
+GLuint _resolution_queries[RESOLUTION_QUERIES];
+int _resolution_query_frame = 0;
+bool _resolution_failed = false;
+
+bool resizeResolutionTarget(int width, int height) {
+	if (!_resolution_fbo) {
+		glGenFramebuffers(1, &_resolution_fbo);
+		glGenRenderbuffers(1, &_resolution_color);
+		glGenRenderbuffers(1, &_resolution_depth);
+		glGenQueries(RESOLUTION_QUERIES, _resolution_queries);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, _resolution_fbo);
+	glBindRenderbuffer(GL_RENDERBUFFER, _resolution_color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, _resolution_depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width,
+			height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			GL_RENDERBUFFER, _resolution_color);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+			GL_RENDERBUFFER, _resolution_depth);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		printf("dynamic resolution is not available\n");
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		_resolution_failed = true;
+		return false;
+	}
+	_resolution_fbo_width = width;
+	_resolution_fbo_height = height;
+	return true;
+}
+
+void updateResolutionScale(double cpuMs) {
+	int slot = _resolution_query_frame % RESOLUTION_QUERIES;
+	GLint available = 0;
+	if (_resolution_query_frame >= RESOLUTION_QUERIES) {
+		glGetQueryObjectiv(_resolution_queries[slot], GL_QUERY_RESULT_AVAILABLE,
+				&available);
+	}
+	if (available) {
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(_resolution_queries[slot], GL_QUERY_RESULT, &ns);
+		_resolution_gpu_ms = ns / 1000000.0f;
+	}
+	float ms = std::max((float) cpuMs, _resolution_gpu_ms);
+	_resolution_frame_ms = _resolution_frame_ms == 0.0f ?
+			ms : 0.9f * _resolution_frame_ms + 0.1f * ms;
+	_resolution_over =
+			_resolution_frame_ms > RESOLUTION_HIGH * _frame_budget_ms ?
+					_resolution_over + 1 : 0;
+	_resolution_under =
+			_resolution_frame_ms < RESOLUTION_LOW * _frame_budget_ms ?
+					_resolution_under + 1 : 0;
+	/* fill rate goes with the area, so aim the area at the budget */
+	float target = _resolution_scale
+			* sqrt(_frame_budget_ms / std::max(_resolution_frame_ms, 0.01f));
+	if (_resolution_over >= RESOLUTION_FRAMES) {
+		_resolution_scale = std::max(RESOLUTION_MIN_SCALE,
+				std::min(target, _resolution_scale * 0.95f));
+		_resolution_over = 0;
+	} else if (_resolution_under >= RESOLUTION_FRAMES) {
+		_resolution_scale = std::min(1.0f,
+				std::min(target, _resolution_scale * 1.05f));
+		_resolution_under = 0;
+	}
+}
+
+void beginDynamicResolution() {
+	_render_width = _current_width;
+	_render_height = _current_height;
+	if (!_view->dynamicResolution || _resolution_failed) {
+		return;
+	}
+	if ((_resolution_fbo_width != _current_width
+			|| _resolution_fbo_height != _current_height)
+			&& !resizeResolutionTarget(_current_width, _current_height)) {
+		return;
+	}
+	_render_width = std::max(1, (int) (_current_width * _resolution_scale));
+	_render_height = std::max(1, (int) (_current_height * _resolution_scale));
+	glBindFramebuffer(GL_FRAMEBUFFER, _resolution_fbo);
+	glViewport(0, 0, _render_width, _render_height);
+	glBeginQuery(GL_TIME_ELAPSED,
+			_resolution_queries[_resolution_query_frame % RESOLUTION_QUERIES]);
+}
+
+void endDynamicResolution(double cpuMs) {
+	if (!_view->dynamicResolution || _resolution_failed) {
+		return;
+	}
+	glEndQuery(GL_TIME_ELAPSED);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, _resolution_fbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBlitFramebuffer(0, 0, _render_width, _render_height, 0, 0,
+			_current_width, _current_height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, _current_width, _current_height);
+	_resolution_query_frame++;
+	updateResolutionScale(cpuMs);
+}
+
+void printResolutionStats() {
+	if (!_view->dynamicResolution || _resolution_failed) {
+		return;
+	}
+	printf("    resolution scale %.2f (%dx%d), %.2f ms frame, %.2f ms gpu, "
+			"%.2f ms budget\n", _resolution_scale, _render_width,
+			_render_height, _resolution_frame_ms, _resolution_gpu_ms,
+			_frame_budget_ms);
+}
+
+/*
+ * Input to photon latency: the first frame that shows a new input event
+ * gets a fence after the buffer swap; once the GPU has passed it, the time
+ * since the GLUT callback saw the event is recorded. Fences are polled
+ * once per frame, so a sample can be up to a frame late.
+ */
+GLsync _latency_fence = 0;
+double _latency_input_time = 0.0;
+double _presented_input_time = 0.0;
+double _stats_latency_ms = 0.0;
+double _stats_latency_max_ms = 0.0;
+int _stats_latency_samples = 0;
+
+void trackInputLatency() {
+	if (_latency_fence) {
+		GLint status = GL_UNSIGNALED;
+		glGetSynciv(_latency_fence, GL_SYNC_STATUS, 1, 0, &status);
+		if (status == GL_SIGNALED) {
+			double ms = nowMs() - _latency_input_time;
+			_stats_latency_ms += ms;
+			_stats_latency_max_ms = std::max(_stats_latency_max_ms, ms);
+			_stats_latency_samples++;
+			glDeleteSync(_latency_fence);
+			_latency_fence = 0;
+		}
+	}
+	if (!_latency_fence && _view->inputTime > _presented_input_time) {
+		_latency_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		_latency_input_time = _view->inputTime;
+	}
+	_presented_input_time = _view->inputTime;
+}
+
+void printLatencyStats() {
+	if (_stats_latency_samples > 0) {
+		printf("    input to photon %.2f ms avg, %.2f ms max, %d samples\n",
+				_stats_latency_ms / _stats_latency_samples,
+				_stats_latency_max_ms, _stats_latency_samples);
+	}
+	if (_input_dropped > 0) {
+		printf("    %d input events dropped\n", _input_dropped.load());
+		_input_dropped = 0;
+	}
+	_stats_latency_ms = 0.0;
+	_stats_latency_max_ms = 0.0;
+	_stats_latency_samples = 0;
+}
+
+int _stats_frames = 0;
+double _stats_start = 0.0;
+double _stats_frame_ms = 0.0;
+int _stats_drawn = 0;
+int _stats_occluded = 0;
+int _stats_light_pairs = 0;
+int _stats_light_pairs_culled = 0;
+
+void printFrameStats(double seconds) {
+	printf("--- %.1f fps, %.2f ms cpu per frame, %.1f of %d objects drawn, "
+			"%.1f occluded\n", _stats_frames / seconds,
+			_stats_frame_ms / _stats_frames,
+			(float) _stats_drawn / _stats_frames, _object_count,
+			(float) _stats_occluded / _stats_frames);
+	printf("    %d workers\n", _worker_count);
+	printf("    %.1f of %.1f object/light pairs culled\n",
+			(float) _stats_light_pairs_culled / _stats_frames,
+			(float) _stats_light_pairs / _stats_frames);
+	std::map<std::string, JOBSTAT>::iterator it;
+	for (it = _job_stats.begin(); it != _job_stats.end(); ++it) {
+		printf("    job %-16s %8.4f ms/frame  %8.4f ms max  %5d runs\n",
+				it->first.c_str(), it->second.ms / _stats_frames,
+				it->second.max_ms, it->second.count);
+	}
+	printStreamStats();
+	printTransparencyStats(_stats_frames);
+	printLightingStats();
+	printWireframeStats();
+	printPointStats();
+	printResolutionStats();
+	printLatencyStats();
+	printf("    gl state: %.1f calls issued, %.1f elided per frame\n",
+			(double) _state_issued / _stats_frames,
+			(double) _state_elided / _stats_frames);
+}
+
+void recordFrameStats(double ms) {
+	_stats_frames++;
+	_stats_frame_ms += ms;
+	recordWireframeFrame(ms);
+	_stats_drawn += _draw_count - _occluded_count;
+	_stats_occluded += _occluded_count;
+	_stats_light_pairs += _light_pairs;
+	_stats_light_pairs_culled += _light_pairs_culled;
+	double now = nowMs();
+	if (_stats_start == 0.0) {
+		_stats_start = now;
+	}
+	if (now - _stats_start < 1000.0) {
+		return;
+	}
+	if (_stats_enabled) {
+		printFrameStats((now - _stats_start) / 1000.0);
+	}
+	_stats_frames = 0;
+	_stats_frame_ms = 0.0;
+	_stats_drawn = 0;
+	_stats_occluded = 0;
+	_stats_light_pairs = 0;
+	_stats_light_pairs_culled = 0;
+	_stats_start = now;
+	_job_stats.clear();
+	_state_issued = 0;
+	_state_elided = 0;
+}
+
+/* everything after the frame jobs, into the bound framebuffer */
+void drawFrame() {
+	setUpDisplay();
+	setUpShading();
+	setUpLight0();
+	setUpLight1();
+	setUpRoomLights();
+	updateOcclusion();
+	beginWireframeTiming();
+	beginClusteredLighting();
+	drawObjects();
+	endClusteredLighting();
+	endWireframeTiming();
+	issueOcclusionQueries();
+	drawOrigin();
+	drawLightSource0();
+	drawLightSource1();
+	drawSpotCones();
+	drawTransparent();
+}
+
+unsigned int _picked_sequence = 0;
+
+void display() {
+	double frameStart = nowMs();
+	if (_replaying) {
+		replayFrame();
+	} else {
+		acquireViewState();
+		recordTraceFrame();
+	}
+	buildFrameJobs();
+	runJobGraph();
+	if (_view->pickSequence != _picked_sequence) {
+		_picked_sequence = _view->pickSequence;
+		pickAtMouse(_view->pickX, _view->pickY, _view->pickReport);
+	}
+	beginDynamicResolution();
+	drawFrame();
+	endDynamicResolution(nowMs() - frameStart);
+	cleanUpDisplay();
+	trackInputLatency();
+	recordReplayFrame(nowMs() - frameStart);
+	recordFrameStats(nowMs() - frameStart);
+}
+
+void myGlutInit(int* argc, char *argv[]) {
+	glutInit(argc, argv);
+	glutInitWindowPosition(50, 50);
+	glutInitWindowSize(WIDTH, HEIGHT);
+	glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
+	_windowID = glutCreateWindow("3D Triangle Mesh Manipulation");
+	myCreateMenu();
+	glutDisplayFunc(display);
+	glutKeyboardFunc(keyboard);
+	glutSpecialFunc(specialKeyboard);
+	glutMouseFunc(mouse);
+	glutMotionFunc(mouseMotion);
+	glutPassiveMotionFunc(mousePassiveMotion);
+	glutReshapeFunc(myResize);
+	glutIdleFunc(idle);
+}
+
+/* read in parallel, one job per mesh, through the asset registry */
+typedef struct {
+	const char* file;
+	RawMesh** raw;
+	SurFaceMesh** off;
+} MESHFILE;
+
+MESHFILE _mesh_files[] = {
+		{ "brother_blender.raw", &_brother_blender_mesh, 0 },
+		{ "blender_monkey.raw", &_blender_monkey_mesh, 0 },
+		{ "room_walls.raw", &_room_walls_mesh, 0 },
+		{ "tables.raw", &_tables_mesh, 0 },
+		{ "lamp_bases.raw", &_lamp_bases_mesh, 0 },
+		{ "lamp_point.raw", &_lamp_point_mesh, 0 },
+		{ "lamp_spotlight.raw", &_lamp_spotlight_mesh, 0 },
+		{ "inputmesh_sample.off", 0, &_surfmesh } };
+#define MESH_FILE_COUNT (int) (sizeof(_mesh_files) / sizeof(MESHFILE))
+ASSET* _mesh_assets[MESH_FILE_COUNT];
+
+void jobReadMesh(int i) {
+	_mesh_assets[i] = acquireAsset(_mesh_files[i].file);
+	if (!_mesh_assets[i]) {
+		return;
+	} else if (_mesh_files[i].raw) {
+		*_mesh_files[i].raw = _mesh_assets[i]->raw;
 	} else {
-		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-		drawAll(true, true);
-		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-		glColor3f(1.0, 1.0, 1.0);
-		drawAll(false, true);
+		*_mesh_files[i].off = _mesh_assets[i]->off;
+	}
+}
+
+void readAll() {
+	for (int i = 0; i < MESH_FILE_COUNT; i++) {
+		addJob("read mesh", jobReadMesh, i);
+	}
+	runJobGraph();
+	/* exiting on a worker would run the atexit handlers there */
+	for (int i = 0; i < MESH_FILE_COUNT; i++) {
+		if (!_mesh_assets[i]) {
+			exit(65);
+		}
+	}
+	atexit(releaseAssets);
+	for (int i = 0; i < MESH_FILE_COUNT; i++) {
+		printMeshReport(_mesh_files[i].file, &_mesh_assets[i]->report);
+		ASSET* asset = _mesh_assets[i];
+		printStreamReport(
+				asset->raw ? asset->raw->streams : asset->off->streams);
+	}
+}
+
+void setUpLighting() {
+	glLightModeli(GL_LIGHT_MODEL_LOCAL_VIEWER, GL_TRUE);
+	glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
+	setCapability(GL_LIGHTING, true);
+}
+
+/*
+ * Mesh analysis
+ *
+ * --analyze loads each mesh through the same stages as acquireAsset()
+ * (parse, cleanup, weld, streams; the .clean cache is not used) and
+ * reports what an asset costs before it ships. It covers the triangles
+ * kept and removed, the welded vertices, the bounds, the edge topology, the
+ * vertex cache efficiency (ACMR, post-transform misses per triangle of a
+ * FIFO cache) and the GPU memory per vertex format. --json writes the same
+ * numbers to a file.
+ */
+#define ANALYSIS_CACHE 16
+
+typedef struct {
+	std::string file;
+	int inputTriangles;
+	MESHREPORT report;
+	int vertices;
+	float bmin[3];
+	float bmax[3];
+	int edges;
+	int boundaryEdges;
+	int nonManifoldEdges;
+	int misorientedEdges;
+	double acmrWelded;
+	double acmrStream;
+	int smoothVertices;
+	double parseMs;
+	double cleanMs;
+	double buildMs;
+	double streamsMs;
+} MESHANALYSIS;
+
+/* ACMR of a FIFO cache: a vertex stays for size misses after its own */
+double simulateVertexCache(const int* indices, int count, int vertices,
+		int size) {
+	if (count < 3) {
+		return 0.0;
+	}
+	std::vector<long long> loaded(vertices, -1);
+	long long misses = 0;
+	for (int i = 0; i < count; i++) {
+		long long* stamp = &loaded[indices[i]];
+		if (*stamp < 0 || misses - *stamp >= size) {
+			*stamp = misses++;
+		}
+	}
+	return (double) misses / (count / 3);
+}
+
+/* every undirected edge should be used by two faces, once each way */
+void analyzeEdges(const std::vector<int>& corners, MESHANALYSIS* analysis) {
+	std::vector<unsigned long long> edges(corners.size());
+	for (size_t f = 0; f < corners.size() / 3; f++) {
+		for (int k = 0; k < 3; k++) {
+			unsigned long long a = corners[3 * f + k];
+			unsigned long long b = corners[3 * f + (k + 1) % 3];
+			edges[3 * f + k] = a < b ?
+					(a << 33 | b << 1) : (b << 33 | a << 1 | 1);
+		}
+	}
+	std::sort(edges.begin(), edges.end());
+	analysis->edges = 0;
+	analysis->boundaryEdges = 0;
+	analysis->nonManifoldEdges = 0;
+	analysis->misorientedEdges = 0;
+	for (size_t i = 0; i < edges.size();) {
+		size_t j = i + 1;
+		while (j < edges.size() && edges[j] >> 1 == edges[i] >> 1) {
+			j++;
+		}
+		analysis->edges++;
+		if (j - i == 1) {
+			analysis->boundaryEdges++;
+		} else if (j - i > 2) {
+			analysis->nonManifoldEdges++;
+		} else if ((edges[i] & 1) == (edges[i + 1] & 1)) {
+			analysis->misorientedEdges++;
+		}
+		i = j;
+	}
+}
+
+bool analyzeMesh(const char* file, int cacheSize, MESHANALYSIS* analysis) {
+	analysis->file = file;
+	memset(&analysis->report, 0, sizeof(MESHREPORT));
+	std::string name = uncompressedName(file);
+	bool indexed = hasExtension(name.c_str(), ".off")
+			|| hasExtension(name.c_str(), ".ply");
+	std::vector<float> floats;
+	std::vector<int> faces;
+	double start = nowMs();
+	if (hasExtension(name.c_str(), ".off")) {
+		if (!parseOFFMesh(file, floats, faces)) {
+			return false;
+		}
+	} else if (hasExtension(name.c_str(), ".ply")) {
+		std::vector<float> normals;
+		if (!parsePLYMesh(file, floats, faces, normals)) {
+			return false;
+		}
+	} else if (hasExtension(name.c_str(), ".stl")) {
+		if (!parseSTLMesh(file, floats)) {
+			return false;
+		}
+	} else if (!parseRawMesh(file, floats)) {
+		return false;
+	}
+	analysis->parseMs = nowMs() - start;
+	analysis->inputTriangles = indexed ? faces.size() / 3 : floats.size() / 9;
+
+	start = nowMs();
+	if (indexed) {
+		cleanIndexedMesh(floats, faces, &analysis->report);
+	} else {
+		cleanTriangleSoup(floats, &analysis->report);
+	}
+	analysis->cleanMs = nowMs() - start;
+
+	start = nowMs();
+	RawMesh* raw = 0;
+	SurFaceMesh* off = 0;
+	int count = indexed ? faces.size() / 3 : floats.size() / 9;
+	if (indexed) {
+		off = buildOFFMesh(floats.empty() ? 0 : &floats[0],
+				floats.size() / 3, faces.empty() ? 0 : &faces[0], count);
+	} else {
+		buildRawMesh(floats.empty() ? 0 : &floats[0], count, &raw);
+	}
+	analysis->buildMs = nowMs() - start;
+
+	start = nowMs();
+	std::vector<float> positions;
+	std::vector<int> corners;
+	if (off) {
+		getOFFMeshCorners(off, positions, corners);
+	} else {
+		getRawMeshCorners(raw, positions, corners);
+	}
+	MESHSTREAMS* streams = buildMeshStreams(positions, corners);
+	analysis->streamsMs = nowMs() - start;
+
+	analysis->vertices = positions.size() / 3;
+	analysis->smoothVertices = streams->smoothVertices;
+	memcpy(analysis->bmin, off ? off->bmin : raw->bmin, 3 * sizeof(float));
+	memcpy(analysis->bmax, off ? off->bmax : raw->bmax, 3 * sizeof(float));
+	analyzeEdges(corners, analysis);
+	analysis->acmrWelded = simulateVertexCache(
+			corners.empty() ? 0 : &corners[0], corners.size(),
+			analysis->vertices, cacheSize);
+	analysis->acmrStream = simulateVertexCache(
+			streams->indices.empty() ? 0 : (int*) &streams->indices[0],
+			streams->indices.size(), streams->smoothVertices, cacheSize);
+	freeMeshStreams(streams);
+	if (off) {
+		freeOFFMesh(off);
+	} else {
+		freeRawMesh(raw);
+	}
+	return true;
+}
+
+/* the layouts drawMeshStreams() and friends upload, and leaner ones */
+#define GPU_FORMATS 7
+
+void getGpuFormatBytes(const MESHANALYSIS* analysis, const char** names,
+		long long* bytes) {
+	long long triangles = analysis->report.triangles;
+	long long smooth = analysis->smoothVertices;
+	long long points = analysis->vertices;
+	int index = smooth <= 65536 ? 2 : 4;
+	names[0] = "flat N3F_V3F";
+	bytes[0] = 3 * triangles * 24;
+	names[1] = "smooth N3F_V3F + u32 index";
+	bytes[1] = smooth * 24 + 3 * triangles * 4;
+	names[2] = "smooth N3F_V3F + u16 index";
+	bytes[2] = index == 2 ? smooth * 24 + 3 * triangles * 2 : -1;
+	names[3] = "smooth V3F + 2_10_10_10 normal";
+	bytes[3] = smooth * 16 + 3 * triangles * index;
+	names[4] = "wireframe N3F_V3F + barycentric";
+	bytes[4] = 3 * triangles * (24 + 12);
+	names[5] = "points N3F_V3F";
+	bytes[5] = points * 24;
+	names[6] = "as uploaded";
+	bytes[6] = bytes[0] + bytes[1] + 3 * triangles * 24 + bytes[5];
+}
+
+void printAnalysis(const MESHANALYSIS* analysis, int cacheSize) {
+	const MESHREPORT* report = &analysis->report;
+	int corners = 3 * report->triangles;
+	printf("%s\n", analysis->file.c_str());
+	printf("  triangles   %d kept of %d: %d degenerate (%d collapsed, "
+			"%d zero area, %d collinear), %d duplicate, %d flipped\n",
+			report->triangles, analysis->inputTriangles,
+			report->collapsed + report->zeroArea + report->collinear,
+			report->collapsed, report->zeroArea, report->collinear,
+			report->duplicates, report->flipped);
+	printf("  vertices    %d welded from %d corners, weld ratio %.2f, "
+			"%d after crease split\n", analysis->vertices, corners,
+			analysis->vertices ? (double) corners / analysis->vertices : 0.0,
+			analysis->smoothVertices);
+	printf("  bounds      %g %g %g to %g %g %g\n", analysis->bmin[0],
+			analysis->bmin[1], analysis->bmin[2], analysis->bmax[0],
+			analysis->bmax[1], analysis->bmax[2]);
+	printf("  topology    %d edges, %d boundary, %d non-manifold, "
+			"%d misoriented: %s, %s\n", analysis->edges,
+			analysis->boundaryEdges, analysis->nonManifoldEdges,
+			analysis->misorientedEdges,
+			analysis->boundaryEdges ? "open" : "closed",
+			analysis->nonManifoldEdges || analysis->misorientedEdges ?
+					"not manifold" : "manifold");
+	printf("  acmr        %.3f welded, %.3f drawn stream (%d entry FIFO)\n",
+			analysis->acmrWelded, analysis->acmrStream, cacheSize);
+	const char* names[GPU_FORMATS];
+	long long bytes[GPU_FORMATS];
+	getGpuFormatBytes(analysis, names, bytes);
+	for (int i = 0; i < GPU_FORMATS; i++) {
+		if (bytes[i] >= 0) {
+			printf("  gpu memory  %-32s %10.1f KB\n", names[i],
+					bytes[i] / 1024.0);
+		}
+	}
+	printf("  load        parse %.2f ms, clean %.2f ms, weld %.2f ms, "
+			"streams %.2f ms\n", analysis->parseMs, analysis->cleanMs,
+			analysis->buildMs, analysis->streamsMs);
+}
+
+void writeJsonString(FILE* out, const char* text) {
+	fputc('"', out);
+	for (; *text; text++) {
+		if (*text == '"' || *text == '\\') {
+			fputc('\\', out);
+		}
+		fputc(*text, out);
+	}
+	fputc('"', out);
+}
+
+void writeAnalysisJson(FILE* out, const MESHANALYSIS* analysis,
+		int cacheSize) {
+	const MESHREPORT* report = &analysis->report;
+	fprintf(out, "  {\n    \"file\": ");
+	writeJsonString(out, analysis->file.c_str());
+	fprintf(out, ",\n    \"triangles\": %d,\n    \"inputTriangles\": %d,\n"
+			"    \"degenerate\": { \"collapsed\": %d, \"zeroArea\": %d, "
+			"\"collinear\": %d },\n    \"duplicates\": %d,\n"
+			"    \"flipped\": %d,\n", report->triangles,
+			analysis->inputTriangles, report->collapsed, report->zeroArea,
+			report->collinear, report->duplicates, report->flipped);
+	fprintf(out, "    \"vertices\": %d,\n    \"weldRatio\": %.4f,\n"
+			"    \"smoothVertices\": %d,\n", analysis->vertices,
+			analysis->vertices ?
+					3.0 * report->triangles / analysis->vertices : 0.0,
+			analysis->smoothVertices);
+	fprintf(out, "    \"bounds\": { \"min\": [%g, %g, %g], "
+			"\"max\": [%g, %g, %g] },\n", analysis->bmin[0],
+			analysis->bmin[1], analysis->bmin[2], analysis->bmax[0],
+			analysis->bmax[1], analysis->bmax[2]);
+	fprintf(out, "    \"edges\": { \"total\": %d, \"boundary\": %d, "
+			"\"nonManifold\": %d, \"misoriented\": %d },\n"
+			"    \"closed\": %s,\n    \"manifold\": %s,\n", analysis->edges,
+			analysis->boundaryEdges, analysis->nonManifoldEdges,
+			analysis->misorientedEdges,
+			analysis->boundaryEdges ? "false" : "true",
+			analysis->nonManifoldEdges || analysis->misorientedEdges ?
+					"false" : "true");
+	fprintf(out, "    \"acmr\": { \"cache\": %d, \"welded\": %.4f, "
+			"\"stream\": %.4f },\n", cacheSize, analysis->acmrWelded,
+			analysis->acmrStream);
+	const char* names[GPU_FORMATS];
+	long long bytes[GPU_FORMATS];
+	getGpuFormatBytes(analysis, names, bytes);
+	fprintf(out, "    \"gpuBytes\": {");
+	for (int i = 0; i < GPU_FORMATS; i++) {
+		fprintf(out, "%s\n      ", i ? "," : "");
+		writeJsonString(out, names[i]);
+		if (bytes[i] >= 0) {
+			fprintf(out, ": %lld", bytes[i]);
+		} else {
+			fprintf(out, ": null");
+		}
+	}
+	fprintf(out, "\n    },\n    \"loadMs\": { \"parse\": %.3f, \"clean\": %.3f, "
+			"\"weld\": %.3f, \"streams\": %.3f }\n  }", analysis->parseMs,
+			analysis->cleanMs, analysis->buildMs, analysis->streamsMs);
+}
+
+/* --analyze [--cache N] [--crease DEG] [--json out.json] mesh... */
+int analyzeMeshes(int count, char** args) {
+	int cacheSize = ANALYSIS_CACHE;
+	const char* json = 0;
+	std::vector<MESHANALYSIS> analyses;
+	for (int i = 0; i < count; i++) {
+		if (strcmp(args[i], "--cache") == 0 && i + 1 < count) {
+			cacheSize = std::max(1, atoi(args[++i]));
+		} else if (strcmp(args[i], "--crease") == 0 && i + 1 < count) {
+			_crease_angle = atof(args[++i]);
+		} else if (strcmp(args[i], "--json") == 0 && i + 1 < count) {
+			json = args[++i];
+		}
+	}
+	int failed = 0;
+	for (int i = 0; i < count; i++) {
+		if (strncmp(args[i], "--", 2) == 0) {
+			i++;
+			continue;
+		}
+		MESHANALYSIS analysis;
+		if (!analyzeMesh(args[i], cacheSize, &analysis)) {
+			printf("%s: cannot be read\n", args[i]);
+			failed++;
+			continue;
+		}
+		printAnalysis(&analysis, cacheSize);
+		analyses.push_back(analysis);
+	}
+	if (json) {
+		FILE* out = fopen(json, "w");
+		if (!out) {
+			perror(json);
+			return 1;
+		}
+		fprintf(out, "[\n");
+		for (size_t i = 0; i < analyses.size(); i++) {
+			writeAnalysisJson(out, &analyses[i], cacheSize);
+			fprintf(out, "%s\n", i + 1 < analyses.size() ? "," : "");
+		}
+		fprintf(out, "]\n");
+		fclose(out);
+	}
+	return failed ? 65 : 0;
+}
+
+/*
+ * Procedural scenes
+ *
+ * --generate-scene writes a stress test: the room tiled COLUMNS x ROWS
+ * times, INSTANCES props scattered over the floors with a random placement
+ * and material, and LIGHTS range-limited lamps, first a copy of the spot
+ * and point lamp in every added tile, the rest points at random. --scene
+ * loads it into the viewer; --bench-scene runs its frame jobs headless and
+ * prints frame time and memory, to plot them against the scene size.
+ *
+ * One item a line, positions in room space; tile 0 0 is the room itself:
+ *   room COLUMN ROW
+ *   instance MESH X Y Z ANGLE SCALE R G B A SHININESS
+ * MESH may be any RAW, OFF, PLY or STL file besides the room's own; it is
+ * loaded through the asset registry the first time it is named.
+ *   light point X Y Z R G B RANGE
+ *   light spot X Y Z R G B RANGE DX DY DZ CUTOFF EXPONENT
+ */
+#define SCENE_TILE_MARGIN 0.5f
+#define SCENE_SPOT_RANGE 8.0f
+#define SCENE_POINT_RANGE 6.0f
+#define SCENE_EXTRA_RANGE 1.5f
+
+const char* SCENE_PROPS[] = { "brother_blender.raw", "blender_monkey.raw",
+		"inputmesh_sample.off" };
+#define SCENE_PROP_COUNT (int) (sizeof(SCENE_PROPS) / sizeof(const char*))
+
+std::deque<std::string> _scene_names;
+int _scene_tiles = 1;
+
+int findMeshFile(const char* file) {
+	for (int i = 0; i < MESH_FILE_COUNT; i++) {
+		if (strcmp(_mesh_files[i].file, file) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* the room's meshes, or another file loaded through the registry once */
+std::map<std::string, ASSET*> _scene_assets;
+
+ASSET* getSceneAsset(const char* mesh) {
+	int file = findMeshFile(mesh);
+	if (file >= 0) {
+		return _mesh_assets[file];
+	}
+	std::map<std::string, ASSET*>::iterator it = _scene_assets.find(mesh);
+	if (it != _scene_assets.end()) {
+		return it->second;
+	}
+	ASSET* asset = acquireAsset(mesh);
+	if (asset) {
+		printMeshReport(mesh, &asset->report);
+		printStreamReport(
+				asset->raw ? asset->raw->streams : asset->off->streams);
+	}
+	_scene_assets[mesh] = asset;
+	return asset;
+}
+
+/* at exit, every handle readAll() and the scenes took */
+void releaseAssets() {
+	for (int i = 0; i < MESH_FILE_COUNT; i++) {
+		if (_mesh_assets[i]) {
+			releaseAsset(_mesh_assets[i]);
+			_mesh_assets[i] = 0;
+		}
+	}
+	std::map<std::string, ASSET*>::iterator it;
+	for (it = _scene_assets.begin(); it != _scene_assets.end(); ++it) {
+		if (it->second) {
+			releaseAsset(it->second);
+		}
+	}
+	_scene_assets.clear();
+}
+
+void getMeshFileBounds(int file, float* bmin, float* bmax) {
+	ASSET* asset = _mesh_assets[file];
+	memcpy(bmin, asset->raw ? asset->raw->bmin : asset->off->bmin,
+			3 * sizeof(float));
+	memcpy(bmax, asset->raw ? asset->raw->bmax : asset->off->bmax,
+			3 * sizeof(float));
+}
+
+/* distance between the origins of neighbouring tiles */
+void getTilePitch(float* pitch) {
+	float bmin[3];
+	float bmax[3];
+	getMeshFileBounds(findMeshFile("room_walls.raw"), bmin, bmax);
+	pitch[0] = bmax[0] - bmin[0] + SCENE_TILE_MARGIN;
+	pitch[1] = bmax[1] - bmin[1] + SCENE_TILE_MARGIN;
+}
+
+float sceneRandom(float lo, float hi) {
+	return lo + (hi - lo) * (rand() / (float) RAND_MAX);
+}
+
+int generateScene(const char* file, int columns, int rows, int instances,
+		int lights, unsigned int seed) {
+	int tiles = columns * rows;
+	if (columns < 1 || rows < 1 || tiles * MESH_FILE_COUNT > MAX_OBJECTS) {
+		fprintf(stderr, "%d x %d rooms do not fit in %d objects\n", columns,
+				rows, MAX_OBJECTS);
+		return 1;
+	}
+	if (instances > MAX_OBJECTS - tiles * MESH_FILE_COUNT) {
+		instances = MAX_OBJECTS - tiles * MESH_FILE_COUNT;
+		printf("%s: only %d instances fit\n", file, instances);
+	}
+	FILE* out = fopen(file, "w");
+	if (!out) {
+		perror(file);
+		return 1;
+	}
+	float lo[3];
+	float hi[3];
+	float pitch[2];
+	getMeshFileBounds(findMeshFile("room_walls.raw"), lo, hi);
+	getTilePitch(pitch);
+	srand(seed);
+	fprintf(out, "# %d x %d rooms, %d instances, %d lights, seed %u\n",
+			columns, rows, instances, lights, seed);
+	int first[2] = { -(columns / 2), -(rows / 2) };
+	for (int row = 0; row < rows; row++) {
+		for (int column = 0; column < columns; column++) {
+			fprintf(out, "room %d %d\n", first[0] + column, first[1] + row);
+		}
+	}
+	for (int i = 0; i < instances; i++) {
+		float dx = (first[0] + rand() % columns) * pitch[0];
+		float dy = (first[1] + rand() % rows) * pitch[1];
+		const char* prop = SCENE_PROPS[rand() % SCENE_PROP_COUNT];
+		float bmin[3];
+		float bmax[3];
+		getMeshFileBounds(findMeshFile(prop), bmin, bmax);
+		float extent = std::max(bmax[0] - bmin[0],
+				std::max(bmax[1] - bmin[1], bmax[2] - bmin[2]));
+		float x = dx + sceneRandom(lo[0] + 1.0f, hi[0] - 1.0f);
+		float y = dy + sceneRandom(lo[1] + 1.0f, hi[1] - 1.0f);
+		float angle = sceneRandom(0.0f, 360.0f);
+		float scale = sceneRandom(0.8f, 1.6f) / extent;
+		float r = sceneRandom(0.0f, 1.0f);
+		float g = sceneRandom(0.0f, 1.0f);
+		float b = sceneRandom(0.0f, 1.0f);
+		float alpha = rand() % 8 == 0 ? 0.4f : 1.0f;
+		fprintf(out, "instance %s %.3f %.3f %.3f %.1f %.5f %.2f %.2f %.2f "
+				"%.1f %.0f\n", prop, x, y, lo[2], angle, scale, r, g, b, alpha,
+				sceneRandom(5.0f, 100.0f));
+	}
+	/* the lamps of setUpSpotlight() and setUpPointlight(), with a range */
+	int written = 0;
+	for (int t = 0; t < tiles && written + 2 <= lights; t++) {
+		int column = first[0] + t % columns;
+		int row = first[1] + t / columns;
+		if (column == 0 && row == 0) {
+			continue;
+		}
+		float dx = column * pitch[0];
+		float dy = row * pitch[1];
+		fprintf(out, "light spot %.3f %.3f 0.2 1 1 1 %.1f -2 1 -0.1 40 0\n",
+				-1.2f + dx, -5.8f + dy, SCENE_SPOT_RANGE);
+		fprintf(out, "light point %.3f %.3f 0.2 1 1 1 %.1f\n", 2.1f + dx,
+				-6.2f + dy, SCENE_POINT_RANGE);
+		written += 2;
+	}
+	for (; written < lights; written++) {
+		float dx = (first[0] + rand() % columns) * pitch[0];
+		float dy = (first[1] + rand() % rows) * pitch[1];
+		fprintf(out, "light point %.3f %.3f %.3f %.2f %.2f %.2f %.1f\n",
+				dx + sceneRandom(lo[0], hi[0]), dy + sceneRandom(lo[1], hi[1]),
+				sceneRandom(lo[2], hi[2]), sceneRandom(0.2f, 1.0f),
+				sceneRandom(0.2f, 1.0f), sceneRandom(0.2f, 1.0f),
+				SCENE_EXTRA_RANGE);
+	}
+	fclose(out);
+	printf("%s: %d x %d rooms, %d instances, %d lights\n", file, columns,
+			rows, instances, lights);
+	return 0;
+}
+
+/* a prop standing on the floor at x y z, with its own material */
+void addSceneInstance(ASSET* asset, const char* mesh, const float* v) {
+	char name[300];
+	snprintf(name, sizeof(name), "%s %d", mesh, _object_count);
+	_scene_names.push_back(name);
+	int object = addSceneObject(_scene_names.back().c_str(), asset->raw,
+			asset->off, 0, NODE_ROOM);
+	SCENEOBJECT* instance = &_objects[object];
+	GLfloat emission[4] = { 0.0, 0.0, 0.0, 1.0 };
+	GLfloat ambient[4] = { 0.3f * v[5], 0.3f * v[6], 0.3f * v[7], 1.0 };
+	GLfloat diffuse[4] = { v[5], v[6], v[7], v[8] };
+	GLfloat specular[4] = { 0.5, 0.5, 0.5, 1.0 };
+	setMaterial(&instance->fixed, emission, ambient, diffuse, specular, v[9]);
+	memcpy(instance->rgb, diffuse, 3 * sizeof(float));
+	float local[16];
+	matIdentity(local);
+	matTranslate(local, v[0], v[1], v[2]);
+	matRotate(local, v[3], 0.0, 0.0, 1.0);
+	matScale(local, v[4], v[4], v[4]);
+	matTranslate(local, -(instance->bmin[0] + instance->bmax[0]) / 2,
+			-(instance->bmin[1] + instance->bmax[1]) / 2, -instance->bmin[2]);
+	setNodeLocal(instance->node, local);
+}
+
+/* after initSceneObjects(); items past MAX_OBJECTS are dropped */
+bool loadScene(const char* file) {
+	FILE* in = fopen(file, "r");
+	if (!in) {
+		perror(file);
+		return false;
+	}
+	float pitch[2];
+	getTilePitch(pitch);
+	char line[512];
+	int number = 0;
+	int dropped = 0;
+	while (fgets(line, sizeof(line), in)) {
+		number++;
+		char mesh[256];
+		int column;
+		int row;
+		float v[12];
+		LIGHT light;
+		if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+			continue;
+		}
+		if (sscanf(line, "room %d %d", &column, &row) == 2) {
+			if (column == 0 && row == 0) {
+				continue;
+			}
+			if (_object_count + MESH_FILE_COUNT > MAX_OBJECTS) {
+				dropped++;
+				continue;
+			}
+			snprintf(mesh, sizeof(mesh), "tile %d %d", column, row);
+			_scene_names.push_back(mesh);
+			int tile = addSceneNode(_scene_names.back().c_str(), NODE_ROOM);
+			float local[16];
+			matIdentity(local);
+			matTranslate(local, column * pitch[0], row * pitch[1], 0.0);
+			setNodeLocal(tile, local);
+			addRoomObjects(tile);
+			_scene_tiles = std::max(_scene_tiles,
+					2 * std::max(abs(column), abs(row)) + 1);
+		} else if (sscanf(line, "instance %255s %f %f %f %f %f %f %f %f %f %f",
+				mesh, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7],
+				&v[8], &v[9]) == 11) {
+			ASSET* prop = getSceneAsset(mesh);
+			if (!prop) {
+				fprintf(stderr, "%s:%d: cannot load %s\n", file, number, mesh);
+			} else if (_object_count >= MAX_OBJECTS) {
+				dropped++;
+			} else {
+				addSceneInstance(prop, mesh, v);
+			}
+		} else if (sscanf(line, "light spot %f %f %f %f %f %f %f %f %f %f %f %f",
+				&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8],
+				&v[9], &v[10], &v[11]) == 12) {
+			setLight(&light, v[0], v[1], v[2], v[3], v[4], v[5], NODE_ROOM);
+			light.range = v[6];
+			memcpy(light.direction, &v[7], 3 * sizeof(float));
+			light.cutoff = v[10];
+			light.exponent = v[11];
+			_extra_lights.push_back(light);
+		} else if (sscanf(line, "light point %f %f %f %f %f %f %f", &v[0],
+				&v[1], &v[2], &v[3], &v[4], &v[5], &v[6]) == 7) {
+			setLight(&light, v[0], v[1], v[2], v[3], v[4], v[5], NODE_ROOM);
+			light.range = v[6];
+			_extra_lights.push_back(light);
+		} else {
+			fprintf(stderr, "%s:%d: cannot read %s", file, number, line);
+		}
+	}
+	fclose(in);
+	updateSceneGraph();
+	if (dropped > 0) {
+		printf("%s: %d items dropped past %d objects\n", file, dropped,
+				MAX_OBJECTS);
+	}
+	printf("%s: %d objects, %d nodes, %d lights\n", file, _object_count,
+			(int) _nodes.size(), (int) _extra_lights.size());
+	return true;
+}
+
+/* --mesh: a prop two units across in the middle of the room's floor */
+bool addMeshInstance(const char* file) {
+	ASSET* asset = getSceneAsset(file);
+	if (!asset || _object_count >= MAX_OBJECTS) {
+		return false;
+	}
+	float lo[3];
+	float hi[3];
+	getMeshFileBounds(findMeshFile("room_walls.raw"), lo, hi);
+	const float* bmin = asset->raw ? asset->raw->bmin : asset->off->bmin;
+	const float* bmax = asset->raw ? asset->raw->bmax : asset->off->bmax;
+	float extent = std::max(bmax[0] - bmin[0],
+			std::max(bmax[1] - bmin[1], bmax[2] - bmin[2]));
+	float v[10] = { (lo[0] + hi[0]) / 2, (lo[1] + hi[1]) / 2, lo[2], 0.0f,
+			extent > 0.0f ? 2.0f / extent : 1.0f, 0.8f, 0.8f, 0.8f, 1.0f,
+			50.0f };
+	addSceneInstance(asset, file, v);
+	updateSceneGraph();
+	return true;
+}
+
+/* the working set on Windows (link with -lpsapi), 0 where it is unknown */
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+
+long long residentBytes() {
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+			sizeof(counters))) {
+		return 0;
+	}
+	return counters.WorkingSetSize;
+}
+#else
+long long residentBytes() {
+	long long pages = 0;
+	FILE* statm = fopen("/proc/self/statm", "r");
+	if (statm) {
+		if (fscanf(statm, "%*d %lld", &pages) != 1) {
+			pages = 0;
+		}
+		fclose(statm);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+#endif
+
+/* frame jobs of a generated scene without a window, turning once around */
+int benchScene(const char* file, int frames, const char* csv) {
+	_headless = true;
+	initJobSystem();
+	readAll();
+	initSceneObjects();
+	if (!loadScene(file)) {
+		return 1;
+	}
+	if (!_extra_lights.empty()) {
+		_lighting_path = LIGHTING_PER_PIXEL;
+	}
+	_radius_diff_scale = 1.0f / _scene_tiles;
+	std::vector<double> times;
+	long long drawn = 0;
+	_job_stats.clear();
+	for (int f = 0; f < frames; f++) {
+		_xdiff_rotate = 360.0f * f / frames;
+		initViewState();
+		double start = nowMs();
+		buildFrameJobs();
+		runJobGraph();
+		times.push_back(nowMs() - start);
+		drawn += _draw_count;
+	}
+	if (times.empty()) {
+		return 1;
+	}
+	std::sort(times.begin(), times.end());
+	double total = 0.0;
+	for (size_t i = 0; i < times.size(); i++) {
+		total += times[i];
+	}
+	long long triangles = 0;
+	for (int i = 0; i < _object_count; i++) {
+		triangles += getTriangleCount(&_objects[i]);
+	}
+	long long meshBytes = 0;
+	for (int i = 0; i < MESH_FILE_COUNT; i++) {
+		meshBytes += assetBytes(_mesh_assets[i]);
+	}
+	double avg = total / frames;
+	double p50 = times[times.size() / 2];
+	double p95 = times[times.size() * 95 / 100];
+	double rss = residentBytes() / 1048576.0;
+	printf("%s: %d objects, %lld triangles, %d lights, %.0f drawn\n", file,
+			_object_count, triangles, (int) _extra_lights.size(),
+			(double) drawn / frames);
+	printf("frame jobs: %.3f ms avg, %.3f ms p50, %.3f ms p95 over %d frames"
+			"\n", avg, p50, p95, frames);
+	printf("memory: %.1f MB meshes, %.1f MB resident\n",
+			meshBytes / 1048576.0, rss);
+	std::map<std::string, JOBSTAT>::iterator it;
+	for (it = _job_stats.begin(); it != _job_stats.end(); ++it) {
+		printf("    job %-16s %8.4f ms/frame  %8.4f ms max\n",
+				it->first.c_str(), it->second.ms / frames, it->second.max_ms);
+	}
+	if (csv) {
+		FILE* out = fopen(csv, "a");
+		if (!out) {
+			perror(csv);
+			return 1;
+		}
+		if (ftell(out) == 0) {
+			fprintf(out, "scene,objects,triangles,lights,drawn,avg_ms,p50_ms,"
+					"p95_ms,mesh_mb,resident_mb\n");
+		}
+		fprintf(out, "%s,%d,%lld,%d,%.1f,%.3f,%.3f,%.3f,%.1f,%.1f\n", file,
+				_object_count, triangles, (int) _extra_lights.size(),
+				(double) drawn / frames, avg, p50, p95, meshBytes / 1048576.0,
+				rss);
+		fclose(out);
+	}
+	return 0;
+}
+
+/*
+ * Render service
+ *
+ * --serve keeps the meshes, the scene and a GL context resident and
+ * renders requests from a Unix domain socket. A request is a RENDERREQUEST:
+ * the transformations, the two light positions, up to RENDER_MENU_ITEMS
+ * right-click menu entries applied over the startup state, and the
+ * resolution. The reply is a RENDERREPLY followed by the RGB rows, bottom
+ * row first. Clients may keep several requests in flight on a connection;
+ * replies come back in the order they are rendered, matched by id.
+ *
+ * A reader thread per connection queues requests. The render thread takes
+ * up to the batch size at once, waiting at most the batch window for more
+ * to arrive. It orders the batch so that neighbours share GL state, draws
+ * each request into an offscreen framebuffer and reads it into its own
+ * pixel buffer without waiting. The buffers are only mapped once the whole
+ * batch is issued, so the wait for the GPU is paid once per batch; each is
+ * copied out and unmapped, and a writer thread per connection sends the
+ * replies, so a slow client never holds up the render thread.
+ * Occlusion culling and dynamic resolution follow the previous frame and
+ * are off. With HAVE_EGL the context is a surfaceless EGL one and no
+ * display is needed; otherwise a hidden GLUT window provides it. The
+ * service needs Unix sockets and is not built on Windows.
+ */
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#define RENDER_MAX_SIZE 4096
+#define RENDER_MAX_BATCH 64
+
+int _serve_max_size = RENDER_MAX_SIZE;
+GLuint _serve_fbo = 0;
+GLuint _serve_color = 0;
+GLuint _serve_depth = 0;
+int _serve_fbo_width = 0;
+int _serve_fbo_height = 0;
+GLuint _serve_pixels[RENDER_MAX_BATCH];
+
+void initHeadlessContext(int* argc, char** argv) {
+#ifdef HAVE_EGL
+	EGLDisplay display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+			EGL_DEFAULT_DISPLAY, 0);
+	EGLContext context = EGL_NO_CONTEXT;
+	if (display != EGL_NO_DISPLAY && eglInitialize(display, 0, 0)
+			&& eglBindAPI(EGL_OPENGL_API)) {
+		context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT,
+				0);
+	}
+	if (context != EGL_NO_CONTEXT
+			&& eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+					context)) {
+		printf("rendering without a window on %s\n",
+				(const char*) glGetString(GL_RENDERER));
+		return;
+	}
+	printf("no surfaceless EGL context, using a hidden window\n");
+#endif
+	myGlutInit(argc, argv);
+	glutHideWindow();
+}
+
+bool resizeServeTarget(int width, int height) {
+	if (!_serve_fbo) {
+		glGenFramebuffers(1, &_serve_fbo);
+		glGenRenderbuffers(1, &_serve_color);
+		glGenRenderbuffers(1, &_serve_depth);
+		glGenBuffers(RENDER_MAX_BATCH, _serve_pixels);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, _serve_fbo);
+	glBindRenderbuffer(GL_RENDERBUFFER, _serve_color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, _serve_depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width,
+			height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			GL_RENDERBUFFER, _serve_color);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+			GL_RENDERBUFFER, _serve_depth);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		printf("cannot render %dx%d offscreen\n", width, height);
+		return false;
+	}
+	_serve_fbo_width = width;
+	_serve_fbo_height = height;
+	return true;
+}
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+
+#define RENDER_MAGIC 0x444e4552
+#define RENDER_MENU_ITEMS 16
+#define RENDER_BATCH 8
+#define RENDER_BATCH_WAIT_MS 2.0
+#define RENDER_IN_FLIGHT 8
+
+typedef struct {
+	int magic;
+	unsigned int id;
+	int width;
+	int height;
+	float rotate[3];
+	float translate[3];
+	float scale;
+	float light0[4];
+	float light1[4];
+	int menu[RENDER_MENU_ITEMS];
+} RENDERREQUEST;
+
+/* width and height are 0 when the request was refused */
+typedef struct {
+	int magic;
+	unsigned int id;
+	int width;
+	int height;
+	float queueMs;
+	float renderMs;
+	int batch;
+} RENDERREPLY;
+
+typedef struct {
+	RENDERREPLY reply;
+	std::vector<unsigned char> pixels;
+} RENDEROUTPUT;
+
+/* replies wait here for the connection's writer thread */
+typedef struct {
+	int fd;
+	int refs;
+	std::deque<RENDEROUTPUT*> replies;
+	std::condition_variable wake;
+} RENDERCLIENT;
+
+typedef struct {
+	RENDERREQUEST request;
+	RENDERCLIENT* client;
+	double queued;
+} RENDERJOB;
+
+std::deque<RENDERJOB> _serve_queue;
+std::mutex _serve_lock;
+std::condition_variable _serve_wake;
+int _serve_batch = RENDER_BATCH;
+double _serve_batch_wait = RENDER_BATCH_WAIT_MS;
+VIEWSTATE _serve_defaults;
+
+double _serve_start = 0.0;
+int _serve_requests = 0;
+int _serve_batches = 0;
+double _serve_pixel_count = 0.0;
+double _serve_render_ms = 0.0;
+std::vector<double> _serve_queue_ms;
+
+bool sendAll(int fd, const void* data, size_t size) {
+	const char* bytes = (const char*) data;
+	while (size > 0) {
+		ssize_t sent = write(fd, bytes, size);
+		if (sent <= 0) {
+			return false;
+		}
+		bytes += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+bool recvAll(int fd, void* data, size_t size) {
+	char* bytes = (char*) data;
+	while (size > 0) {
+		ssize_t got = read(fd, bytes, size);
+		if (got <= 0) {
+			return false;
+		}
+		bytes += got;
+		size -= got;
+	}
+	return true;
+}
+
+/* the reader, the writer and every queued request hold a reference */
+void releaseRenderClient(RENDERCLIENT* client) {
+	bool last;
+	{
+		std::lock_guard<std::mutex> guard(_serve_lock);
+		last = --client->refs == 0;
+		client->wake.notify_one();
+	}
+	if (last) {
+		close(client->fd);
+		delete client;
+	}
+}
+
+void readRenderRequests(RENDERCLIENT* client) {
+	RENDERJOB job;
+	job.client = client;
+	while (recvAll(client->fd, &job.request, sizeof(RENDERREQUEST))
+			&& job.request.magic == RENDER_MAGIC) {
+		job.queued = nowMs();
+		std::lock_guard<std::mutex> guard(_serve_lock);
+		client->refs++;
+		_serve_queue.push_back(job);
+		_serve_wake.notify_one();
+	}
+	releaseRenderClient(client);
+}
+
+/* until only the writer is left and every reply is out */
+void writeRenderReplies(RENDERCLIENT* client) {
+	for (;;) {
+		RENDEROUTPUT* output;
+		{
+			std::unique_lock<std::mutex> lock(_serve_lock);
+			client->wake.wait(lock, [client] {
+				return !client->replies.empty() || client->refs == 1;
+			});
+			if (client->replies.empty()) {
+				break;
+			}
+			output = client->replies.front();
+			client->replies.pop_front();
+		}
+		if (sendAll(client->fd, &output->reply, sizeof(RENDERREPLY))
+				&& !output->pixels.empty()) {
+			sendAll(client->fd, &output->pixels[0], output->pixels.size());
+		}
+		delete output;
+	}
+	releaseRenderClient(client);
+}
+
+void acceptRenderClients(int listener) {
+	for (;;) {
+		int fd = accept(listener, 0, 0);
+		if (fd < 0) {
+			continue;
+		}
+		RENDERCLIENT* client = new RENDERCLIENT;
+		client->fd = fd;
+		client->refs = 2;
+		std::thread(readRenderRequests, client).detach();
+		std::thread(writeRenderReplies, client).detach();
+	}
+}
+
+int openRenderSocket(const char* path, bool listening) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		printf("socket path is too long: %s\n", path);
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (listening) {
+		unlink(path);
+	}
+	int result = listening ?
+			bind(fd, (struct sockaddr*) &address, sizeof(address)) :
+			connect(fd, (struct sockaddr*) &address, sizeof(address));
+	if (result != 0 || (listening && listen(fd, SOMAXCONN) != 0)) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* the startup state, then the request; nothing carries over */
+void applyRenderRequest(const RENDERREQUEST* request) {
+	restoreViewState(&_serve_defaults);
+	_xdiff_rotate = request->rotate[0];
+	_ydiff_rotate = request->rotate[1];
+	_zdiff_rotate = request->rotate[2];
+	_xdiff_translate = request->translate[0];
+	_ydiff_translate = request->translate[1];
+	_zdiff_translate = request->translate[2];
+	_radius_diff_scale = request->scale;
+	memcpy(_light0_pos, request->light0, 4 * sizeof(float));
+	memcpy(_light1_pos, request->light1, 4 * sizeof(float));
+	for (int i = 0; i < RENDER_MENU_ITEMS && request->menu[i] > 0; i++) {
+		handleMenu(request->menu[i]);
+	}
+	_occlusion_culling = false;
+	_dynamic_resolution = false;
+	initViewState();
+}
+
+/* requests with the same menu state and size next to each other */
+bool compareRenderJobs(const RENDERJOB& a, const RENDERJOB& b) {
+	int menu = memcmp(a.request.menu, b.request.menu,
+			sizeof(a.request.menu));
+	if (menu != 0) {
+		return menu < 0;
+	}
+	if (a.request.width != b.request.width) {
+		return a.request.width < b.request.width;
+	}
+	return a.request.height < b.request.height;
+}
+
+/* takes the pixels, if any; a refused request has none */
+void queueRenderReply(const RENDERJOB* job, std::vector<unsigned char>* pixels,
+		double start, int batch) {
+	RENDEROUTPUT* output = new RENDEROUTPUT;
+	RENDERREPLY* reply = &output->reply;
+	reply->magic = RENDER_MAGIC;
+	reply->id = job->request.id;
+	reply->width = pixels ? job->request.width : 0;
+	reply->height = pixels ? job->request.height : 0;
+	reply->queueMs = start - job->queued;
+	reply->renderMs = nowMs() - start;
+	reply->batch = batch;
+	if (pixels) {
+		output->pixels.swap(*pixels);
+	}
+	{
+		std::lock_guard<std::mutex> guard(_serve_lock);
+		job->client->replies.push_back(output);
+		job->client->wake.notify_one();
+	}
+	releaseRenderClient(job->client);
+}
+
+void recordServeStats(const std::vector<RENDERJOB>& batch, double start) {
+	double now = nowMs();
+	if (_serve_start == 0.0) {
+		_serve_start = start;
+	}
+	_serve_batches++;
+	_serve_render_ms += now - start;
+	for (size_t i = 0; i < batch.size(); i++) {
+		_serve_requests++;
+		_serve_pixel_count += (double) batch[i].request.width
+				* batch[i].request.height;
+		_serve_queue_ms.push_back(start - batch[i].queued);
+	}
+	double seconds = (now - _serve_start) / 1000.0;
+	if (seconds < 1.0) {
+		return;
+	}
+	std::sort(_serve_queue_ms.begin(), _serve_queue_ms.end());
+	double queued = 0.0;
+	for (size_t i = 0; i < _serve_queue_ms.size(); i++) {
+		queued += _serve_queue_ms[i];
+	}
+	printf("--- %.1f renders/s, %.1f Mpixel/s, %.1f per batch, %.2f ms "
+			"render per batch\n", _serve_requests / seconds,
+			_serve_pixel_count / seconds / 1000000.0,
+			(double) _serve_requests / _serve_batches,
+			_serve_render_ms / _serve_batches);
+	printf("    queue latency %.2f ms avg, %.2f ms p50, %.2f ms p95, "
+			"%.2f ms max\n", queued / _serve_queue_ms.size(),
+			_serve_queue_ms[_serve_queue_ms.size() / 2],
+			_serve_queue_ms[_serve_queue_ms.size() * 95 / 100],
+			_serve_queue_ms.back());
+	fflush(stdout);
+	_serve_start = 0.0;
+	_serve_requests = 0;
+	_serve_batches = 0;
+	_serve_pixel_count = 0.0;
+	_serve_render_ms = 0.0;
+	_serve_queue_ms.clear();
+}
+
+void renderBatch(std::vector<RENDERJOB>& batch) {
+	double start = nowMs();
+	std::vector<RENDERJOB> drawn;
+	int width = _serve_fbo_width;
+	int height = _serve_fbo_height;
+	for (size_t i = 0; i < batch.size(); i++) {
+		const RENDERREQUEST* request = &batch[i].request;
+		if (request->width < 1 || request->height < 1
+				|| request->width > _serve_max_size
+				|| request->height > _serve_max_size) {
+			queueRenderReply(&batch[i], 0, start, 1);
+			continue;
+		}
+		width = std::max(width, request->width);
+		height = std::max(height, request->height);
+		drawn.push_back(batch[i]);
+	}
+	if (drawn.empty()) {
+		return;
+	}
+	if ((width != _serve_fbo_width || height != _serve_fbo_height)
+			&& !resizeServeTarget(width, height)) {
+		for (size_t i = 0; i < drawn.size(); i++) {
+			queueRenderReply(&drawn[i], 0, start, 1);
+		}
+		return;
 	}
+	std::stable_sort(drawn.begin(), drawn.end(), compareRenderJobs);
+	glBindFramebuffer(GL_FRAMEBUFFER, _serve_fbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	for (size_t i = 0; i < drawn.size(); i++) {
+		const RENDERREQUEST* request = &drawn[i].request;
+		applyRenderRequest(request);
+		myResize(request->width, request->height);
+		_render_width = request->width;
+		_render_height = request->height;
+		buildFrameJobs();
+		runJobGraph();
+		drawFrame();
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, _serve_pixels[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER,
+				3 * request->width * request->height, 0, GL_STREAM_READ);
+		glReadPixels(0, 0, request->width, request->height, GL_RGB,
+				GL_UNSIGNED_BYTE, 0);
+	}
+	for (size_t i = 0; i < drawn.size(); i++) {
+		const RENDERREQUEST* request = &drawn[i].request;
+		size_t size = 3 * request->width * request->height;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, _serve_pixels[i]);
+		const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size,
+				GL_MAP_READ_BIT);
+		std::vector<unsigned char> pixels;
+		if (mapped) {
+			pixels.assign((const unsigned char*) mapped,
+					(const unsigned char*) mapped + size);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		queueRenderReply(&drawn[i], mapped ? &pixels : 0, start,
+				drawn.size());
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	recordServeStats(drawn, start);
 }
 
-void setUpDisplay() {
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glLoadIdentity();
-	gluLookAt(0.0f, 0.0f, 60.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f);
+/* --serve socket [--batch N] [--batch-wait MS] [--scene file] */
+int serveRenders(int* argc, char** argv) {
+	const char* path = argv[2];
+	const char* scene = 0;
+	for (int i = 3; i < *argc; i++) {
+		if (strcmp(argv[i], "--batch") == 0 && i + 1 < *argc) {
+			_serve_batch = std::max(1,
+					std::min(RENDER_MAX_BATCH, atoi(argv[++i])));
+		} else if (strcmp(argv[i], "--batch-wait") == 0 && i + 1 < *argc) {
+			_serve_batch_wait = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--scene") == 0 && i + 1 < *argc) {
+			scene = argv[++i];
+		}
+	}
+	initHeadlessContext(argc, argv);
+	if (!glInit()) {
+		return 1;
+	}
+	glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &_serve_max_size);
+	_serve_max_size = std::min(_serve_max_size, RENDER_MAX_SIZE);
+	initJobSystem();
+	readAll();
+	initSceneObjects();
+	if (scene && loadScene(scene) && !_extra_lights.empty()) {
+		_lighting_path = LIGHTING_PER_PIXEL;
+	}
+	setUpLighting();
+	captureViewState(&_serve_defaults);
+	signal(SIGPIPE, SIG_IGN);
+	int listener = openRenderSocket(path, true);
+	if (listener < 0) {
+		return 1;
+	}
+	printf("serving renders on %s, up to %d per batch\n", path, _serve_batch);
+	fflush(stdout);
+	std::thread(acceptRenderClients, listener).detach();
+	std::vector<RENDERJOB> batch;
+	for (;;) {
+		batch.clear();
+		{
+			std::unique_lock<std::mutex> lock(_serve_lock);
+			_serve_wake.wait(lock, [] {return !_serve_queue.empty();});
+			double deadline = _serve_queue.front().queued + _serve_batch_wait;
+			while ((int) _serve_queue.size() < _serve_batch
+					&& nowMs() < deadline) {
+				_serve_wake.wait_for(lock,
+						std::chrono::microseconds(
+								(long long) ((deadline - nowMs()) * 1000.0)));
+			}
+			while (!_serve_queue.empty() && (int) batch.size() < _serve_batch) {
+				batch.push_back(_serve_queue.front());
+				_serve_queue.pop_front();
+			}
+		}
+		renderBatch(batch);
+	}
+	return 0;
 }
 
-void cleanUpDisplay() {
-	glFlush();
-	glutSwapBuffers();
+void initRenderRequest(RENDERREQUEST* request, unsigned int id, int width,
+		int height) {
+	VIEWSTATE state;
+	captureViewState(&state);
+	memset(request, 0, sizeof(RENDERREQUEST));
+	request->magic = RENDER_MAGIC;
+	request->id = id;
+	request->width = width;
+	request->height = height;
+	memcpy(request->rotate, state.rotate, 3 * sizeof(float));
+	memcpy(request->translate, state.translate, 3 * sizeof(float));
+	request->scale = state.scale;
+	memcpy(request->light0, state.light0, 4 * sizeof(float));
+	memcpy(request->light1, state.light1, 4 * sizeof(float));
 }
 
-void drawLightSource1() {
-	glPushMatrix();
-	GLfloat emission[4] = { 1.0, 1.0, 1.0, 1.0 };
-	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat diffuse[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat shininess[4] = { 0.0, 0.0, 0.0, 1.0 };
-	if (_upper_light_color == UPPER_LIGHT_ORANGE) {
-		emission[0] = 1.0;
-		emission[1] = 0.5;
-		emission[2] = 0.0;
+/* bottom row first, as glReadPixels() returns it */
+bool writeRenderPPM(const char* file, const unsigned char* pixels, int width,
+		int height) {
+	FILE* out = fopen(file, "wb");
+	if (!out) {
+		perror(file);
+		return false;
 	}
-	glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emission);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, shininess);
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 25.0);
-	glTranslatef(_light1_pos[0], _light1_pos[1], _light1_pos[2]);
-	glutSolidSphere(1, 10, 10);
-	glPopMatrix();
+	fprintf(out, "P6\n%d %d\n255\n", width, height);
+	for (int y = height - 1; y >= 0; y--) {
+		fwrite(pixels + 3 * width * y, 1, 3 * width, out);
+	}
+	fclose(out);
+	return true;
 }
 
-void drawLightSource0() {
-	glPushMatrix();
-	GLfloat emission[4] = { 1.0, 1.0, 1.0, 1.0 };
-	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat diffuse[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat shininess[4] = { 0.0, 0.0, 0.0, 1.0 };
-	if (_front_light_color == FRONT_LIGHT_TURQUOISE) {
-			emission[0] = 0.0;
-			emission[1] = 1.0;
-			emission[2] = 1.0;
+/*
+ * --render-client socket N [--size WxH] [--in-flight K] [--out prefix]
+ * orbits the camera once in N requests, cycling through three light setups,
+ * with up to K requests outstanding
+ */
+int runRenderClient(int count, char** args) {
+	int total = atoi(args[1]);
+	int width = 320;
+	int height = 240;
+	int inFlight = RENDER_IN_FLIGHT;
+	const char* prefix = 0;
+	for (int i = 2; i < count; i++) {
+		if (strcmp(args[i], "--size") == 0 && i + 1 < count) {
+			sscanf(args[++i], "%dx%d", &width, &height);
+		} else if (strcmp(args[i], "--in-flight") == 0 && i + 1 < count) {
+			inFlight = std::max(1, atoi(args[++i]));
+		} else if (strcmp(args[i], "--out") == 0 && i + 1 < count) {
+			prefix = args[++i];
+		}
 	}
-	glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emission);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, shininess);
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 25.0);
-	glTranslatef(_light0_pos[0], _light0_pos[1], _light0_pos[2]);
-	glutSolidSphere(1, 10, 10);
-	glPopMatrix();
+	int fd = openRenderSocket(args[0], false);
+	if (fd < 0 || total < 1) {
+		return 1;
+	}
+	std::vector<double> sentAt(total);
+	std::vector<double> trips;
+	std::vector<unsigned char> pixels;
+	double queued = 0.0;
+	double batched = 0.0;
+	int refused = 0;
+	int sent = 0;
+	double start = nowMs();
+	while ((int) trips.size() + refused < total) {
+		while (sent < total && sent - (int) trips.size() - refused < inFlight) {
+			RENDERREQUEST request;
+			initRenderRequest(&request, sent, width, height);
+			request.rotate[1] = 360.0f * sent / total;
+			if (sent % 3 == 1) {
+				request.menu[0] = SPOT_LIGHT_OFF;
+				request.light0[0] = -request.light0[0];
+			} else if (sent % 3 == 2) {
+				request.menu[0] = POINT_LIGHT_OFF;
+				request.menu[1] = UPPER_LIGHT_ORANGE;
+			}
+			sentAt[sent++] = nowMs();
+			if (!sendAll(fd, &request, sizeof(request))) {
+				printf("render server closed the connection\n");
+				return 1;
+			}
+		}
+		RENDERREPLY reply;
+		if (!recvAll(fd, &reply, sizeof(reply)) || reply.magic != RENDER_MAGIC
+				|| reply.id >= (unsigned int) total) {
+			printf("render server closed the connection\n");
+			return 1;
+		}
+		if (reply.width == 0) {
+			refused++;
+			continue;
+		}
+		pixels.resize(3 * reply.width * reply.height);
+		if (!recvAll(fd, &pixels[0], pixels.size())) {
+			printf("render server closed the connection\n");
+			return 1;
+		}
+		trips.push_back(nowMs() - sentAt[reply.id]);
+		queued += reply.queueMs;
+		batched += reply.batch;
+		if (prefix) {
+			char file[PATH_MAX];
+			snprintf(file, sizeof(file), "%s%04u.ppm", prefix, reply.id);
+			writeRenderPPM(file, &pixels[0], reply.width, reply.height);
+		}
+	}
+	double seconds = (nowMs() - start) / 1000.0;
+	close(fd);
+	if (trips.empty()) {
+		printf("all %d requests refused\n", refused);
+		return 1;
+	}
+	std::sort(trips.begin(), trips.end());
+	double trip = 0.0;
+	for (size_t i = 0; i < trips.size(); i++) {
+		trip += trips[i];
+	}
+	printf("%d renders of %dx%d in %.2f s: %.1f renders/s, %d refused\n",
+			(int) trips.size(), width, height, seconds,
+			trips.size() / seconds, refused);
+	printf("round trip %.2f ms avg, %.2f ms p50, %.2f ms p95; server queue "
+			"%.2f ms avg, %.1f per batch\n", trip / trips.size(),
+			trips[trips.size() / 2], trips[trips.size() * 95 / 100],
+			queued / trips.size(), batched / trips.size());
+	return 0;
 }
+#endif
 
-void drawOrigin() {
-	if (_origin_visibility == ORIGIN_HIDDEN) {
+/*
+ * CPU lighting
+ *
+ * The fixed-function lighting display() sets up, evaluated on the CPU for
+ * baking, validation and as a fallback. initLightingSetup() takes every
+ * enabled light from the GL state cache, already in eye space, together
+ * with a modelview and a material. lightVertices() then transforms
+ * structure-of-arrays positions by the modelview and normals by its inverse
+ * transpose (normalized, as GL_NORMALIZE is always on). It writes the
+ * clamped Blinn-Phong colors for both sides of two-sided lighting, with a
+ * local viewer and the spot cutoff and exponent, 8 vertices at a time with
+ * AVX2 when the CPU has it. The global ambient and the attenuation stay at
+ * GL's defaults, as nothing here changes them.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LIGHTING_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+#define LIGHTING_BLOCK 8
+#define LIGHTING_CHUNK 65536
+#define LIGHT_MODEL_AMBIENT 0.2f
+
+typedef struct {
+	float position[4];
+	float direction[3];
+	float cosCutoff;
+	float exponent;
+	bool spot;
+	/* light color times material color */
+	float ambient[3];
+	float diffuse[3];
+	float specular[3];
+} CPULIGHT;
+
+typedef struct {
+	float modelview[16];
+	float normal[9];
+	float base[3];
+	float alpha;
+	float shininess;
+	int lights;
+	CPULIGHT light[CACHED_LIGHTS];
+} LIGHTINGSETUP;
+
+typedef struct {
+	const float* position[3];
+	const float* normal[3];
+} SOAVERTICES;
+
+/* eye may be 0; the alpha of every vertex is the setup's */
+typedef struct {
+	float* eye[3];
+	float* front[3];
+	float* back[3];
+} LITVERTICES;
+
+bool _lighting_avx2 = false;
+
+void initCpuLighting() {
+#ifdef LIGHTING_AVX2
+	_lighting_avx2 = __builtin_cpu_supports("avx2")
+			&& __builtin_cpu_supports("fma");
+#endif
+}
+
+const GLfloat* cachedLightParameter(int light, int parameter,
+		const GLfloat* fallback) {
+	const STATESLOT* slot = &_state[SLOT_LIGHT + light * LIGHT_PARAMETERS
+			+ parameter];
+	return slot->known ? slot->value : fallback;
+}
+
+/* reads the GL state cache, so the frame's lights have to be set up */
+void initLightingSetup(LIGHTINGSETUP* setup, const float* modelview,
+		const MATERIAL* material) {
+	static const GLfloat BLACK[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+	static const GLfloat WHITE[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	static const GLfloat POSITION[4] = { 0.0f, 0.0f, 1.0f, 0.0f };
+	static const GLfloat DIRECTION[3] = { 0.0f, 0.0f, -1.0f };
+	static const GLfloat CUTOFF = 180.0f;
+	static const GLfloat EXPONENT = 0.0f;
+	memcpy(setup->modelview, modelview, 16 * sizeof(float));
+	float inverse[16];
+	if (!matInvert(modelview, inverse)) {
+		matIdentity(inverse);
+	}
+	for (int row = 0; row < 3; row++) {
+		for (int col = 0; col < 3; col++) {
+			setup->normal[3 * row + col] = inverse[4 * row + col];
+		}
+	}
+	for (int c = 0; c < 3; c++) {
+		setup->base[c] = material->emission[c]
+				+ LIGHT_MODEL_AMBIENT * material->ambient[c];
+	}
+	setup->alpha = material->diffuse[3];
+	setup->shininess = material->shininess;
+	setup->lights = 0;
+	const STATESLOT* lighting = &_state[SLOT_CAP + CAP_LIGHTING];
+	if (!lighting->known || lighting->value[0] == 0.0f) {
 		return;
 	}
-	glPushMatrix();
-	GLfloat emission[4] = { 1.0, 0.8, 0.0, 1.0 };
-	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat diffuse[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat shininess[4] = { 0.0, 0.0, 0.0, 1.0 };
-	glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emission);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, shininess);
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 0.0);
-	glutSolidSphere(0.5, 10, 10);
-	glPopMatrix();
+	for (int l = 0; l < CACHED_LIGHTS; l++) {
+		const STATESLOT* enabled = &_state[SLOT_CAP + l];
+		if (!enabled->known || enabled->value[0] == 0.0f) {
+			continue;
+		}
+		CPULIGHT* light = &setup->light[setup->lights++];
+		const GLfloat* ambient = cachedLightParameter(l, LIGHT_AMBIENT, BLACK);
+		const GLfloat* diffuse = cachedLightParameter(l, LIGHT_DIFFUSE,
+				l == 0 ? WHITE : BLACK);
+		const GLfloat* specular = cachedLightParameter(l, LIGHT_SPECULAR,
+				l == 0 ? WHITE : BLACK);
+		for (int c = 0; c < 3; c++) {
+			light->ambient[c] = ambient[c] * material->ambient[c];
+			light->diffuse[c] = diffuse[c] * material->diffuse[c];
+			light->specular[c] = specular[c] * material->specular[c];
+		}
+		memcpy(light->position,
+				cachedLightParameter(l, LIGHT_POSITION, POSITION),
+				4 * sizeof(float));
+		const GLfloat* direction = cachedLightParameter(l, LIGHT_DIRECTION,
+				DIRECTION);
+		float length = sqrt(direction[0] * direction[0]
+				+ direction[1] * direction[1] + direction[2] * direction[2]);
+		for (int c = 0; c < 3; c++) {
+			light->direction[c] = length > 0.0f ? direction[c] / length : 0.0f;
+		}
+		float cutoff = *cachedLightParameter(l, LIGHT_CUTOFF, &CUTOFF);
+		light->spot = cutoff != 180.0f;
+		light->cosCutoff = cos(cutoff * PI / 180.0);
+		light->exponent = *cachedLightParameter(l, LIGHT_EXPONENT, &EXPONENT);
+	}
 }
 
-void drawObjects() {
-	glPushMatrix();
-	glTranslatef(_xdiff_translate / 10.0, _ydiff_translate / 10.0,
-			_zdiff_translate);
-	glScalef(_radius_diff_scale, _radius_diff_scale, _radius_diff_scale);
-	glRotatef(-_ydiff_rotate, 1.0f, 0.0f, 0.0f);
-	glRotatef(_xdiff_rotate, 0.0f, 1.0f, 0.0f);
-	glRotatef(_zdiff_rotate, 0.0f, 0.0f, 1.0f);
-	drawAllWithMode();
-	glPopMatrix();
+void normalize3(float* v) {
+	float length = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+	if (length > 0.0f) {
+		v[0] /= length;
+		v[1] /= length;
+		v[2] /= length;
+	}
 }
 
-void setUpLight1() {
-	glEnable(GL_LIGHT1);
-	glLightfv(GL_LIGHT1, GL_POSITION, _light1_pos);
-	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat diffuse[4] = { 1.0, 1.0, 1.0, 1.0 };
-	GLfloat specular[4] = { 1.0, 1.0, 1.0, 1.0 };
-	if (_upper_light_color == UPPER_LIGHT_ORANGE) {
-		diffuse[0] = specular[0] = 1.0;
-		diffuse[1] = specular[1] = 0.5;
-		diffuse[2] = specular[2] = 0.0;
+void lightVerticesScalar(const LIGHTINGSETUP* setup, const SOAVERTICES* in,
+		int first, int count, LITVERTICES* out) {
+	const float* m = setup->modelview;
+	const float* n = setup->normal;
+	for (int i = first; i < first + count; i++) {
+		float x = in->position[0][i];
+		float y = in->position[1][i];
+		float z = in->position[2][i];
+		float eye[3] = { m[0] * x + m[4] * y + m[8] * z + m[12], m[1] * x
+				+ m[5] * y + m[9] * z + m[13], m[2] * x + m[6] * y + m[10] * z
+				+ m[14] };
+		x = in->normal[0][i];
+		y = in->normal[1][i];
+		z = in->normal[2][i];
+		float normal[3] = { n[0] * x + n[1] * y + n[2] * z, n[3] * x + n[4] * y
+				+ n[5] * z, n[6] * x + n[7] * y + n[8] * z };
+		normalize3(normal);
+		float view[3] = { -eye[0], -eye[1], -eye[2] };
+		normalize3(view);
+		float front[3];
+		float back[3];
+		memcpy(front, setup->base, 3 * sizeof(float));
+		memcpy(back, setup->base, 3 * sizeof(float));
+		for (int l = 0; l < setup->lights; l++) {
+			const CPULIGHT* light = &setup->light[l];
+			float toLight[3];
+			for (int c = 0; c < 3; c++) {
+				toLight[c] = light->position[3] != 0.0f ?
+						light->position[c] - eye[c] : light->position[c];
+			}
+			normalize3(toLight);
+			float spot = 1.0f;
+			if (light->spot) {
+				float cosine = -(toLight[0] * light->direction[0]
+						+ toLight[1] * light->direction[1]
+						+ toLight[2] * light->direction[2]);
+				if (cosine < light->cosCutoff) {
+					continue;
+				}
+				spot = pow(cosine, light->exponent);
+			}
+			float half[3] = { toLight[0] + view[0], toLight[1] + view[1],
+					toLight[2] + view[2] };
+			normalize3(half);
+			float diffuse = normal[0] * toLight[0] + normal[1] * toLight[1]
+					+ normal[2] * toLight[2];
+			float specular = normal[0] * half[0] + normal[1] * half[1]
+					+ normal[2] * half[2];
+			float* side = diffuse > 0.0f ? front : back;
+			if (diffuse < 0.0f) {
+				diffuse = -diffuse;
+				specular = -specular;
+			}
+			if (diffuse > 0.0f) {
+				specular = pow(std::max(specular, 0.0f), setup->shininess);
+			}
+			for (int c = 0; c < 3; c++) {
+				front[c] += spot * light->ambient[c];
+				back[c] += spot * light->ambient[c];
+				if (diffuse > 0.0f) {
+					side[c] += spot * (diffuse * light->diffuse[c]
+							+ specular * light->specular[c]);
+				}
+			}
+		}
+		for (int c = 0; c < 3; c++) {
+			out->front[c][i] = std::min(std::max(front[c], 0.0f), 1.0f);
+			out->back[c][i] = std::min(std::max(back[c], 0.0f), 1.0f);
+			if (out->eye[0]) {
+				out->eye[c][i] = eye[c];
+			}
+		}
 	}
-	glLightfv(GL_LIGHT1, GL_AMBIENT, ambient);
-	glLightfv(GL_LIGHT1, GL_DIFFUSE, diffuse);
-	glLightfv(GL_LIGHT1, GL_SPECULAR, specular);
-	GLfloat direction[3] = { 0.0, -1.0, 0.0 };
-	glLightfv(GL_LIGHT1, GL_SPOT_DIRECTION, direction);
-	glLightf(GL_LIGHT1, GL_SPOT_CUTOFF, 80.0);
-	glLightf(GL_LIGHT1, GL_SPOT_EXPONENT, 0.0);
 }
 
-void setUpLight0() {
-	glEnable(GL_LIGHT0);
-	glLightfv(GL_LIGHT0, GL_POSITION, _light0_pos);
-	GLfloat ambient[4] = { 0.0, 0.0, 0.0, 1.0 };
-	GLfloat diffuse[4] = { 1.0, 1.0, 1.0, 1.0 };
-	GLfloat specular[4] = { 1.0, 1.0, 1.0, 1.0 };
-	if (_front_light_color == FRONT_LIGHT_TURQUOISE) {
-			diffuse[0] = specular[0] = 0.0;
-			diffuse[1] = specular[1] = 1.0;
-			diffuse[2] = specular[2] = 1.0;
-		}
-	glLightfv(GL_LIGHT0, GL_AMBIENT, ambient);
-	glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuse);
-	glLightfv(GL_LIGHT0, GL_SPECULAR, specular);
+#ifdef LIGHTING_AVX2
+/* log2 of x > 0: Cephes' logf polynomial on a mantissa in [0.71, 1.41] */
+LIGHTING_AVX2 __m256 log2Avx2(__m256 x) {
+	__m256i bits = _mm256_castps_si256(x);
+	__m256 exponent = _mm256_cvtepi32_ps(
+			_mm256_sub_epi32(_mm256_srli_epi32(bits, 23),
+					_mm256_set1_epi32(127)));
+	__m256 m = _mm256_castsi256_ps(
+			_mm256_or_si256(
+					_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+					_mm256_set1_epi32(0x3f800000)));
+	__m256 high = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356f), _CMP_GT_OQ);
+	m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), high);
+	exponent = _mm256_add_ps(exponent,
+			_mm256_and_ps(high, _mm256_set1_ps(1.0f)));
+	__m256 f = _mm256_sub_ps(m, _mm256_set1_ps(1.0f));
+	__m256 p = _mm256_set1_ps(7.0376836292e-2f);
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(-1.1514610310e-1f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.1676998740e-1f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(-1.2420140846e-1f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.4249322787e-1f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(-1.6668057665e-1f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(2.0000714765e-1f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(-2.4999993993e-1f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(3.3333331174e-1f));
+	__m256 z = _mm256_mul_ps(f, f);
+	__m256 ln = _mm256_fmadd_ps(_mm256_mul_ps(p, f), z,
+			_mm256_fnmadd_ps(_mm256_set1_ps(0.5f), z, f));
+	return _mm256_fmadd_ps(ln, _mm256_set1_ps(1.44269504f), exponent);
 }
 
-void setUpShading() {
-	if (_shading_model == FLAT_SHADING) {
-		glShadeModel(GL_FLAT);
-	} else if (_shading_model == SMOOTH_SHADING) {
-		glShadeModel(GL_SMOOTH);
-	}
-	glEnable(GL_NORMALIZE);
+/* 2^x: Cephes' exp2f polynomial on the fraction in [-0.5, 0.5] */
+LIGHTING_AVX2 __m256 exp2Avx2(__m256 x) {
+	x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-126.0f)),
+			_mm256_set1_ps(127.0f));
+	__m256 whole = _mm256_round_ps(x,
+			_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	__m256 f = _mm256_sub_ps(x, whole);
+	__m256 p = _mm256_set1_ps(1.535336188319500e-4f);
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.339887440266574e-3f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(9.618437357674640e-3f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(5.550332471162809e-2f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(2.402264791363012e-1f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(6.931472028550421e-1f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.0f));
+	__m256i scale = _mm256_slli_epi32(
+			_mm256_add_epi32(_mm256_cvtps_epi32(whole),
+					_mm256_set1_epi32(127)), 23);
+	return _mm256_mul_ps(p, _mm256_castsi256_ps(scale));
 }
 
-void display() {
-	setUpDisplay();
-	setUpShading();
-	drawObjects();
-	drawOrigin();
-	drawLightSource0();
-	drawLightSource1();
-	setUpLight0();
-	setUpLight1();
-	cleanUpDisplay();
+/* x^y for x >= 0 and y > 0 */
+LIGHTING_AVX2 __m256 powAvx2(__m256 x, float y) {
+	__m256 positive = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ);
+	__m256 result = exp2Avx2(
+			_mm256_mul_ps(log2Avx2(_mm256_max_ps(x, _mm256_set1_ps(1e-30f))),
+					_mm256_set1_ps(y)));
+	return _mm256_and_ps(result, positive);
 }
 
-void myGlutInit(int argc, char *argv[]) {
-	glutInit(&argc, argv);
-	glutInitWindowPosition(50, 50);
-	glutInitWindowSize(WIDTH, HEIGHT);
-	glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
-	_windowID = glutCreateWindow("3D Triangle Mesh Manipulation");
-	myCreateMenu();
-	glutDisplayFunc(display);
-	glutKeyboardFunc(keyboard);
-	glutSpecialFunc(specialKeyboard);
-	glutMouseFunc(mouse);
-	glutMotionFunc(mouseMotion);
-	glutReshapeFunc(myResize);
-	glutIdleFunc(idle);
+LIGHTING_AVX2 void normalizeAvx2(__m256* x, __m256* y, __m256* z) {
+	__m256 length = _mm256_sqrt_ps(
+			_mm256_fmadd_ps(*x, *x, _mm256_fmadd_ps(*y, *y,
+					_mm256_mul_ps(*z, *z))));
+	__m256 scale = _mm256_and_ps(
+			_mm256_div_ps(_mm256_set1_ps(1.0f), length),
+			_mm256_cmp_ps(length, _mm256_setzero_ps(), _CMP_GT_OQ));
+	*x = _mm256_mul_ps(*x, scale);
+	*y = _mm256_mul_ps(*y, scale);
+	*z = _mm256_mul_ps(*z, scale);
 }
 
-void readBrotherBlender() {
-	readRawMesh("brother_blender.raw", &_brother_blender_mesh);
+LIGHTING_AVX2 __m256 transformAvx2(const float* row, int stride, __m256 x,
+		__m256 y, __m256 z, float w) {
+	return _mm256_fmadd_ps(_mm256_set1_ps(row[0]), x,
+			_mm256_fmadd_ps(_mm256_set1_ps(row[stride]), y,
+					_mm256_fmadd_ps(_mm256_set1_ps(row[2 * stride]), z,
+							_mm256_set1_ps(w))));
 }
 
-void readBlenderMonkey() {
-	readRawMesh("blender_monkey.raw", &_blender_monkey_mesh);
+/* the same arithmetic as lightVerticesScalar(), lane by lane */
+LIGHTING_AVX2 void lightVerticesAvx2(const LIGHTINGSETUP* setup,
+		const SOAVERTICES* in, int first, int count, LITVERTICES* out) {
+	const float* m = setup->modelview;
+	const float* n = setup->normal;
+	__m256 zero = _mm256_setzero_ps();
+	__m256 one = _mm256_set1_ps(1.0f);
+	int i = first;
+	for (; i + LIGHTING_BLOCK <= first + count; i += LIGHTING_BLOCK) {
+		__m256 x = _mm256_loadu_ps(in->position[0] + i);
+		__m256 y = _mm256_loadu_ps(in->position[1] + i);
+		__m256 z = _mm256_loadu_ps(in->position[2] + i);
+		__m256 eye[3];
+		for (int c = 0; c < 3; c++) {
+			eye[c] = transformAvx2(m + c, 4, x, y, z, m[12 + c]);
+		}
+		x = _mm256_loadu_ps(in->normal[0] + i);
+		y = _mm256_loadu_ps(in->normal[1] + i);
+		z = _mm256_loadu_ps(in->normal[2] + i);
+		__m256 normal[3];
+		for (int c = 0; c < 3; c++) {
+			normal[c] = transformAvx2(n + 3 * c, 1, x, y, z, 0.0f);
+		}
+		normalizeAvx2(&normal[0], &normal[1], &normal[2]);
+		__m256 view[3];
+		for (int c = 0; c < 3; c++) {
+			view[c] = _mm256_sub_ps(zero, eye[c]);
+		}
+		normalizeAvx2(&view[0], &view[1], &view[2]);
+		__m256 front[3];
+		__m256 back[3];
+		for (int c = 0; c < 3; c++) {
+			front[c] = back[c] = _mm256_set1_ps(setup->base[c]);
+		}
+		for (int l = 0; l < setup->lights; l++) {
+			const CPULIGHT* light = &setup->light[l];
+			__m256 toLight[3];
+			for (int c = 0; c < 3; c++) {
+				toLight[c] = _mm256_set1_ps(light->position[c]);
+				if (light->position[3] != 0.0f) {
+					toLight[c] = _mm256_sub_ps(toLight[c], eye[c]);
+				}
+			}
+			normalizeAvx2(&toLight[0], &toLight[1], &toLight[2]);
+			__m256 spot = one;
+			if (light->spot) {
+				__m256 cosine = _mm256_sub_ps(zero,
+						_mm256_fmadd_ps(toLight[0],
+								_mm256_set1_ps(light->direction[0]),
+								_mm256_fmadd_ps(toLight[1],
+										_mm256_set1_ps(light->direction[1]),
+										_mm256_mul_ps(toLight[2],
+												_mm256_set1_ps(
+														light->direction[2])))));
+				__m256 inside = _mm256_cmp_ps(cosine,
+						_mm256_set1_ps(light->cosCutoff), _CMP_GE_OQ);
+				if (_mm256_movemask_ps(inside) == 0) {
+					continue;
+				}
+				if (light->exponent != 0.0f) {
+					spot = powAvx2(cosine, light->exponent);
+				}
+				spot = _mm256_and_ps(spot, inside);
+			}
+			__m256 half[3];
+			for (int c = 0; c < 3; c++) {
+				half[c] = _mm256_add_ps(toLight[c], view[c]);
+			}
+			normalizeAvx2(&half[0], &half[1], &half[2]);
+			__m256 diffuse = _mm256_fmadd_ps(normal[0], toLight[0],
+					_mm256_fmadd_ps(normal[1], toLight[1],
+							_mm256_mul_ps(normal[2], toLight[2])));
+			__m256 specular = _mm256_fmadd_ps(normal[0], half[0],
+					_mm256_fmadd_ps(normal[1], half[1],
+							_mm256_mul_ps(normal[2], half[2])));
+			__m256 facing = _mm256_cmp_ps(diffuse, zero, _CMP_GT_OQ);
+			__m256 away = _mm256_cmp_ps(diffuse, zero, _CMP_LT_OQ);
+			/* the side that faces the light sees |n.l| and |n.h| */
+			__m256 sign = _mm256_blendv_ps(one, _mm256_set1_ps(-1.0f), away);
+			diffuse = _mm256_mul_ps(diffuse, sign);
+			specular = _mm256_max_ps(_mm256_mul_ps(specular, sign), zero);
+			if (setup->shininess != 0.0f) {
+				specular = powAvx2(specular, setup->shininess);
+			} else {
+				specular = one;
+			}
+			__m256 lit = _mm256_or_ps(facing, away);
+			diffuse = _mm256_and_ps(_mm256_mul_ps(spot, diffuse), lit);
+			specular = _mm256_and_ps(_mm256_mul_ps(spot, specular), lit);
+			for (int c = 0; c < 3; c++) {
+				__m256 ambient = _mm256_mul_ps(spot,
+						_mm256_set1_ps(light->ambient[c]));
+				__m256 color = _mm256_fmadd_ps(diffuse,
+						_mm256_set1_ps(light->diffuse[c]),
+						_mm256_mul_ps(specular,
+								_mm256_set1_ps(light->specular[c])));
+				front[c] = _mm256_add_ps(front[c],
+						_mm256_add_ps(ambient, _mm256_and_ps(color, facing)));
+				back[c] = _mm256_add_ps(back[c],
+						_mm256_add_ps(ambient, _mm256_and_ps(color, away)));
+			}
+		}
+		for (int c = 0; c < 3; c++) {
+			_mm256_storeu_ps(out->front[c] + i,
+					_mm256_min_ps(_mm256_max_ps(front[c], zero), one));
+			_mm256_storeu_ps(out->back[c] + i,
+					_mm256_min_ps(_mm256_max_ps(back[c], zero), one));
+			if (out->eye[0]) {
+				_mm256_storeu_ps(out->eye[c] + i, eye[c]);
+			}
+		}
+	}
+	lightVerticesScalar(setup, in, i, first + count - i, out);
 }
+#endif
 
-void readRoomWalls() {
-	readRawMesh("room_walls.raw", &_room_walls_mesh);
+void lightVertices(const LIGHTINGSETUP* setup, const SOAVERTICES* in,
+		int first, int count, LITVERTICES* out) {
+#ifdef LIGHTING_AVX2
+	if (_lighting_avx2) {
+		lightVerticesAvx2(setup, in, first, count, out);
+		return;
+	}
+#endif
+	lightVerticesScalar(setup, in, first, count, out);
 }
 
-void readScene() {
-	readRawMesh("all.raw", &_scene_mesh);
+/*
+ * --bench-lighting [N]: checks both kernels against GL's own per-vertex
+ * colors for every object of the first frame, read back in feedback mode
+ * (points under a projection that clips nothing; a negated normal gives the
+ * back side), then times them on N vertices taken from those objects.
+ */
+typedef struct {
+	std::vector<float> data[6];
+	SOAVERTICES in;
+} SOABUFFER;
+
+typedef struct {
+	std::vector<float> data[9];
+	LITVERTICES out;
+} LITBUFFER;
+
+void resizeSoaBuffer(SOABUFFER* buffer, int count) {
+	for (int c = 0; c < 6; c++) {
+		buffer->data[c].resize(count);
+	}
+	for (int c = 0; c < 3; c++) {
+		buffer->in.position[c] = &buffer->data[c][0];
+		buffer->in.normal[c] = &buffer->data[3 + c][0];
+	}
 }
 
-void readTables() {
-	readRawMesh("tables.raw", &_tables_mesh);
+void resizeLitBuffer(LITBUFFER* buffer, int count) {
+	for (int c = 0; c < 9; c++) {
+		buffer->data[c].resize(count);
+	}
+	for (int c = 0; c < 3; c++) {
+		buffer->out.eye[c] = &buffer->data[c][0];
+		buffer->out.front[c] = &buffer->data[3 + c][0];
+		buffer->out.back[c] = &buffer->data[6 + c][0];
+	}
 }
 
-void readLampBases() {
-	readRawMesh("lamp_bases.raw", &_lamp_bases_mesh);
+/* GL_N3F_V3F to structure of arrays */
+void appendSmoothStream(const MESHSTREAMS* streams, SOABUFFER* buffer,
+		int* count) {
+	const float* v = &streams->smooth[0];
+	for (int i = 0; i < streams->smoothVertices; i++, (*count)++) {
+		for (int c = 0; c < 3; c++) {
+			buffer->data[3 + c][*count] = v[6 * i + c];
+			buffer->data[c][*count] = v[6 * i + 3 + c];
+		}
+	}
 }
 
-void readLampPoint() {
-	readRawMesh("lamp_point.raw", &_lamp_point_mesh);
+bool feedbackLighting(const float* modelview, const SOAVERTICES* in,
+		int count, float sign, std::vector<GLfloat>& colors) {
+	std::vector<GLfloat> buffer(8 * count);
+	glFeedbackBuffer(buffer.size(), GL_3D_COLOR, &buffer[0]);
+	glRenderMode(GL_FEEDBACK);
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glOrtho(-1e6, 1e6, -1e6, 1e6, -1e6, 1e6);
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadMatrixf(modelview);
+	glBegin(GL_POINTS);
+	for (int i = 0; i < count; i++) {
+		glNormal3f(sign * in->normal[0][i], sign * in->normal[1][i],
+				sign * in->normal[2][i]);
+		glVertex3f(in->position[0][i], in->position[1][i],
+				in->position[2][i]);
+	}
+	glEnd();
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	if (glRenderMode(GL_RENDER) != 8 * count) {
+		return false;
+	}
+	colors.resize(3 * count);
+	for (int i = 0; i < count; i++) {
+		memcpy(&colors[3 * i], &buffer[8 * i + 4], 3 * sizeof(GLfloat));
+	}
+	return true;
 }
 
-void readLampSpotlight() {
-	readRawMesh("lamp_spotlight.raw", &_lamp_spotlight_mesh);
+void compareLighting(const std::vector<GLfloat>& expected,
+		float* const* colors, int count, double* maxError,
+		double* sumError) {
+	for (int i = 0; i < count; i++) {
+		for (int c = 0; c < 3; c++) {
+			double error = fabs(expected[3 * i + c] - colors[c][i]);
+			*maxError = std::max(*maxError, error);
+			*sumError += error;
+		}
+	}
 }
 
-void readAll() {
-	readBrotherBlender();
-	readBlenderMonkey();
-	readRoomWalls();
-	readTables();
-	readLampBases();
-	readLampPoint();
-	readLampSpotlight();
-	readOFFMesh("inputmesh_sample.off");
+LIGHTINGSETUP _bench_lighting_setup;
+SOABUFFER _bench_lighting_in;
+LITBUFFER _bench_lighting_out;
+int _bench_lighting_count = 0;
+int _bench_lighting_chunk = LIGHTING_CHUNK;
+
+void jobLightVertices(int chunk) {
+	int first = chunk * _bench_lighting_chunk;
+	lightVertices(&_bench_lighting_setup, &_bench_lighting_in.in, first,
+			std::min(_bench_lighting_chunk, _bench_lighting_count - first),
+			&_bench_lighting_out.out);
 }
 
-void setUpLighting() {
-	glLightModeli(GL_LIGHT_MODEL_LOCAL_VIEWER, GL_TRUE);
-	glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
-	glEnable(GL_LIGHTING);
+double timeLighting(int path, int repeats) {
+	double best = 1e30;
+	for (int r = 0; r < repeats; r++) {
+		double start = nowMs();
+		if (path == 0) {
+			lightVerticesScalar(&_bench_lighting_setup, &_bench_lighting_in.in,
+					0, _bench_lighting_count, &_bench_lighting_out.out);
+		} else if (path == 1) {
+			lightVertices(&_bench_lighting_setup, &_bench_lighting_in.in, 0,
+					_bench_lighting_count, &_bench_lighting_out.out);
+		} else {
+			int chunks = (_bench_lighting_count + _bench_lighting_chunk - 1)
+					/ _bench_lighting_chunk;
+			for (int i = 0; i < chunks; i++) {
+				addJob("light vertices", jobLightVertices, i);
+			}
+			runJobGraph();
+		}
+		best = std::min(best, nowMs() - start);
+	}
+	return best;
+}
+
+int benchLighting(int* argc, char** argv) {
+	int total = *argc > 2 ? atoi(argv[2]) : 4000000;
+	initHeadlessContext(argc, argv);
+	if (!glInit()) {
+		return 1;
+	}
+	/* a surfaceless context has no framebuffer of its own */
+	if (!resizeServeTarget(WIDTH, HEIGHT)) {
+		return 1;
+	}
+	initCpuLighting();
+	initJobSystem();
+	readAll();
+	initSceneObjects();
+	setUpLighting();
+	initViewState();
+	myResize(WIDTH, HEIGHT);
+	buildFrameJobs();
+	runJobGraph();
+	setUpDisplay();
+	setUpShading();
+	setUpLight0();
+	setUpLight1();
+	setUpRoomLights();
+	const char* PATHS[2] = { "scalar", "avx2" };
+	int paths = _lighting_avx2 ? 2 : 1;
+	double maxError[2][2] = { { 0.0, 0.0 }, { 0.0, 0.0 } };
+	double sumError[2][2] = { { 0.0, 0.0 }, { 0.0, 0.0 } };
+	int checked = 0;
+	int objects = 0;
+	int vertices = 0;
+	for (int i = 0; i < _draw_count; i++) {
+		const DRAWCOMMAND* command = &_commands[i];
+		MESHSTREAMS* streams = getObjectStreams(&_objects[command->object]);
+		if (!streams || streams->smoothVertices == 0) {
+			continue;
+		}
+		int count = streams->smoothVertices;
+		SOABUFFER soa;
+		resizeSoaBuffer(&soa, count);
+		int appended = 0;
+		appendSmoothStream(streams, &soa, &appended);
+		applyLightMask(command->lights);
+		applyMaterial(&command->material);
+		float modelview[16];
+		matMultiply(_frame_view, command->model, modelview);
+		LIGHTINGSETUP setup;
+		initLightingSetup(&setup, modelview, &command->material);
+		std::vector<GLfloat> expected[2];
+		if (!feedbackLighting(modelview, &soa.in, count, 1.0f, expected[0])
+				|| !feedbackLighting(modelview, &soa.in, count, -1.0f,
+						expected[1])) {
+			printf("feedback mode returned too few vertices\n");
+			return 1;
+		}
+		LITBUFFER lit;
+		resizeLitBuffer(&lit, count);
+		for (int p = 0; p < paths; p++) {
+			if (p == 0) {
+				lightVerticesScalar(&setup, &soa.in, 0, count, &lit.out);
+			} else {
+				lightVertices(&setup, &soa.in, 0, count, &lit.out);
+			}
+			compareLighting(expected[0], lit.out.front, count, &maxError[p][0],
+					&sumError[p][0]);
+			compareLighting(expected[1], lit.out.back, count, &maxError[p][1],
+					&sumError[p][1]);
+		}
+		checked += count;
+		objects++;
+		vertices += count;
+		if (objects == 1 || setup.lights > _bench_lighting_setup.lights) {
+			_bench_lighting_setup = setup;
+		}
+	}
+	if (checked == 0) {
+		printf("nothing to light\n");
+		return 1;
+	}
+	printf("lighting check: %d vertices of %d objects against GL feedback\n",
+			checked, objects);
+	for (int p = 0; p < paths; p++) {
+		printf("    %-6s front %.2e max %.2e mean, back %.2e max %.2e mean "
+				"(%.3f 8 bit steps)\n", PATHS[p], maxError[p][0],
+				sumError[p][0] / (3.0 * checked), maxError[p][1],
+				sumError[p][1] / (3.0 * checked),
+				255.0 * std::max(maxError[p][0], maxError[p][1]));
+	}
+
+	/* the first frame's objects, repeated up to N vertices */
+	SOABUFFER pool;
+	resizeSoaBuffer(&pool, vertices);
+	int pooled = 0;
+	for (int i = 0; i < _draw_count; i++) {
+		MESHSTREAMS* streams = getObjectStreams(&_objects[_commands[i].object]);
+		if (streams && streams->smoothVertices > 0) {
+			appendSmoothStream(streams, &pool, &pooled);
+		}
+	}
+	_bench_lighting_count = std::max(total, LIGHTING_BLOCK);
+	resizeSoaBuffer(&_bench_lighting_in, _bench_lighting_count);
+	resizeLitBuffer(&_bench_lighting_out, _bench_lighting_count);
+	for (int c = 0; c < 6; c++) {
+		for (int i = 0; i < _bench_lighting_count; i++) {
+			_bench_lighting_in.data[c][i] = pool.data[c][i % pooled];
+		}
+	}
+	_bench_lighting_chunk = std::max(LIGHTING_CHUNK,
+			(_bench_lighting_count + MAX_JOBS - 1) / MAX_JOBS);
+	printf("lighting: %d vertices, %d lights, shininess %g\n",
+			_bench_lighting_count, _bench_lighting_setup.lights,
+			_bench_lighting_setup.shininess);
+	double scalar = timeLighting(0, 3);
+	for (int p = 0; p < paths + 1; p++) {
+		double ms = p == 0 ? scalar : timeLighting(p, 3);
+		char name[32];
+		if (p < paths) {
+			snprintf(name, sizeof(name), "%s", PATHS[p]);
+		} else {
+			snprintf(name, sizeof(name), "%s x%d workers", PATHS[paths - 1],
+					_worker_count);
+		}
+		printf("    %-18s %8.2f ms %8.1f Mvertices/s %6.2fx\n", name, ms,
+				_bench_lighting_count / ms / 1000.0, scalar / ms);
+	}
+	return 0;
 }
 
+/*
+ * Command line:
+ * --convert-chunked in.raw out.chk   convert for out-of-core viewing, exit
+ * --chunked file.chk                 stream a converted mesh into the room
+ * --budget MB                        resident memory for streamed chunks
+ * --bench-load mesh.raw|mesh.off...  compare ASCII and binary load times
+ * --analyze [--cache N] [--crease DEG] [--json out.json] mesh...
+ *                                    report topology, vertex cache efficiency
+ *                                    and memory of meshes, exit
+ * --crease DEG                       split smooth normals at edges sharper than
+ *                                    DEG degrees (40)
+ * --point-budget N                   at most N points a frame in point mode
+ * --lights N                         add N range-limited lamps to the room
+ *                                    (drawn with per-pixel lighting)
+ * --frame-budget MS                  scale the resolution to hold MS per frame
+ * --bench-primitives N               time N cached spheres against GLUT's, exit
+ * --generate-scene out COLUMNS ROWS INSTANCES LIGHTS [SEED]
+ *                                    write a tiled stress test scene, exit
+ * --scene file                       add a generated scene to the room
+ * --mesh file                        add a RAW, OFF, PLY or STL mesh to the
+ *                                    room
+ * --bench-scene file [FRAMES] [out.csv]
+ *                                    time its frame jobs headless, exit
+ * --serve socket [--batch N] [--batch-wait MS] [--scene file]
+ *                                    render requests from a Unix socket
+ *                                    (not on Windows)
+ * --render-client socket N [--size WxH] [--in-flight K] [--out prefix]
+ *                                    send N test requests to --serve, exit
+ * --bench-lighting [N]               check the CPU lighting against GL, time
+ *                                    it on N vertices, exit
+ * --record trace                     log the session's input to a trace file
+ * --replay trace [--fast] [--timings out.csv]
+ *                                    play a trace back, print frame times, exit
+ */
 int main(int argc, char *argv[]) {
-	myGlutInit(argc, argv);
+	if (argc == 4 && strcmp(argv[1], "--convert-chunked") == 0) {
+		return convertToChunked(argv[2], argv[3]);
+	}
+	if (argc >= 3 && strcmp(argv[1], "--bench-load") == 0) {
+		return benchLoad(argc - 2, argv + 2);
+	}
+	if (argc >= 3 && strcmp(argv[1], "--analyze") == 0) {
+		return analyzeMeshes(argc - 2, argv + 2);
+	}
+#ifndef _WIN32
+	if (argc >= 3 && strcmp(argv[1], "--serve") == 0) {
+		return serveRenders(&argc, argv);
+	}
+	if (argc >= 4 && strcmp(argv[1], "--render-client") == 0) {
+		return runRenderClient(argc - 2, argv + 2);
+	}
+#endif
+	if (argc >= 2 && strcmp(argv[1], "--bench-lighting") == 0) {
+		return benchLighting(&argc, argv);
+	}
+	if (argc >= 3 && strcmp(argv[1], "--bench-scene") == 0) {
+		return benchScene(argv[2], argc > 3 ? atoi(argv[3]) : 360,
+				argc > 4 ? argv[4] : 0);
+	}
+	if (argc >= 7 && strcmp(argv[1], "--generate-scene") == 0) {
+		initJobSystem();
+		readAll();
+		return generateScene(argv[2], atoi(argv[3]), atoi(argv[4]),
+				atoi(argv[5]), atoi(argv[6]), argc > 7 ? atoi(argv[7]) : 459);
+	}
+	myGlutInit(&argc, argv);
 	if (!glInit()) {
 		return 1;
 	}
+	if (argc == 3 && strcmp(argv[1], "--bench-primitives") == 0) {
+		benchPrimitives(atoi(argv[2]));
+		return 0;
+	}
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--crease") == 0 && i + 1 < argc) {
+			_crease_angle = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--point-budget") == 0 && i + 1 < argc) {
+			_point_budget = atoll(argv[++i]);
+		}
+	}
+	initJobSystem();
 	readAll();
+	initViewState();
+	initSceneObjects();
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc
+				&& loadScene(argv[++i]) && !_extra_lights.empty()) {
+			_lighting_path = LIGHTING_PER_PIXEL;
+		} else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc
+				&& !addMeshInstance(argv[++i])) {
+			return 65;
+		}
+	}
+	initPicking();
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+			_stream_budget_mb = atoll(argv[++i]);
+		}
+	}
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--chunked") == 0 && i + 1 < argc) {
+			_streamed_mesh = openChunkedMesh(argv[++i],
+					_stream_budget_mb * 1048576);
+		}
+	}
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--frame-budget") == 0 && i + 1 < argc) {
+			_frame_budget_ms = atof(argv[++i]);
+			_dynamic_resolution = true;
+		}
+	}
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc) {
+			addExtraLights(atoi(argv[++i]));
+			_lighting_path = LIGHTING_PER_PIXEL;
+		}
+	}
 	setUpLighting();
+	bool fast = false;
+	const char* timings = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--fast") == 0) {
+			fast = true;
+		} else if (strcmp(argv[i], "--timings") == 0 && i + 1 < argc) {
+			timings = argv[++i];
+		}
+	}
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			startRecording(argv[++i]);
+		} else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			startReplay(argv[++i], fast, timings);
+		}
+	}
+	if (_replaying) {
+		initViewState();
+	} else {
+		startInputThread();
+	}
 	glutMainLoop();
 	return 0;
 }